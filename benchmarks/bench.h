@@ -0,0 +1,168 @@
+// bench.h - Minimal timing helpers shared by the benchmark kernels
+//
+// Every kernel program prints one line per measurement in the form
+//   BENCH <name> <ns_per_iter> <checksum>
+// so the driver scripts can compare plain and obfuscated builds with awk.
+// With OBF_BENCH_PERF=1 (Linux) each measurement is followed by
+//   PERF <name> <cycles> <instructions> <branch_misses> <l1i_misses>
+//        <itlb_misses> <stalled_frontend> <stalled_backend>
+// per iteration, from perf_event_open; see run_perf_bench.sh.
+
+#ifndef OBF_BENCH_H
+#define OBF_BENCH_H
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace bench {
+
+// Keep the optimizer from deleting a kernel whose result is otherwise unused.
+template <typename T>
+inline void doNotOptimize(const T &value) {
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+// User-space hardware counters over all timed rounds of one run(). Every
+// event is opened on its own, so an event the CPU or hypervisor lacks only
+// prints "-" instead of disabling the rest; when the kernel multiplexes
+// them, counts are scaled up to the whole time the counter was enabled.
+class PerfCounters {
+public:
+    static const int NumEvents = 7;
+
+    PerfCounters() {
+        for (int e = 0; e < NumEvents; e++) {
+            fds[e] = -1;
+        }
+#ifdef __linux__
+        const char *env = std::getenv("OBF_BENCH_PERF");
+        if (!env || env[0] == '\0' || env[0] == '0') {
+            return;
+        }
+        const uint64_t cacheMissRead = (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        const struct {
+            uint32_t type;
+            uint64_t config;
+        } events[NumEvents] = {
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+            {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1I | cacheMissRead},
+            {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_ITLB | cacheMissRead},
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_STALLED_CYCLES_FRONTEND},
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_STALLED_CYCLES_BACKEND},
+        };
+        active = true;
+        for (int e = 0; e < NumEvents; e++) {
+            struct perf_event_attr attr = {};
+            attr.size = sizeof(attr);
+            attr.type = events[e].type;
+            attr.config = events[e].config;
+            attr.disabled = 1;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+            fds[e] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        }
+#endif
+    }
+
+    ~PerfCounters() {
+#ifdef __linux__
+        for (int e = 0; e < NumEvents; e++) {
+            if (fds[e] >= 0) {
+                close(fds[e]);
+            }
+        }
+#endif
+    }
+
+    void start() {
+#ifdef __linux__
+        for (int e = 0; e < NumEvents; e++) {
+            if (fds[e] >= 0) {
+                ioctl(fds[e], PERF_EVENT_IOC_RESET, 0);
+                ioctl(fds[e], PERF_EVENT_IOC_ENABLE, 0);
+            }
+        }
+#endif
+    }
+
+    void stop() {
+#ifdef __linux__
+        for (int e = 0; e < NumEvents; e++) {
+            if (fds[e] >= 0) {
+                ioctl(fds[e], PERF_EVENT_IOC_DISABLE, 0);
+            }
+        }
+#endif
+    }
+
+    void print(const char *name, double iters) {
+        if (!active) {
+            return;
+        }
+        std::printf("PERF %s", name);
+        for (int e = 0; e < NumEvents; e++) {
+            uint64_t values[3] = {0, 0, 0}; // count, time enabled, time running
+#ifdef __linux__
+            if (fds[e] < 0 || read(fds[e], values, sizeof(values)) != (ssize_t)sizeof(values) || values[2] == 0) {
+                std::printf(" -");
+                continue;
+            }
+#endif
+            double count = values[0] * ((double)values[1] / values[2]);
+            std::printf(" %.3f", count / iters);
+        }
+        std::printf("\n");
+    }
+
+private:
+    int fds[NumEvents];
+    bool active = false;
+};
+
+// Run fn() `iters` times after a short warm-up and report the best of
+// `repeats` rounds. The checksum is the value returned by the last call and
+// lets the driver confirm both builds computed the same thing. Hardware
+// counters, when enabled, cover all rounds.
+template <typename Fn>
+void run(const char *name, Fn fn, int iters, int repeats = 5) {
+    uint64_t checksum = 0;
+    for (int i = 0; i < iters / 10 + 1; i++) {
+        checksum = fn();
+    }
+
+    PerfCounters counters;
+    double best = 1e300;
+    counters.start();
+    for (int r = 0; r < repeats; r++) {
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < iters; i++) {
+            checksum = fn();
+            doNotOptimize(checksum);
+        }
+        auto end = std::chrono::steady_clock::now();
+        double ns = std::chrono::duration<double, std::nano>(end - start).count() / iters;
+        if (ns < best) {
+            best = ns;
+        }
+    }
+    counters.stop();
+
+    std::printf("BENCH %s %.2f %llu\n", name, best, (unsigned long long)checksum);
+    counters.print(name, (double)iters * repeats);
+}
+
+} // namespace bench
+
+#endif // OBF_BENCH_H
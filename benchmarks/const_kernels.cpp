@@ -0,0 +1,70 @@
+// const_kernels.cpp - Constant-heavy loops used by run_const_bench.sh to
+// check that encoded constants are decoded once per call, not once per
+// iteration.
+//
+// Every kernel runs at two trip counts. The driver fits time = a + b * n per
+// build: b is the cost per iteration, a the fixed cost per call.
+
+#include "bench.h"
+#include <cstdint>
+#include <vector>
+
+static const int Short = 256;
+static const int Long = 4096;
+
+// Bitwise CRC-32 step: polynomial, masks and the final xor are immediates.
+__attribute__((noinline)) uint64_t crc32(const uint8_t *data, int n) {
+    uint32_t crc = 0xFFFFFFFFu;
+    for (int i = 0; i < n; i++) {
+        crc ^= data[i];
+        for (int k = 0; k < 8; k++) {
+            crc = (crc >> 1) ^ (0xEDB88320u & (0u - (crc & 1)));
+        }
+    }
+    return crc ^ 0xFFFFFFFFu;
+}
+
+// Mixing with add/xor/and constants, as in hash finalizers.
+__attribute__((noinline)) uint64_t mix(const uint32_t *data, int n) {
+    uint64_t acc = 0x9E3779B97F4A7C15ull;
+    for (int i = 0; i < n; i++) {
+        acc ^= data[i] + 0x7F4A7C15u;
+        acc = (acc + 0x632BE59BD9B4E019ull) ^ (acc >> 29);
+        acc &= 0x0FFFFFFFFFFFFFFFull;
+    }
+    return acc;
+}
+
+// Range classification against several thresholds.
+__attribute__((noinline)) uint64_t classify(const uint32_t *data, int n) {
+    uint64_t buckets = 0;
+    for (int i = 0; i < n; i++) {
+        uint32_t v = data[i] & 0xFFFFu;
+        if (v < 1000) {
+            buckets += 3;
+        } else if (v < 20000) {
+            buckets += 17;
+        } else if (v > 60000) {
+            buckets += 1000003;
+        }
+    }
+    return buckets;
+}
+
+int main() {
+    std::vector<uint32_t> data(Long);
+    uint32_t seed = 12345;
+    for (int i = 0; i < Long; i++) {
+        seed = seed * 1103515245u + 12345u;
+        data[i] = seed >> 8;
+    }
+    const uint8_t *bytes = reinterpret_cast<const uint8_t*>(data.data());
+
+    bench::run("crc32@256", [&] { return crc32(bytes, Short); }, 200000);
+    bench::run("crc32@4096", [&] { return crc32(bytes, Long); }, 20000);
+    bench::run("mix@256", [&] { return mix(data.data(), Short); }, 200000);
+    bench::run("mix@4096", [&] { return mix(data.data(), Long); }, 20000);
+    bench::run("classify@256", [&] { return classify(data.data(), Short); }, 200000);
+    bench::run("classify@4096", [&] { return classify(data.data(), Long); }, 20000);
+    return 0;
+}
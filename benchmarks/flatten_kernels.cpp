@@ -0,0 +1,87 @@
+// flatten_kernels.cpp - Branchy kernels used by run_flatten_bench.sh to
+// measure what each control-flow flattening dispatcher costs per transition.
+
+#include "bench.h"
+#include <cstdint>
+#include <vector>
+
+static const int N = 4096;
+
+// Two-way branch with a fixed pattern: the plain build predicts it
+// perfectly, so any slowdown is dispatch overhead plus the misses the
+// dispatcher itself introduces.
+__attribute__((noinline)) uint64_t predictable(const uint32_t *data) {
+    uint64_t acc = 0;
+    for (int i = 0; i < N; i++) {
+        if (i & 1) {
+            acc += data[i];
+        } else {
+            acc ^= data[i] << 1;
+        }
+    }
+    return acc;
+}
+
+// Same shape on random data: the plain build already mispredicts about half
+// of the branches.
+__attribute__((noinline)) uint64_t unpredictable(const uint32_t *data) {
+    uint64_t acc = 0;
+    for (int i = 0; i < N; i++) {
+        if (data[i] & 1) {
+            acc += data[i];
+        } else {
+            acc ^= data[i] << 1;
+        }
+    }
+    return acc;
+}
+
+// Small tokenizer state machine: many blocks and a switch per element.
+__attribute__((noinline)) uint64_t stateMachine(const uint8_t *text) {
+    int state = 0;
+    uint64_t tokens = 0;
+    for (int i = 0; i < N; i++) {
+        uint8_t c = text[i];
+        switch (state) {
+        case 0:
+            if (c < 64) {
+                state = 1;
+            } else if (c < 128) {
+                state = 2;
+            }
+            break;
+        case 1:
+            if (c >= 64) {
+                tokens++;
+                state = 0;
+            }
+            break;
+        case 2:
+            if (c < 32) {
+                tokens += 2;
+                state = 3;
+            }
+            break;
+        default:
+            state = c & 1;
+            break;
+        }
+    }
+    return tokens;
+}
+
+int main() {
+    std::vector<uint32_t> data(N);
+    std::vector<uint8_t> text(N);
+    uint32_t seed = 12345;
+    for (int i = 0; i < N; i++) {
+        seed = seed * 1103515245u + 12345u;
+        data[i] = seed >> 8;
+        text[i] = (uint8_t)(seed >> 16);
+    }
+
+    bench::run("predictable", [&] { return predictable(data.data()); }, 20000);
+    bench::run("unpredictable", [&] { return unpredictable(data.data()); }, 20000);
+    bench::run("state_machine", [&] { return stateMachine(text.data()); }, 20000);
+    return 0;
+}
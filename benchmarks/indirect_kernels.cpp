@@ -0,0 +1,62 @@
+// indirect_kernels.cpp - Call- and branch-heavy loops used by
+// run_indirect_bench.sh to measure what routing through the encoded target
+// table costs per call.
+//
+// Every benchmark iteration makes Calls calls to a small noinline function,
+// so the driver divides the time difference by Calls to get the cost of one
+// routed call (and, for classify, of its routed branches).
+
+#include "bench.h"
+#include <cstdint>
+#include <vector>
+
+static const int Calls = 1024;
+
+// A call whose body is a couple of cycles, so the call itself dominates.
+__attribute__((noinline)) uint64_t step(uint64_t acc, uint32_t v) {
+    return (acc ^ v) * 0x9E3779B97F4A7C15ull;
+}
+
+// Branch chain outside any loop: these are the branches -indirect-branches
+// routes. The inputs make every outcome common.
+__attribute__((noinline)) uint64_t classify(uint32_t v) {
+    if (v < 1000) {
+        return 3;
+    }
+    if (v < 20000) {
+        return v >> 3;
+    }
+    if (v > 60000) {
+        return v * 5;
+    }
+    return 0;
+}
+
+__attribute__((noinline)) uint64_t callLoop(const uint32_t *data) {
+    uint64_t acc = 0;
+    for (int i = 0; i < Calls; i++) {
+        acc = step(acc, data[i]);
+    }
+    return acc;
+}
+
+__attribute__((noinline)) uint64_t classifyLoop(const uint32_t *data) {
+    uint64_t acc = 0;
+    for (int i = 0; i < Calls; i++) {
+        acc += classify(data[i]);
+    }
+    return acc;
+}
+
+int main() {
+    std::vector<uint32_t> data(Calls);
+    uint32_t seed = 12345;
+    for (int i = 0; i < Calls; i++) {
+        seed = seed * 1103515245u + 12345u;
+        data[i] = (seed >> 8) & 0xFFFF;
+    }
+
+    bench::run("calls", [&] { return callLoop(data.data()); }, 20000);
+    bench::run("classify", [&] { return classifyLoop(data.data()); }, 20000);
+    return 0;
+}
@@ -0,0 +1,177 @@
+#!/bin/bash
+# run_fuzz.sh - Differential fuzzing of the obfuscator: correctness bugs and
+# performance cliffs from the same random programs.
+#
+#   run_fuzz.sh [count] [first-seed]     (default: 100 programs from seed 1)
+#
+# Every seed becomes a C program (obfuscator_pass/tools/obf-fuzzgen.cpp)
+# that is built once with clang++ -O2 and once per configuration below
+# with the obfuscate CLI. opt verifies the module after the pass, so IR the
+# verifier rejects fails the build. Each obfuscated program must print the
+# same output and exit with the same status as the plain one. A run is
+#   ok        same behavior
+#   verify    opt reported a broken module
+#   crash     obfuscate failed otherwise (assertion, crash, link error)
+#   mismatch  different output or exit status
+#   timeout   ran longer than FUZZ_TIMEOUT seconds
+# and the obfuscated / plain run time is recorded for every ok run. Runs
+# more than FUZZ_CLIFF times slower than their configuration's geometric
+# mean are listed as cliffs. Every configuration is obfuscated with
+# --seed set to the program's seed, so the output is the same on every
+# run. Failing programs and their logs are kept in build/fuzz/failures/ to
+# reproduce with the printed command.
+#
+# Environment:
+#   OBF_ARGS      extra CLI flags for every configuration
+#   FUZZ_TIMEOUT  seconds per run (default 20)
+#   FUZZ_CLIFF    cliff threshold (default 4)
+#   FUZZ_RUNS     runs per binary, the fastest counts (default 3)
+#   FUZZ_WORK     obf-fuzzgen work per program (default: its own)
+#
+# Exit status: 0 when every run is ok, 1 otherwise. Cliffs are reported but
+# do not fail the run.
+
+set -e
+
+cd "$(dirname "$0")/.."
+
+OUT=build/fuzz
+COUNT=${1:-100}
+FIRST=${2:-1}
+FUZZ_TIMEOUT=${FUZZ_TIMEOUT:-20}
+FUZZ_CLIFF=${FUZZ_CLIFF:-4}
+FUZZ_RUNS=${FUZZ_RUNS:-3}
+
+# name|flags. f1 and f2 exist in every generated program.
+CONFIGS=(
+    "low|-l low"
+    "medium|-l medium"
+    "high|-l high"
+    "flat-ibr|-l high --flatten-dispatch indirectbr --indirect-branches"
+    "vm|-l low --virtualize f1,f2"
+)
+
+if [ ! -x ./obfuscate ] || [ ! -f ./obfuscator_pass/build/ObfuscatorPass.so ]; then
+    echo "Error: obfuscate or ObfuscatorPass.so not found, run ./setup.sh first"
+    exit 1
+fi
+
+mkdir -p $OUT/failures
+clang++ -O2 -std=c++17 obfuscator_pass/tools/obf-fuzzgen.cpp -o $OUT/obf-fuzzgen
+
+now_ns() {
+    date +%s%N
+}
+
+# run <binary> <output file>: fastest of FUZZ_RUNS runs in ns, or "timeout".
+# The exit status is appended to the output.
+run() {
+    best=
+    for i in $(seq $FUZZ_RUNS); do
+        start=$(now_ns)
+        set +e
+        timeout $FUZZ_TIMEOUT "$1" > "$2"
+        status=$?
+        set -e
+        elapsed=$(( $(now_ns) - start ))
+        if [ $status = 124 ]; then
+            echo timeout
+            return
+        fi
+        if [ -z "$best" ] || [ $elapsed -lt $best ]; then
+            best=$elapsed
+        fi
+    done
+    echo "exit $status" >> "$2"
+    echo $best
+}
+
+keep() {
+    cp $OUT/prog.cpp $OUT/failures/seed$1.cpp
+    cp $OUT/$2.log $OUT/failures/seed$1_$2.log 2>/dev/null || true
+    echo "  reproduce: ./obfuscate $OUT/failures/seed$1.cpp $3 -f -o fuzz_repro"
+}
+
+: > $OUT/fuzz.txt
+for seed in $(seq $FIRST $((FIRST + COUNT - 1))); do
+    $OUT/obf-fuzzgen $seed $FUZZ_WORK > $OUT/prog.cpp
+    clang++ -O2 -w $OUT/prog.cpp -o $OUT/plain
+    plainTime=$(run $OUT/plain $OUT/plain.out)
+    if [ "$plainTime" = timeout ]; then
+        echo "seed $seed: plain build timed out, skipped"
+        continue
+    fi
+
+    for config in "${CONFIGS[@]}"; do
+        name=${config%%|*}
+        flags="${config#*|} --seed $seed${OBF_ARGS:+ $OBF_ARGS}"
+        if ! ./obfuscate $OUT/prog.cpp $flags -f -o fuzz_$name -r fuzz/$name.report > $OUT/$name.log 2>&1; then
+            if grep -q "Broken module\|input module is broken\|verification failed" $OUT/$name.log; then
+                status=verify
+            else
+                status=crash
+            fi
+            ratio=-
+        else
+            obfTime=$(run build/fuzz_$name $OUT/$name.out)
+            if [ "$obfTime" = timeout ]; then
+                status=timeout
+                ratio=-
+            elif ! cmp -s $OUT/plain.out $OUT/$name.out; then
+                status=mismatch
+                ratio=-
+            else
+                status=ok
+                ratio=$(awk -v o=$obfTime -v p=$plainTime 'BEGIN {printf "%.2f", o / p}')
+            fi
+        fi
+        echo "$seed $name $status $ratio" >> $OUT/fuzz.txt
+        if [ $status != ok ]; then
+            echo "seed $seed $name: $status"
+            keep $seed $name "$flags"
+        fi
+    done
+    rm -f build/fuzz_*
+done
+
+printf "%-10s %6s %6s %9s %9s  %s\n" "config" "runs" "failed" "geomean" "worst" "worst seed"
+for config in "${CONFIGS[@]}"; do
+    name=${config%%|*}
+    awk -v name=$name '$2 == name {
+        runs++
+        if ($3 != "ok") {
+            failed++
+            next
+        }
+        logSum += log($4)
+        n++
+        if ($4 > worst) {
+            worst = $4
+            worstSeed = $1
+        }
+    } END {
+        if (!n) {
+            printf "%-10s %6d %6d %9s %9s\n", name, runs, failed, "-", "-"
+            exit
+        }
+        printf "%-10s %6d %6d %8.2fx %8.2fx  %s\n", name, runs, failed, exp(logSum / n), worst, worstSeed
+    }' $OUT/fuzz.txt
+done
+
+# Cliffs: ok runs far slower than their configuration's typical program.
+awk -v cliff=$FUZZ_CLIFF '$3 == "ok" {
+    seed[NR] = $1
+    config[NR] = $2
+    ratio[NR] = $4
+    logSum[$2] += log($4)
+    n[$2]++
+} END {
+    for (i in ratio) {
+        mean = exp(logSum[config[i]] / n[config[i]])
+        if (ratio[i] > cliff * mean) {
+            printf "cliff: seed %s %s %.2fx (geomean %.2fx)\n", seed[i], config[i], ratio[i], mean
+        }
+    }
+}' $OUT/fuzz.txt | sort -t' ' -k3,3n
+
+awk '$3 != "ok" {bad = 1} END {exit bad}' $OUT/fuzz.txt
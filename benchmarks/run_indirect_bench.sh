@@ -0,0 +1,78 @@
+#!/bin/bash
+# run_indirect_bench.sh - Measure the extra cost of routing calls and
+# branches through the encoded target table.
+#
+# Builds benchmarks/indirect_kernels.cpp three ways:
+#   plain    - clang++ -O2
+#   calls    - -indirect-calls at the optimizer-last extension point
+#   branches - -indirect-branches at the optimizer-last extension point
+# and prints the extra nanoseconds and cycles per call over the plain build.
+# Cycles are derived from the clock in /proc/cpuinfo (override with
+# CPU_MHZ=...), so they are only as exact as that clock.
+#
+# The measured cycles per routed call are passed back through
+# -indirect-call-cycles, so $OUT/calls.report shows them.
+
+set -e
+
+cd "$(dirname "$0")/.."
+
+PLUGIN=./obfuscator_pass/build/ObfuscatorPass.so
+OUT=build/bench_indirect
+CXXFLAGS="-O2 -std=c++17"
+CALLS=1024
+
+if [ ! -f "$PLUGIN" ]; then
+    echo "Error: $PLUGIN not found, run ./setup.sh first"
+    exit 1
+fi
+
+if [ -z "$CPU_MHZ" ]; then
+    CPU_MHZ=$(awk -F: '/cpu MHz/ {print $2 + 0; exit}' /proc/cpuinfo)
+fi
+
+mkdir -p "$OUT"
+
+# Routing only, so the numbers are not mixed with other transforms.
+OBF_FLAGS="-obf-ep=optimizer-last -bogus-blocks=false -fake-loops=false -instr-sub=false -string-encryption=false"
+
+echo "[1/3] Building plain kernels..."
+clang++ $CXXFLAGS benchmarks/indirect_kernels.cpp -o $OUT/plain
+clang++ $CXXFLAGS -Xclang -disable-llvm-passes -emit-llvm -c benchmarks/indirect_kernels.cpp -o $OUT/kernels.bc
+
+echo "[2/3] Building routed kernels..."
+for variant in calls branches; do
+    opt -load-pass-plugin=$PLUGIN -passes='default<O2>' $OBF_FLAGS -indirect-$variant \
+        -report-file=/dev/null $OUT/kernels.bc -o $OUT/$variant.bc 2>/dev/null
+    clang++ -O2 -Xclang -disable-llvm-passes $OUT/$variant.bc -o $OUT/$variant
+done
+
+echo "[3/3] Running..."
+for variant in plain calls branches; do
+    $OUT/$variant | awk '$1 == "BENCH" {print $2, $3, $4}' | sort > $OUT/$variant.txt
+done
+
+echo ""
+printf "%-10s %-10s %12s %12s %14s %16s\n" "kernel" "build" "plain ns" "routed ns" "extra ns/call" "extra cycles/call"
+for variant in calls branches; do
+    join $OUT/plain.txt $OUT/$variant.txt | \
+    awk -v build=$variant -v calls=$CALLS -v mhz="$CPU_MHZ" '{
+        if ($3 != $5) {
+            printf "%-10s %-10s checksum mismatch (%s / %s)\n", $1, build, $3, $5
+            bad = 1
+            next
+        }
+        extra = ($4 - $2) / calls
+        printf "%-10s %-10s %12.1f %12.1f %14.3f %16.2f\n", $1, build, $2, $4, extra, extra * mhz / 1000
+    } END {
+        exit bad
+    }'
+done
+
+# Feed the measured cost of a routed call back into the report.
+cycles=$(join $OUT/plain.txt $OUT/calls.txt | \
+         awk -v calls=$CALLS -v mhz="$CPU_MHZ" '$1 == "calls" {printf "%.2f", ($4 - $2) / calls * mhz / 1000}')
+opt -load-pass-plugin=$PLUGIN -passes='default<O2>' $OBF_FLAGS -indirect-calls \
+    -indirect-call-cycles=$cycles -report-file=$OUT/calls.report $OUT/kernels.bc -o /dev/null 2>/dev/null
+echo ""
+grep "Extra Cycles" $OUT/calls.report
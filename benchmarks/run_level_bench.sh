@@ -0,0 +1,100 @@
+#!/bin/bash
+# run_level_bench.sh - Measure the runtime and code-size cost of each
+# obfuscation level (obfuscate -l low/medium/high).
+#
+# Every program of the corpus is built once with clang++ -O2 and once per
+# level with the obfuscate CLI (extra CLI flags go in OBF_ARGS, e.g.
+# OBF_ARGS="--ep optimizer-last"). Per level the script prints:
+#   time   - geometric mean over all BENCH lines of obfuscated / plain time
+#   worst  - the slowest kernel relative to plain
+#   .text  - total .text size of the corpus relative to plain
+#   build  - wall time to build the corpus with obfuscate, relative to
+#            clang++ -O2
+# and writes the same table to build/bench_levels/levels.txt, which
+# run_regression_gate.sh compares against benchmarks/baseline.txt.
+
+set -e
+# A checksum mismatch fails the table below, which is piped through tee.
+set -o pipefail
+
+cd "$(dirname "$0")/.."
+
+OUT=build/bench_levels
+CXXFLAGS="-O2 -std=c++17"
+LEVELS="low medium high"
+CORPUS="simd_kernels const_kernels flatten_kernels indirect_kernels"
+
+if [ ! -x ./obfuscate ] || [ ! -f ./obfuscator_pass/build/ObfuscatorPass.so ]; then
+    echo "Error: obfuscate or ObfuscatorPass.so not found, run ./setup.sh first"
+    exit 1
+fi
+
+mkdir -p "$OUT"
+
+text_size() {
+    size -A "$1" | awk '$1 == ".text" {print $2}'
+}
+
+now_ns() {
+    date +%s%N
+}
+
+echo "[1/3] Building plain corpus..."
+start=$(now_ns)
+for prog in $CORPUS; do
+    clang++ $CXXFLAGS benchmarks/$prog.cpp -o $OUT/${prog}_plain
+done
+echo "plain $(( $(now_ns) - start ))" > $OUT/build_ns.txt
+
+echo "[2/3] Building each level..."
+for level in $LEVELS; do
+    start=$(now_ns)
+    for prog in $CORPUS; do
+        ./obfuscate benchmarks/$prog.cpp -l $level $OBF_ARGS -f \
+            -o ${prog}_$level -r bench_levels/${prog}_$level.report > $OUT/${prog}_$level.log 2>&1
+        mv build/${prog}_$level $OUT/
+    done
+    echo "$level $(( $(now_ns) - start ))" >> $OUT/build_ns.txt
+done
+
+echo "[3/3] Running..."
+for prog in $CORPUS; do
+    for build in plain $LEVELS; do
+        $OUT/${prog}_$build | awk -v p=$prog '$1 == "BENCH" {print p "/" $2, $3, $4}' | sort > $OUT/${prog}_$build.txt
+    done
+done
+
+{
+    mismatch=0
+    printf "%-8s %10s %10s %10s %10s\n" "level" "time" "worst" ".text" "build"
+    plainBuild=$(awk '$1 == "plain" {print $2}' $OUT/build_ns.txt)
+    for level in $LEVELS; do
+        levelBuild=$(awk -v l=$level '$1 == l {print $2}' $OUT/build_ns.txt)
+        plainText=0
+        levelText=0
+        for prog in $CORPUS; do
+            plainText=$((plainText + $(text_size $OUT/${prog}_plain)))
+            levelText=$((levelText + $(text_size $OUT/${prog}_$level)))
+        done
+        for prog in $CORPUS; do
+            join $OUT/${prog}_plain.txt $OUT/${prog}_$level.txt
+        done | \
+        awk -v level=$level -v pt=$plainText -v lt=$levelText -v pb=$plainBuild -v lb=$levelBuild '{
+            if ($3 != $5) {
+                printf "%-8s checksum mismatch in %s (%s / %s)\n", level, $1, $3, $5
+                bad = 1
+                next
+            }
+            r = $4 / $2
+            logSum += log(r)
+            n++
+            if (r > worst) {
+                worst = r
+            }
+        } END {
+            printf "%-8s %9.2fx %9.2fx %9.2fx %9.2fx\n", level, exp(logSum / n), worst, lt / pt, lb / pb
+            exit bad
+        }' || mismatch=1
+    done
+    exit $mismatch
+} | tee $OUT/levels.txt
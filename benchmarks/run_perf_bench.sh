@@ -0,0 +1,197 @@
+#!/bin/bash
+# run_perf_bench.sh - Explain where each obfuscation feature's slowdown comes
+# from, using hardware performance counters (Linux perf_event_open).
+#
+# Every program of the corpus is built
+#   plain  - clang++ -O2
+#   none   - obfuscate -l high with every feature turned off, the baseline
+#            the features are compared against (same pipeline, no changes)
+#   <feature> - the same with only that feature turned on
+#   all    - obfuscate -l high, every feature of the level at once
+# and run with OBF_BENCH_PERF=1, so bench::run() prints per-iteration
+# cycles, instructions, branch misses, L1i and iTLB misses and stalled
+# cycles next to each timing (see bench.h).
+#
+# For each build the script prints, averaged over all kernels and relative
+# to the baseline's cycles, the change in cycles and instructions, the
+# change in misses per 1000 baseline instructions, and an estimate of how
+# many extra cycles come from
+#   branches     - extra branch misses x BRANCH_MISS_CYCLES (default 15)
+#   footprint    - extra L1i misses x L1I_MISS_CYCLES (default 12) plus
+#                  extra iTLB misses x ITLB_MISS_CYCLES (default 30)
+#   instructions - extra instructions at the baseline's cycles/instruction
+# and names the largest as the cause. The miss penalties are rough; set them
+# for the machine at hand. The pipeline row compares the baseline with
+# clang++ -O2, i.e. what the obfuscate pipeline costs before any feature;
+# the all row can be compared with the sum of the single features to see
+# how they interact. Per-kernel figures go to
+# build/bench_perf/perf_detail.txt.
+#
+# Needs a PMU the kernel exposes to user space: run it on bare metal (or a
+# VM with PMU passthrough) with kernel.perf_event_paranoid <= 2.
+
+set -e
+
+cd "$(dirname "$0")/.."
+
+OUT=build/bench_perf
+CXXFLAGS="-O2 -std=c++17"
+CORPUS="simd_kernels const_kernels flatten_kernels indirect_kernels"
+BRANCH_MISS_CYCLES=${BRANCH_MISS_CYCLES:-15}
+L1I_MISS_CYCLES=${L1I_MISS_CYCLES:-12}
+ITLB_MISS_CYCLES=${ITLB_MISS_CYCLES:-30}
+
+# feature|the flag that turns it off
+FEATURES=(
+    "bogus-blocks|--no-bogus-blocks"
+    "fake-loops|--no-fake-loops"
+    "substitution|--no-instr-sub"
+    "constant-encoding|--no-const-obf"
+    "flatten|--no-flatten"
+    "indirect-calls|--no-indirect-calls"
+    "string-encryption|--no-string-encryption"
+)
+ALL_OFF=""
+for feature in "${FEATURES[@]}"; do
+    ALL_OFF="$ALL_OFF ${feature#*|}"
+done
+
+if [ ! -x ./obfuscate ] || [ ! -f ./obfuscator_pass/build/ObfuscatorPass.so ]; then
+    echo "Error: obfuscate or ObfuscatorPass.so not found, run ./setup.sh first"
+    exit 1
+fi
+
+mkdir -p "$OUT"
+
+# obf_build <build name> <flags>
+obf_build() {
+    for prog in $CORPUS; do
+        ./obfuscate benchmarks/$prog.cpp -l high $2 -f \
+            -o ${prog}_$1 -r bench_perf/${prog}_$1.report > $OUT/${prog}_$1.log 2>&1
+        mv build/${prog}_$1 $OUT/
+    done
+}
+
+echo "[1/3] Building..."
+for prog in $CORPUS; do
+    clang++ $CXXFLAGS benchmarks/$prog.cpp -o $OUT/${prog}_plain
+done
+BUILDS="plain none"
+obf_build none "$ALL_OFF"
+for feature in "${FEATURES[@]}"; do
+    name=${feature%%|*}
+    obf_build $name "${ALL_OFF/ ${feature#*|}/}"
+    BUILDS="$BUILDS $name"
+done
+obf_build all ""
+BUILDS="$BUILDS all"
+
+echo "[2/3] Running..."
+for build in $BUILDS; do
+    for prog in $CORPUS; do
+        OBF_BENCH_PERF=1 $OUT/${prog}_$build > $OUT/${prog}_$build.out
+        awk -v p=$prog '$1 == "BENCH" {print p "/" $2, $4}' $OUT/${prog}_$build.out
+    done | sort > $OUT/$build.sums
+    for prog in $CORPUS; do
+        awk -v p=$prog '$1 == "PERF" {$1 = ""; $2 = p "/" $2; print}' $OUT/${prog}_$build.out
+    done | sed 's/^ //' | sort > $OUT/$build.perf
+    if ! cmp -s $OUT/plain.sums $OUT/$build.sums; then
+        echo "Error: $build computes different checksums than plain"
+        exit 1
+    fi
+done
+if awk '$2 == "-" || $3 == "-" {bad = 1} END {exit !bad}' $OUT/none.perf; then
+    echo "Error: cycle and instruction counters unavailable (no PMU exposed, or kernel.perf_event_paranoid > 2)"
+    exit 2
+fi
+
+echo "[3/3] Attributing..."
+echo ""
+: > $OUT/perf_detail.txt
+printf "%-18s %8s %8s %9s %9s %9s %9s %9s %9s  %s\n" "build" "cycles" "instr" "br-miss" "l1i-miss" "itlb-miss" \
+    "branches" "footprint" "instrs" "cause"
+for build in $BUILDS; do
+    [ $build = none ] && continue
+    # plain is compared the other way round: what the pipeline adds to it.
+    if [ $build = plain ]; then
+        base=plain
+        cur=none
+        build=pipeline
+    else
+        base=none
+        cur=$build
+    fi
+    join $OUT/$base.perf $OUT/$cur.perf | \
+    awk -v build=$build -v pb=$BRANCH_MISS_CYCLES -v pi=$L1I_MISS_CYCLES -v pt=$ITLB_MISS_CYCLES \
+        -v detail=$OUT/perf_detail.txt '
+    # Fields: kernel, then base and current cycles instructions branch_misses
+    # l1i_misses itlb_misses stalled_frontend stalled_backend.
+    function delta(i) {
+        if ($(1 + i) == "-" || $(8 + i) == "-") {
+            return ""
+        }
+        return $(8 + i) - $(1 + i)
+    }
+    # Misses the CPU does not count stay "-" instead of averaging to 0.
+    BEGIN {
+        have["br"] = have["l1i"] = have["itlb"] = have["branches"] = have["footprint"] = 0
+    }
+    function pct(x) {
+        return x == "" ? "-" : sprintf("%+.1f%%", x)
+    }
+    {
+        baseCycles = $2
+        baseInstr = $3
+        if (baseCycles <= 0 || baseInstr <= 0) {
+            next
+        }
+        dc = delta(1)
+        di = delta(2)
+        db = delta(3)
+        dl = delta(4)
+        dt = delta(5)
+        branchCycles = db == "" ? "" : db * pb
+        footprintCycles = dl == "" && dt == "" ? "" : (dl == "" ? 0 : dl * pi) + (dt == "" ? 0 : dt * pt)
+        instrCycles = di * baseCycles / baseInstr
+        n++
+        sum["cycles"] += 100 * dc / baseCycles
+        sum["instr"] += 100 * di / baseInstr
+        if (db != "") { sum["br"] += 1000 * db / baseInstr; have["br"]++ }
+        if (dl != "") { sum["l1i"] += 1000 * dl / baseInstr; have["l1i"]++ }
+        if (dt != "") { sum["itlb"] += 1000 * dt / baseInstr; have["itlb"]++ }
+        if (branchCycles != "") { sum["branches"] += 100 * branchCycles / baseCycles; have["branches"]++ }
+        if (footprintCycles != "") { sum["footprint"] += 100 * footprintCycles / baseCycles; have["footprint"]++ }
+        sum["instrs"] += 100 * instrCycles / baseCycles
+        printf "%-18s %-24s cycles %s instr %s branches %s footprint %s instrs %s stalled-fe %s stalled-be %s\n", \
+            build, $1, pct(100 * dc / baseCycles), pct(100 * di / baseInstr), \
+            pct(branchCycles == "" ? "" : 100 * branchCycles / baseCycles), \
+            pct(footprintCycles == "" ? "" : 100 * footprintCycles / baseCycles), pct(100 * instrCycles / baseCycles), \
+            delta(6) == "" ? "-" : sprintf("%+.1f", delta(6)), delta(7) == "" ? "-" : sprintf("%+.1f", delta(7)) >> detail
+    }
+    function avg(k) {
+        return k in have ? (have[k] ? sum[k] / have[k] : "") : sum[k] / n
+    }
+    function col(k, fmt) {
+        v = avg(k)
+        return v == "" ? "-" : sprintf(fmt, v)
+    }
+    END {
+        if (!n) {
+            exit
+        }
+        cause = "instructions"
+        best = avg("instrs")
+        if (best <= 0) {
+            cause = "-"
+            best = 0
+        }
+        if (avg("branches") != "" && avg("branches") > best) { cause = "branches"; best = avg("branches") }
+        if (avg("footprint") != "" && avg("footprint") > best) { cause = "footprint"; best = avg("footprint") }
+        printf "%-18s %+7.1f%% %+7.1f%% %9s %9s %9s %9s %9s %8.1f%%  %s\n", build, avg("cycles"), avg("instr"), \
+            col("br", "%+.2f"), col("l1i", "%+.2f"), col("itlb", "%+.2f"), \
+            col("branches", "%.1f%%"), col("footprint", "%.1f%%"), avg("instrs"), cause
+    }'
+done | tee $OUT/perf.txt
+echo ""
+echo "cycles/instr: change vs. the baseline; misses: change per 1000 baseline instructions;"
+echo "branches/footprint/instrs: estimated extra cycles, % of baseline cycles. Details: $OUT/perf_detail.txt"
@@ -0,0 +1,133 @@
+#!/bin/bash
+# run_regression_gate.sh - Fail when a plugin change makes obfuscated code
+# slower or bigger, or the obfuscator itself slower to run.
+#
+# Runs run_level_bench.sh (runtime, code-size and build-time suites per
+# level), then compares every figure of build/bench_levels/levels.txt with
+# benchmarks/baseline.txt. All figures are ratios against plain clang++ -O2
+# on the same machine, so the baseline carries over between similar hosts,
+# but record it on the machine the gate runs on.
+#
+#   run_regression_gate.sh            measure and compare
+#   run_regression_gate.sh --update   measure and rewrite the baseline values
+#
+# Environment:
+#   BASELINE  baseline file (default benchmarks/baseline.txt)
+#   SKIP_RUN  reuse the existing levels.txt instead of measuring again
+#   OBF_ARGS  passed on to run_level_bench.sh
+#
+# Exit status: 0 when every figure is within its tolerance, 1 when any
+# figure regressed, 2 when the measurement failed (including a checksum
+# mismatch, i.e. a miscompile) or no figure has a baseline value yet.
+# Single figures without a baseline value are listed but do not fail the
+# gate.
+
+set -e
+
+cd "$(dirname "$0")/.."
+
+BASELINE=${BASELINE:-benchmarks/baseline.txt}
+LEVELS_FILE=build/bench_levels/levels.txt
+UPDATE=0
+if [ "$1" = "--update" ]; then
+    UPDATE=1
+fi
+
+if [ ! -f "$BASELINE" ]; then
+    echo "Error: baseline $BASELINE not found"
+    exit 2
+fi
+
+if [ -z "$SKIP_RUN" ]; then
+    benchmarks/run_level_bench.sh || exit 2
+fi
+if [ ! -f "$LEVELS_FILE" ]; then
+    echo "Error: $LEVELS_FILE not found"
+    exit 2
+fi
+
+# levels.txt -> "<level>.<figure> <ratio>" lines. Anything but the header
+# and figure rows (e.g. a checksum mismatch) fails the measurement.
+if ! CURRENT=$(awk 'NR == 1 {
+    for (i = 2; i <= NF; i++) {
+        name[i] = $i
+        sub(/^\./, "", name[i])
+    }
+    next
+} {
+    if (NF != 5) {
+        print "Error: not a figure row in levels.txt: " $0 > "/dev/stderr"
+        bad = 1
+        next
+    }
+    for (i = 2; i <= NF; i++) {
+        v = $i
+        if (v !~ /^[0-9.]+x$/) {
+            print "Error: not a figure row in levels.txt: " $0 > "/dev/stderr"
+            bad = 1
+            next
+        }
+        sub(/x$/, "", v)
+        print $1 "." name[i], v
+    }
+} END {
+    exit bad
+}' "$LEVELS_FILE"); then
+    exit 2
+fi
+
+if [ $UPDATE = 1 ]; then
+    echo "$CURRENT" | awk 'NR == FNR {
+        value[$1] = $2
+        next
+    } /^#/ || NF < 3 {
+        print
+        next
+    } {
+        if ($1 in value) {
+            $2 = value[$1]
+        }
+        printf "%-16s %-8s %s\n", $1, $2, $3
+    }' - "$BASELINE" > "$BASELINE.new"
+    mv "$BASELINE.new" "$BASELINE"
+    echo "Updated $BASELINE"
+    exit 0
+fi
+
+echo "$CURRENT" | awk 'NR == FNR {
+    value[$1] = $2
+    next
+} /^#/ || NF < 3 {
+    next
+} {
+    metric = $1
+    base = $2
+    tolerance = $3
+    if (!(metric in value)) {
+        printf "%-16s %9s %9s %8s %6s%%  missing from levels.txt\n", metric, base, "-", "-", tolerance
+        missing = 1
+        next
+    }
+    cur = value[metric]
+    if (base == "-") {
+        printf "%-16s %9s %9.2f %8s %6s%%  no baseline\n", metric, base, cur, "-", tolerance
+        next
+    }
+    compared++
+    change = 100 * (cur - base) / base
+    status = change > tolerance ? "REGRESSED" : "ok"
+    if (change > tolerance) {
+        bad = 1
+    }
+    printf "%-16s %9.2f %9.2f %+7.1f%% %6s%%  %s\n", metric, base, cur, change, tolerance, status
+} BEGIN {
+    printf "%-16s %9s %9s %8s %7s  %s\n", "figure", "baseline", "current", "change", "limit", "status"
+} END {
+    if (!compared) {
+        print ""
+        print "*** No figure has a baseline value: nothing was checked. Record one with"
+        print "*** benchmarks/run_regression_gate.sh --update and commit it."
+        exit 2
+    }
+    exit bad ? 1 : missing ? 2 : 0
+}' - "$BASELINE"
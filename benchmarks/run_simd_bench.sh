@@ -0,0 +1,64 @@
+#!/bin/bash
+# run_simd_bench.sh - Compare SIMD kernel throughput with and without
+# instruction substitution.
+#
+# Builds benchmarks/simd_kernels.cpp three ways:
+#   plain  - clang++ -O2
+#   early  - substitution before the vectorizers (reduction adds preserved)
+#   late   - substitution deferred to obfuscator-sub after default<O2>
+# and prints ns/iter for each kernel plus the slowdown against plain. The
+# obfuscated modules are already optimized, so they are compiled with
+# -disable-llvm-passes; another -O2 run would fold the substitutions back.
+
+set -e
+
+cd "$(dirname "$0")/.."
+
+PLUGIN=./obfuscator_pass/build/ObfuscatorPass.so
+OUT=build/bench_simd
+CXXFLAGS="-O2 -march=native -std=c++17"
+
+if [ ! -f "$PLUGIN" ]; then
+    echo "Error: $PLUGIN not found, run ./setup.sh first"
+    exit 1
+fi
+
+mkdir -p "$OUT"
+
+# Only substitution is measured here; bogus blocks and fake loops would
+# change the control flow the vectorizers see.
+OBF_FLAGS="-bogus-blocks=false -fake-loops=false -instr-sub=true"
+
+echo "[1/4] Building plain kernels..."
+clang++ $CXXFLAGS benchmarks/simd_kernels.cpp -o $OUT/plain
+
+echo "[2/4] Building early-substitution kernels..."
+clang++ $CXXFLAGS -Xclang -disable-llvm-passes -emit-llvm -c benchmarks/simd_kernels.cpp -o $OUT/kernels.bc
+opt -load-pass-plugin=$PLUGIN -passes='obfuscator-pass,default<O2>' $OBF_FLAGS \
+    $OUT/kernels.bc -o $OUT/early.bc 2>/dev/null
+clang++ $CXXFLAGS -Xclang -disable-llvm-passes $OUT/early.bc -o $OUT/early
+
+echo "[3/4] Building late-substitution kernels..."
+opt -load-pass-plugin=$PLUGIN -passes='obfuscator-pass,default<O2>,obfuscator-sub' \
+    $OBF_FLAGS -instr-sub-late=true \
+    $OUT/kernels.bc -o $OUT/late.bc 2>/dev/null
+clang++ $CXXFLAGS -Xclang -disable-llvm-passes $OUT/late.bc -o $OUT/late
+
+echo "[4/4] Running..."
+$OUT/plain > $OUT/plain.txt
+$OUT/early > $OUT/early.txt
+$OUT/late > $OUT/late.txt
+
+echo ""
+printf "%-16s %12s %12s %12s %9s %9s\n" "kernel" "plain ns" "early ns" "late ns" "early" "late"
+join <(awk '{print $2, $3, $4}' $OUT/plain.txt | sort) \
+     <(awk '{print $2, $3, $4}' $OUT/early.txt | sort) | \
+join - <(awk '{print $2, $3, $4}' $OUT/late.txt | sort) | \
+awk '{
+    if ($3 != $5 || $3 != $7) {
+        printf "%-16s checksum mismatch (%s / %s / %s)\n", $1, $3, $5, $7
+        bad = 1
+        next
+    }
+    printf "%-16s %12.2f %12.2f %12.2f %8.2fx %8.2fx\n", $1, $2, $4, $6, $4 / $2, $6 / $2
+} END { exit bad }'
@@ -0,0 +1,104 @@
+#!/bin/bash
+# run_string_rss_bench.sh - Measure how much of the string data each process
+# keeps private under the two string decryption modes.
+#
+# Generates a program with NSTRINGS distinct string literals, each passed to
+# fputs once, and builds it three ways:
+#   plain  - no string encryption
+#   global - -string-decrypt=global (lazy per-process .bss buffers)
+#   stack  - -string-decrypt=stack (decrypt into a wiped stack buffer per call)
+# NPROCS copies of each build are started at once; after every copy has
+# touched all of its strings, /proc/<pid>/smaps_rollup is summed across
+# them. Anonymous is memory that is not backed by the executable and can
+# never be shared (the global-mode buffers live here); Pss splits shared
+# pages between the processes that map them. Private_Dirty also counts text
+# pages on filesystems that report page-cache pages as dirty (some overlay
+# and tmpfs setups), so compare Anonymous first.
+
+set -e
+
+cd "$(dirname "$0")/.."
+
+PLUGIN=./obfuscator_pass/build/ObfuscatorPass.so
+OUT=build/bench_string_rss
+NSTRINGS=${NSTRINGS:-4000}
+NPROCS=${NPROCS:-8}
+
+if [ ! -f "$PLUGIN" ]; then
+    echo "Error: $PLUGIN not found, run ./setup.sh first"
+    exit 1
+fi
+if [ ! -r /proc/self/smaps_rollup ]; then
+    echo "Error: /proc/<pid>/smaps_rollup is not available on this kernel"
+    exit 1
+fi
+
+mkdir -p "$OUT"
+
+echo "[1/4] Generating $NSTRINGS strings..."
+awk -v n=$NSTRINGS 'BEGIN {
+    print "#include <cstdio>"
+    print "#include <unistd.h>"
+    print "static void touch(FILE *f) {"
+    for (i = 0; i < n; i++)
+        printf "    fputs(\"string %06d: the quick brown fox jumps over the lazy dog\\n\", f);\n", i
+    print "}"
+    print "int main() {"
+    print "    FILE *f = fopen(\"/dev/null\", \"w\");"
+    print "    touch(f);"
+    print "    fflush(f);"
+    print "    puts(\"ready\");"
+    print "    fflush(stdout);"
+    print "    pause();"
+    print "}"
+}' > $OUT/strings.cpp
+
+echo "[2/4] Building..."
+clang++ -O2 $OUT/strings.cpp -o $OUT/plain
+clang++ -O2 -Xclang -disable-llvm-passes -emit-llvm -c $OUT/strings.cpp -o $OUT/strings.bc
+for mode in global stack; do
+    opt -load-pass-plugin=$PLUGIN -passes='inferattrs,obfuscator-strings,default<O2>' \
+        -string-decrypt=$mode -report-file=$OUT/$mode.report \
+        $OUT/strings.bc -o $OUT/$mode.bc 2>/dev/null
+    clang++ -O2 -Xclang -disable-llvm-passes $OUT/$mode.bc -o $OUT/$mode
+done
+
+# Start NPROCS copies, wait until all are ready, then sum smaps_rollup
+# fields (kB) across them.
+measure() {
+    local bin=$1 pids=() fifo=$OUT/ready.$1
+    for ((p = 0; p < NPROCS; p++)); do
+        rm -f $fifo.$p
+        $OUT/$bin > $fifo.$p &
+        pids+=($!)
+    done
+    for ((p = 0; p < NPROCS; p++)); do
+        until grep -q ready $fifo.$p 2>/dev/null; do sleep 0.01; done
+    done
+    local rollup=""
+    for pid in "${pids[@]}"; do
+        rollup+=$(cat /proc/$pid/smaps_rollup)$'\n'
+    done
+    kill "${pids[@]}" 2>/dev/null
+    wait 2>/dev/null || true
+    rm -f $fifo.*
+    echo "$rollup" | awk -v name=$bin -v n=$NPROCS '
+        $1 == "Rss:" { rss += $2 }
+        $1 == "Pss:" { pss += $2 }
+        $1 == "Private_Dirty:" { dirty += $2 }
+        $1 == "Anonymous:" { anon += $2 }
+        END { printf "%-8s %10d %10d %14d %10d %14.1f\n", name, rss, pss, dirty, anon, anon / n }'
+}
+
+echo "[3/4] Running $NPROCS copies of each build..."
+RESULTS=$(for bin in plain global stack; do measure $bin; done)
+
+echo "[4/4] Results (kB, summed over $NPROCS processes)"
+echo ""
+printf "%-8s %10s %10s %14s %10s %14s\n" "build" "Rss" "Pss" "Private_Dirty" "Anonymous" "Anonymous/proc"
+echo "$RESULTS"
+echo ""
+for mode in global stack; do
+    echo "$mode:"
+    sed -n '/--- String Memory ---/,/^$/p' $OUT/$mode.report | tail -n +2
+done
@@ -0,0 +1,63 @@
+#!/bin/bash
+# run_vm_bench.sh - Measure the cost of virtualization per executed bytecode
+# op.
+#
+# Builds benchmarks/vm_kernels.cpp three ways:
+#   plain   - clang++ -O2
+#   vm      - obfuscator-vm on the obf:virtualize kernels, then -O2
+#   counted - as vm, plus -vm-count-ops to count executed ops
+# and prints, per kernel, the plain and virtualized time per call, the
+# slowdown factor and (t_vm - t_plain) / ops_per_call, the extra cost of one
+# interpreted op. The counting build is only used for the op counts; its
+# timings include the counter increments and are not reported.
+
+set -e
+
+cd "$(dirname "$0")/.."
+
+PLUGIN=./obfuscator_pass/build/ObfuscatorPass.so
+OUT=build/bench_vm
+CXXFLAGS="-O2 -std=c++17"
+
+if [ ! -f "$PLUGIN" ]; then
+    echo "Error: $PLUGIN not found, run ./setup.sh first"
+    exit 1
+fi
+
+mkdir -p "$OUT"
+
+# Virtualization only, so the numbers are not mixed with other transforms.
+OBF_PASSES='obfuscator-vm,default<O2>'
+
+echo "[1/3] Building plain kernels..."
+clang++ $CXXFLAGS benchmarks/vm_kernels.cpp -o $OUT/plain
+clang++ $CXXFLAGS -Xclang -disable-llvm-passes -emit-llvm -c benchmarks/vm_kernels.cpp -o $OUT/kernels.bc
+
+echo "[2/3] Building virtualized kernels..."
+opt -load-pass-plugin=$PLUGIN -passes="$OBF_PASSES" -report-file=$OUT/vm.report \
+    $OUT/kernels.bc -o $OUT/vm.bc
+opt -load-pass-plugin=$PLUGIN -passes="$OBF_PASSES" -vm-count-ops -report-file=/dev/null \
+    $OUT/kernels.bc -o $OUT/counted.bc 2>/dev/null
+clang++ -O2 -Xclang -disable-llvm-passes $OUT/vm.bc -o $OUT/vm
+clang++ -O2 -Xclang -disable-llvm-passes $OUT/counted.bc -o $OUT/counted
+
+echo "[3/3] Running..."
+$OUT/plain > $OUT/plain.txt
+$OUT/vm > $OUT/vm.txt
+$OUT/counted | awk '$1 == "OPS" {print $2, $3}' | sort > $OUT/ops.txt
+
+echo ""
+printf "%-12s %12s %12s %10s %12s %14s\n" "kernel" "plain ns" "vm ns" "slowdown" "ops/call" "extra ns/op"
+join <(awk '$1 == "BENCH" {print $2, $3, $4}' $OUT/plain.txt | sort) \
+     <(awk '$1 == "BENCH" {print $2, $3, $4}' $OUT/vm.txt | sort) | \
+join - $OUT/ops.txt | \
+awk '{
+    if ($3 != $5) {
+        printf "%-12s checksum mismatch (%s / %s)\n", $1, $3, $5
+        bad = 1
+        next
+    }
+    printf "%-12s %12.1f %12.1f %9.1fx %12d %14.3f\n", $1, $2, $4, $4 / $2, $6, ($4 - $2) / $6
+} END {
+    exit bad
+}'
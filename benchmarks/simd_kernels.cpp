@@ -0,0 +1,66 @@
+// simd_kernels.cpp - Integer kernels the loop and SLP vectorizers turn into
+// <N x iK> code. Used by run_simd_bench.sh to check that instruction
+// substitution keeps their throughput.
+
+#include "bench.h"
+#include <cstdint>
+#include <vector>
+
+static const int N = 4096;
+
+// Element-wise add: vectorizes to <N x i32> add.
+__attribute__((noinline)) uint64_t vecAdd(const int32_t *a, const int32_t *b, int32_t *c) {
+    for (int i = 0; i < N; i++) {
+        c[i] = a[i] + b[i];
+    }
+    return (uint32_t)c[N - 1];
+}
+
+// Add-reduction: only vectorizes while the loop-carried add stays a plain add.
+__attribute__((noinline)) uint64_t sumReduce(const int32_t *a) {
+    int32_t sum = 0;
+    for (int i = 0; i < N; i++) {
+        sum += a[i];
+    }
+    return (uint32_t)sum;
+}
+
+// Multiply-accumulate reduction on narrow integers.
+__attribute__((noinline)) uint64_t dot16(const int16_t *a, const int16_t *b) {
+    int32_t acc = 0;
+    for (int i = 0; i < N; i++) {
+        acc += a[i] * b[i];
+    }
+    return (uint32_t)acc;
+}
+
+// Straight-line lane-wise adds the SLP vectorizer packs together.
+__attribute__((noinline)) uint64_t slpAdd4(int64_t *x, const int64_t *y) {
+    for (int i = 0; i < N; i += 4) {
+        x[i + 0] = x[i + 0] + y[i + 0];
+        x[i + 1] = x[i + 1] + y[i + 1];
+        x[i + 2] = x[i + 2] + y[i + 2];
+        x[i + 3] = x[i + 3] + y[i + 3];
+    }
+    return (uint64_t)x[N - 1];
+}
+
+int main() {
+    std::vector<int32_t> a(N), b(N), c(N);
+    std::vector<int16_t> s(N), t(N);
+    std::vector<int64_t> x(N), y(N);
+    for (int i = 0; i < N; i++) {
+        a[i] = i * 7 - 3;
+        b[i] = i ^ 0x55;
+        s[i] = (int16_t)(i & 0x3ff);
+        t[i] = (int16_t)(3 - (i & 0x7f));
+        x[i] = i;
+        y[i] = 1;
+    }
+
+    bench::run("vec_add_i32", [&] { return vecAdd(a.data(), b.data(), c.data()); }, 20000);
+    bench::run("sum_reduce_i32", [&] { return sumReduce(a.data()); }, 20000);
+    bench::run("dot_i16", [&] { return dot16(s.data(), t.data()); }, 20000);
+    bench::run("slp_add_i64", [&] { return slpAdd4(x.data(), y.data()); }, 20000);
+    return 0;
+}
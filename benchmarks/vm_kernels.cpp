@@ -0,0 +1,102 @@
+// vm_kernels.cpp - Cold-path style routines used by run_vm_bench.sh to
+// measure what the threaded bytecode interpreter costs per executed op.
+//
+// Every kernel is annotated obf:virtualize. When the program is built with
+// -vm-count-ops, __obf_vm_ops counts executed bytecode ops and the program
+// also prints one line per kernel in the form
+//   OPS <name> <ops_per_call>
+// which the driver divides the slowdown by.
+
+#include "bench.h"
+#include <cstdint>
+#include <cstring>
+
+#define VIRTUALIZE __attribute__((noinline, annotate("obf:virtualize")))
+
+extern "C" __attribute__((weak)) uint64_t __obf_vm_ops;
+
+// Serial-number check: FNV-1a over the key, then a few mixing rounds.
+VIRTUALIZE uint64_t checkSerial(const char *key, int len) {
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (int i = 0; i < len; i++) {
+        h = (h ^ (uint8_t)key[i]) * 0x100000001b3ull;
+    }
+    for (int r = 0; r < 4; r++) {
+        h ^= h >> 31;
+        h *= 0x7fb5d329728ea185ull;
+    }
+    return h;
+}
+
+// Tokenizer over key=value;... text, branching per character class.
+VIRTUALIZE uint64_t parseConfig(const char *text, int len) {
+    uint64_t keys = 0, values = 0, digits = 0;
+    int state = 0;
+    for (int i = 0; i < len; i++) {
+        switch (text[i]) {
+        case '=':
+            keys++;
+            state = 1;
+            break;
+        case ';':
+            values += state;
+            state = 0;
+            break;
+        default:
+            if (text[i] >= '0' && text[i] <= '9') {
+                digits += text[i] - '0';
+            }
+            break;
+        }
+    }
+    return keys * 1000000 + values * 1000 + digits;
+}
+
+// Signed arithmetic and memory traffic: a small table-driven checksum.
+VIRTUALIZE int64_t signedTable(const int32_t *data, int n) {
+    int32_t table[16];
+    for (int i = 0; i < 16; i++) {
+        table[i] = (i - 8) * 37;
+    }
+    int64_t acc = 0;
+    for (int i = 0; i < n; i++) {
+        int32_t v = data[i];
+        acc += table[v & 15] + v / 7 - (v % 5);
+        acc = acc >> 1 ^ (acc < 0 ? -3 : 5);
+    }
+    return acc;
+}
+
+template <typename Fn>
+static void run(const char *name, Fn fn, int iters) {
+    bench::run(name, fn, iters);
+    if (&__obf_vm_ops) {
+        uint64_t before = __obf_vm_ops;
+        fn();
+        std::printf("OPS %s %llu\n", name, (unsigned long long)(__obf_vm_ops - before));
+    }
+}
+
+int main() {
+    static char key[64];
+    static char config[512];
+    static int32_t numbers[256];
+    for (int i = 0; i < 63; i++) {
+        key[i] = 'A' + (i * 7) % 26;
+    }
+    int pos = 0;
+    for (int i = 0; pos < 500; i++) {
+        pos += std::snprintf(config + pos, sizeof(config) - pos, "k%d=%d;", i, i * 13);
+    }
+    uint32_t seed = 12345;
+    for (int i = 0; i < 256; i++) {
+        seed = seed * 1103515245u + 12345u;
+        numbers[i] = (int32_t)seed >> 4;
+    }
+
+    int configLen = (int)std::strlen(config);
+    run("checkSerial", [&] { return checkSerial(key, 63); }, 20000);
+    run("parseConfig", [&] { return parseConfig(config, configLen); }, 5000);
+    run("signedTable", [&] { return (uint64_t)signedTable(numbers, 256); }, 5000);
+    return 0;
+}
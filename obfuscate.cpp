@@ -7,6 +7,49 @@
 #include <libgen.h> // For dirname()
 #include <cstdio> // For std::remove
 #include <cstring>
+#include <vector>
+#include <chrono>
+#include <iterator>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// An obfuscation level is a complete preset. Flags given on the command line
+// override the preset for that one setting. benchmarks/run_level_bench.sh
+// measures the runtime and code-size cost of each level.
+struct LevelPreset {
+    const char *name;
+    bool bogusBlocks;
+    bool fakeLoops;
+    bool instrSub;
+    bool flatten;
+    bool constObf;
+    bool indirectCalls;
+    int opaqueTier;
+    int mbaLevel;
+    int bogusDensity;    // percent of eligible blocks
+    int bogusMax;
+    int fakeLoopDensity; // percent of eligible blocks
+    int fakeLoopMax;
+};
+
+static const LevelPreset Presets[] = {
+    // name     bogus  loops  sub   flatten const  indirect tier mba  bogus%/max loop%/max
+    // low keeps real densities: obf:heavy functions turn bogus blocks and
+    // fake loops on at every level, and a budget of 0 would drop them.
+    {"low",     false, false, true, false,  false, false,   0,   1,   10, 16,    3,  4},
+    {"medium",  true,  true,  true, false,  true,  false,   1,   2,   10, 16,    3,  4},
+    {"high",    true,  true,  true, true,   true,  true,    2,   4,   30, 64,    10, 16},
+};
+
+static const LevelPreset *findPreset(const std::string &name) {
+    for (const LevelPreset &preset : Presets) {
+        if (name == preset.name) {
+            return &preset;
+        }
+    }
+    return nullptr;
+}
 
 void printUsage(const char *progName) {
     std::cout << "LLVM Code Obfuscator - CLI Tool\n";
@@ -15,13 +58,42 @@ void printUsage(const char *progName) {
     std::cout << "Options:\n";
     std::cout << "  -o <file>       Output file name (default: <input>_obfuscated)\n";
     std::cout << "  -r <file>       Report file name (default: obfuscation_report.txt)\n";
+    std::cout << "  --report-format <fmt> Report format: text (default), json\n";
     std::cout << "  -l <level>      Obfuscation level: low, medium, high (default: medium)\n";
+    std::cout << "                  Each level is a preset; the flags below override it\n";
     std::cout << "  --windows       Generate Windows executable (cross-compile)\n";
     std::cout << "  --linux         Generate Linux executable (default)\n";
     std::cout << "  --emit-ll       Emit human-readable LLVM IR (.ll file)\n";
     std::cout << "  --no-bogus-blocks Disable bogus block obfuscation\n";
     std::cout << "  --no-fake-loops   Disable fake loop obfuscation\n";
     std::cout << "  --no-instr-sub    Disable instruction substitution obfuscation\n";
+    std::cout << "  --no-string-encryption Disable lazy string encryption\n";
+    std::cout << "  --string-decrypt <mode> Decrypt strings into: global (default), stack\n";
+    std::cout << "  --const-obf       Encode integer constants (decoded outside loops)\n";
+    std::cout << "  --no-const-obf    Disable constant encoding\n";
+    std::cout << "  --mba-level <n>   MBA substitution level, 0-7 (default: 1)\n";
+    std::cout << "  --seed <n>        Seed for the random choices, e.g. keys and blocks (default: 0)\n";
+    std::cout << "  --overhead-warn <x> Warn when a function's estimated cost grows more than x times (default: 10)\n";
+    std::cout << "  --overhead-limit <x> Restore functions whose estimated cost grows more than x times\n";
+    std::cout << "  --memory-warn-mb <n> Flag steps and passes whose peak RSS is above n MB\n";
+    std::cout << "  --ir-growth-warn-kb <n> Flag functions whose IR grows by more than n KB\n";
+    std::cout << "  --remarks <file>  Save optimization remarks for every obfuscation decision\n";
+    std::cout << "  --remarks-format <fmt> Remark file format: yaml (default), bitstream\n";
+    std::cout << "  --instrument      Count executions of inserted code; merge with obf-counters\n";
+    std::cout << "  --stage-timings <file> Per-step timings file (default: <output>_stages.json)\n";
+    std::cout << "  --trace=<file>    Chrome trace of every step, pass and transformation\n";
+    std::cout << "  --indirect-calls  Route direct calls through an encoded target table\n";
+    std::cout << "  --no-indirect-calls Keep calls direct\n";
+    std::cout << "  --indirect-branches Route conditional branches (outside loops) through it too\n";
+    std::cout << "  --virtualize <fn,...> Virtualize these functions (and any annotated obf:virtualize)\n";
+    std::cout << "  --flatten         Enable control-flow flattening\n";
+    std::cout << "  --no-flatten      Disable control-flow flattening\n";
+    std::cout << "  --flatten-dispatch <kind> Flattening dispatcher: switch (default), indirectbr\n";
+    std::cout << "  --sub-after-vectorize Optimize with -O2 and substitute after the vectorizers\n";
+    std::cout << "  --no-cleanup      Skip the post-obfuscation cleanup pipeline\n";
+    std::cout << "  --ep <point>      Run inside the -O2 pipeline at an extension point:\n";
+    std::cout << "                    pipeline-start, scalar-late, vectorizer-start, optimizer-last\n";
+    std::cout << "  --print-plugin-flags Print the plugin options for these settings and exit (used by obfuscate-cc)\n";
     std::cout << "  -f, --force       Force overwrite of existing output files\n";
     std::cout << "  -h, --help      Show this help message\n\n";
     std::cout << "Example:\n";
@@ -35,7 +107,229 @@ long getFileSize(const std::string &filename) {
     return rc == 0 ? stat_buf.st_size : -1;
 }
 
+// Resources used by each command the tool ran, for the summary and the
+// stage timings file.
+struct StageUsage {
+    std::string name;
+    std::string command;
+    int exitStatus;
+    double startSeconds; // since the tool started
+    double wallSeconds;
+    double userSeconds;
+    double systemSeconds;
+    long peakRssKB;
+};
+static std::vector<StageUsage> stageUsage;
+static std::chrono::steady_clock::time_point toolStart;
+static long long toolStartEpochUs;
+
+static double seconds(const struct timeval &tv) {
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// Like system(), but waits with wait4() to record the CPU time and peak RSS
+// of the command. The shell's rusage includes the children it waited for,
+// so these are clang's or opt's own figures.
+static int runStage(const std::string &name, const std::string &cmd) {
+    std::cout.flush();
+    auto start = std::chrono::steady_clock::now();
+    pid_t pid = fork();
+    if (pid < 0) {
+        return -1;
+    }
+    if (pid == 0) {
+        execl("/bin/sh", "sh", "-c", cmd.c_str(), (char *)nullptr);
+        _exit(127);
+    }
+    int status = 0;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) < 0) {
+        return -1;
+    }
+    std::chrono::duration<double> wall = std::chrono::steady_clock::now() - start;
+    std::chrono::duration<double> offset = start - toolStart;
+#ifdef __APPLE__
+    long peakRssKB = usage.ru_maxrss / 1024; // bytes on macOS
+#else
+    long peakRssKB = usage.ru_maxrss;
+#endif
+    int exitStatus = WIFEXITED(status) ? WEXITSTATUS(status) : -WTERMSIG(status);
+    stageUsage.push_back({name, cmd, exitStatus, offset.count(), wall.count(), seconds(usage.ru_utime),
+                          seconds(usage.ru_stime), peakRssKB});
+    return status;
+}
+
+static std::string jsonString(const std::string &value) {
+    std::string out = "\"";
+    for (char c : value) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if ((unsigned char)c < 0x20) {
+            char escape[8];
+            std::snprintf(escape, sizeof(escape), "\\u%04x", c);
+            out += escape;
+        } else {
+            out += c;
+        }
+    }
+    return out + "\"";
+}
+
+// The stage timings file: one entry per command, in the order they ran.
+// Written on failure too, so build telemetry sees where a failed build
+// stopped. Negative exit statuses are the signal that killed the command.
+static void writeStageTimings(const std::string &path, const std::string &inputFile, const std::string &outputFile,
+                              bool succeeded, double totalSeconds) {
+    std::ofstream out(path);
+    if (!out) {
+        std::cerr << "Warning: Could not write " << path << "\n";
+        return;
+    }
+    char number[64];
+    out << "{\n";
+    out << "  \"version\": 1,\n";
+    out << "  \"input\": " << jsonString(inputFile) << ",\n";
+    out << "  \"output\": " << jsonString(outputFile) << ",\n";
+    out << "  \"succeeded\": " << (succeeded ? "true" : "false") << ",\n";
+    std::snprintf(number, sizeof(number), "%.6f", totalSeconds);
+    out << "  \"wall_seconds\": " << number << ",\n";
+    out << "  \"stages\": [";
+    for (size_t i = 0; i < stageUsage.size(); i++) {
+        const StageUsage &stage = stageUsage[i];
+        out << (i ? ",\n" : "\n") << "    {\"name\": " << jsonString(stage.name)
+            << ", \"command\": " << jsonString(stage.command) << ", \"exit_status\": " << stage.exitStatus;
+        std::snprintf(number, sizeof(number), "%.6f", stage.wallSeconds);
+        out << ", \"wall_seconds\": " << number;
+        std::snprintf(number, sizeof(number), "%.6f", stage.userSeconds);
+        out << ", \"user_seconds\": " << number;
+        std::snprintf(number, sizeof(number), "%.6f", stage.systemSeconds);
+        out << ", \"system_seconds\": " << number;
+        out << ", \"peak_rss_kb\": " << stage.peakRssKB << "}";
+    }
+    out << (stageUsage.empty() ? "]\n" : "\n  ]\n") << "}\n";
+}
+
+// Skips the JSON string starting at text[pos] (a quote) and returns the
+// index just past its closing quote.
+static size_t skipJsonString(const std::string &text, size_t pos) {
+    for (pos++; pos < text.size(); pos++) {
+        if (text[pos] == '\\') {
+            pos++;
+        } else if (text[pos] == '"') {
+            return pos + 1;
+        }
+    }
+    return pos;
+}
+
+// Reads a -ftime-trace / -time-trace file and returns its events with every
+// "ts" moved onto the tool's timeline, without the enclosing brackets. LLVM
+// writes "beginningOfTime" (microseconds since the epoch) next to the
+// events; without it the trace is assumed to start with its stage.
+static std::string childTraceEvents(const std::string &path, double stageStartSeconds) {
+    std::ifstream in(path);
+    if (!in) {
+        return "";
+    }
+    std::string text((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    size_t key = text.find("\"traceEvents\"");
+    size_t begin = key == std::string::npos ? key : text.find('[', key);
+    if (begin == std::string::npos) {
+        return "";
+    }
+    size_t end = begin + 1;
+    for (int depth = 1; end < text.size() && depth > 0;) {
+        char c = text[end];
+        if (c == '"') {
+            end = skipJsonString(text, end);
+            continue;
+        }
+        depth += (c == '[' || c == '{') ? 1 : (c == ']' || c == '}') ? -1 : 0;
+        end++;
+    }
+    long long offsetUs = (long long)(stageStartSeconds * 1e6);
+    size_t origin = text.find("\"beginningOfTime\"");
+    if (origin != std::string::npos && (origin < begin || origin >= end)) {
+        offsetUs = std::atoll(text.c_str() + text.find(':', origin) + 1) - toolStartEpochUs;
+    }
+
+    std::string events;
+    size_t pos = begin + 1;
+    while (pos < end - 1) {
+        if (text[pos] != '"') {
+            events += text[pos++];
+            continue;
+        }
+        size_t next = skipJsonString(text, pos);
+        bool isTs = text.compare(pos, next - pos, "\"ts\"") == 0;
+        events.append(text, pos, next - pos);
+        pos = next;
+        if (!isTs) {
+            continue;
+        }
+        while (pos < end && (text[pos] == ':' || text[pos] == ' ')) {
+            events += text[pos++];
+        }
+        char *numberEnd = nullptr;
+        long long ts = std::strtoll(text.c_str() + pos, &numberEnd, 10);
+        events += std::to_string(ts + offsetUs);
+        pos = numberEnd - text.c_str();
+    }
+    return events;
+}
+
+// Chrome Trace Event file (chrome://tracing, Perfetto) with one span per
+// stage on the tool's own row, and the spans clang and opt recorded (passes
+// per function, the obfuscator's transformations) on their rows, all on
+// one timeline. The children's trace files are merged in and removed.
+static void writeTrace(const std::string &path, const std::string &inputFile, const std::string &outputFile,
+                       double totalSeconds, const std::vector<std::pair<std::string, std::string>> &childTraces) {
+    std::ofstream out(path);
+    if (!out) {
+        std::cerr << "Warning: Could not write " << path << "\n";
+        return;
+    }
+    int pid = getpid();
+    char event[256];
+    out << "{\"traceEvents\": [\n";
+    std::snprintf(event, sizeof(event),
+                  "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %d, \"tid\": 0, \"args\": {\"name\": \"obfuscate\"}}", pid);
+    out << event;
+    std::snprintf(event, sizeof(event), ",\n{\"name\": \"obfuscate\", \"cat\": \"cli\", \"ph\": \"X\", \"pid\": %d, \"tid\": 0, "
+                  "\"ts\": 0, \"dur\": %lld, \"args\": {", pid, (long long)(totalSeconds * 1e6));
+    out << event << "\"input\": " << jsonString(inputFile) << ", \"output\": " << jsonString(outputFile) << "}}";
+    for (const StageUsage &stage : stageUsage) {
+        std::snprintf(event, sizeof(event), ",\n{\"name\": %s, \"cat\": \"stage\", \"ph\": \"X\", \"pid\": %d, \"tid\": 0, "
+                      "\"ts\": %lld, \"dur\": %lld, \"args\": {", jsonString(stage.name).c_str(), pid,
+                      (long long)(stage.startSeconds * 1e6), (long long)(stage.wallSeconds * 1e6));
+        out << event << "\"command\": " << jsonString(stage.command);
+        std::snprintf(event, sizeof(event), ", \"exit_status\": %d, \"user_seconds\": %.6f, \"system_seconds\": %.6f, "
+                      "\"peak_rss_kb\": %ld}}", stage.exitStatus, stage.userSeconds, stage.systemSeconds,
+                      stage.peakRssKB);
+        out << event;
+    }
+    for (const auto &child : childTraces) {
+        for (const StageUsage &stage : stageUsage) {
+            if (stage.name != child.first) {
+                continue;
+            }
+            std::string events = childTraceEvents(child.second, stage.startSeconds);
+            if (events.find_first_not_of(" \n") != std::string::npos) {
+                out << ",\n" << events;
+            }
+            break;
+        }
+        std::remove(child.second.c_str());
+    }
+    out << "\n], \"displayTimeUnit\": \"ms\"}\n";
+}
+
 int main(int argc, char *argv[]) {
+    toolStart = std::chrono::steady_clock::now();
+    toolStartEpochUs = std::chrono::duration_cast<std::chrono::microseconds>(
+                           std::chrono::system_clock::now().time_since_epoch())
+                           .count();
     if (argc < 2) {
         printUsage(argv[0]);
         return 1;
@@ -44,6 +338,7 @@ int main(int argc, char *argv[]) {
     std::string inputFile;
     std::string outputFile;
     std::string reportFile = "obfuscation_report.txt";
+    std::string reportFormat = "text";
     std::string level = "medium";
     std::string platform = "linux";
     bool emitLL = false;
@@ -51,10 +346,36 @@ int main(int argc, char *argv[]) {
     bool enableFakeLoops = true;
     bool enableInstrSub = true;
     bool forceOverwrite = false;
+    bool subAfterVectorize = false;
+    bool enableCleanup = true;
+    std::string extensionPoint;
+    bool enableFlatten = false;
+    bool enableConstObf = false;
+    bool indirectCalls = false;
+    std::string seed;
+    std::string overheadWarn;
+    std::string overheadLimit;
+    std::string memoryWarnMB;
+    std::string remarksFile;
+    bool instrument = false;
+    bool printPluginFlags = false;
+    std::string stageTimingsFile;
+    std::string traceFile;
+    std::string remarksFormat = "yaml";
+    std::string irGrowthWarnKB;
+    bool indirectBranches = false;
+    std::string mbaLevel;
+    std::string vmFunctions;
+    bool enableStrings = true;
+    std::string flattenDispatch = "switch";
+    std::string stringDecrypt = "global";
 
     bool bogusSet = false;
     bool loopsSet = false;
     bool instrSet = false;
+    bool flattenSet = false;
+    bool constObfSet = false;
+    bool indirectCallsSet = false;
     
     // Parse arguments
     for (int i = 1; i < argc; i++) {
@@ -67,6 +388,8 @@ int main(int argc, char *argv[]) {
             outputFile = argv[++i];
         } else if (arg == "-r" && i + 1 < argc) {
             reportFile = argv[++i];
+        } else if (arg == "--report-format" && i + 1 < argc) {
+            reportFormat = argv[++i];
         } else if (arg == "-l" && i + 1 < argc) {
             level = argv[++i];
         } else if (arg == "--windows") {
@@ -84,6 +407,66 @@ int main(int argc, char *argv[]) {
         } else if (arg == "--no-instr-sub") {
             enableInstrSub = false;
             instrSet = true;
+        } else if (arg == "--sub-after-vectorize") {
+            subAfterVectorize = true;
+        } else if (arg == "--no-string-encryption") {
+            enableStrings = false;
+        } else if (arg == "--string-decrypt" && i + 1 < argc) {
+            stringDecrypt = argv[++i];
+        } else if (arg == "--mba-level" && i + 1 < argc) {
+            mbaLevel = argv[++i];
+        } else if (arg == "--seed" && i + 1 < argc) {
+            seed = argv[++i];
+        } else if (arg == "--overhead-warn" && i + 1 < argc) {
+            overheadWarn = argv[++i];
+        } else if (arg == "--overhead-limit" && i + 1 < argc) {
+            overheadLimit = argv[++i];
+        } else if (arg == "--instrument") {
+            instrument = true;
+        } else if (arg == "--stage-timings" && i + 1 < argc) {
+            stageTimingsFile = argv[++i];
+        } else if (arg.rfind("--trace=", 0) == 0) {
+            traceFile = arg.substr(8);
+        } else if (arg == "--trace" && i + 1 < argc) {
+            traceFile = argv[++i];
+        } else if (arg == "--remarks" && i + 1 < argc) {
+            remarksFile = argv[++i];
+        } else if (arg == "--remarks-format" && i + 1 < argc) {
+            remarksFormat = argv[++i];
+        } else if (arg == "--memory-warn-mb" && i + 1 < argc) {
+            memoryWarnMB = argv[++i];
+        } else if (arg == "--ir-growth-warn-kb" && i + 1 < argc) {
+            irGrowthWarnKB = argv[++i];
+        } else if (arg == "--indirect-calls") {
+            indirectCalls = true;
+            indirectCallsSet = true;
+        } else if (arg == "--no-indirect-calls") {
+            indirectCalls = false;
+            indirectCallsSet = true;
+        } else if (arg == "--indirect-branches") {
+            indirectBranches = true;
+        } else if (arg == "--virtualize" && i + 1 < argc) {
+            vmFunctions = argv[++i];
+        } else if (arg == "--const-obf") {
+            enableConstObf = true;
+            constObfSet = true;
+        } else if (arg == "--no-const-obf") {
+            enableConstObf = false;
+            constObfSet = true;
+        } else if (arg == "--flatten") {
+            enableFlatten = true;
+            flattenSet = true;
+        } else if (arg == "--no-flatten") {
+            enableFlatten = false;
+            flattenSet = true;
+        } else if (arg == "--flatten-dispatch" && i + 1 < argc) {
+            flattenDispatch = argv[++i];
+        } else if (arg == "--no-cleanup") {
+            enableCleanup = false;
+        } else if (arg == "--ep" && i + 1 < argc) {
+            extensionPoint = argv[++i];
+        } else if (arg == "--print-plugin-flags") {
+            printPluginFlags = true;
         } else if (arg == "-f" || arg == "--force") {
             forceOverwrite = true;
         } else if (arg[0] != '-') {
@@ -91,19 +474,89 @@ int main(int argc, char *argv[]) {
         }
     }
 
-    // Apply level settings for any options not explicitly set by --no-* flags
-    if (level == "low") {
-        if (!bogusSet) enableBogusBlocks = false;
-        if (!loopsSet) enableFakeLoops = false;
-        if (!instrSet) enableInstrSub = true;
-    } else if (level == "high") {
-        if (!bogusSet) enableBogusBlocks = true;
-        if (!loopsSet) enableFakeLoops = true;
-        if (!instrSet) enableInstrSub = true;
-    } else { // medium is the default
-        if (!bogusSet) enableBogusBlocks = true;
-        if (!loopsSet) enableFakeLoops = false;
-        if (!instrSet) enableInstrSub = true;
+    // Apply the level preset to every setting not given explicitly
+    const LevelPreset *preset = findPreset(level);
+    if (!preset) {
+        std::cerr << "Error: Unknown obfuscation level '" << level << "' (use low, medium or high)\n";
+        return 1;
+    }
+    if (!bogusSet) enableBogusBlocks = preset->bogusBlocks;
+    if (!loopsSet) enableFakeLoops = preset->fakeLoops;
+    if (!instrSet) enableInstrSub = preset->instrSub;
+    if (!flattenSet) enableFlatten = preset->flatten;
+    if (!constObfSet) enableConstObf = preset->constObf;
+    if (!indirectCallsSet) indirectCalls = preset->indirectCalls;
+    if (mbaLevel.empty()) mbaLevel = std::to_string(preset->mbaLevel);
+    int opaqueTier = preset->opaqueTier;
+
+    // Plugin options for the settings above; opt gets them below.
+    std::string optFlags = " -bogus-blocks=" + std::string(enableBogusBlocks ? "true" : "false") +
+                           " -fake-loops=" + std::string(enableFakeLoops ? "true" : "false") +
+                           " -instr-sub=" + std::string(enableInstrSub ? "true" : "false") +
+                           " -opaque-tier=" + std::to_string(opaqueTier) +
+                           " -string-encryption=" + std::string(enableStrings ? "true" : "false") +
+                           " -string-decrypt=" + stringDecrypt +
+                           " -obf-level=" + level +
+                           " -report-format=" + reportFormat +
+                           " -bogus-density=" + std::to_string(preset->bogusDensity) +
+                           " -bogus-max=" + std::to_string(preset->bogusMax) +
+                           " -fake-loop-density=" + std::to_string(preset->fakeLoopDensity) +
+                           " -fake-loop-max=" + std::to_string(preset->fakeLoopMax);
+    if (subAfterVectorize) {
+        optFlags += " -instr-sub-late=true";
+    }
+    if (enableConstObf) {
+        optFlags += " -const-obf";
+    }
+    optFlags += " -mba-level=" + mbaLevel;
+    if (!seed.empty()) {
+        optFlags += " -obf-seed=" + seed;
+    }
+    if (!overheadWarn.empty()) {
+        optFlags += " -overhead-warn=" + overheadWarn;
+    }
+    if (!overheadLimit.empty()) {
+        optFlags += " -overhead-limit=" + overheadLimit;
+    }
+    if (!memoryWarnMB.empty()) {
+        optFlags += " -memory-warn-mb=" + memoryWarnMB;
+    }
+    if (instrument) {
+        optFlags += " -obf-instrument";
+    }
+    if (!irGrowthWarnKB.empty()) {
+        optFlags += " -ir-growth-warn-kb=" + irGrowthWarnKB;
+    }
+    if (indirectCalls) {
+        optFlags += " -indirect-calls";
+    }
+    if (indirectBranches) {
+        optFlags += " -indirect-branches";
+    }
+    if (!vmFunctions.empty()) {
+        optFlags += " -vm-functions=" + vmFunctions;
+    }
+    if (enableFlatten) {
+        optFlags += " -flatten -flatten-dispatch=" + flattenDispatch;
+    }
+
+    // --print-plugin-flags: the plugin options these settings map to, for
+    // obfuscate-cc to hand to clang as -mllvm options. The passes then run
+    // at an extension point of clang's own pipeline.
+    if (printPluginFlags) {
+        if (instrument) {
+            // The wrapper leaves link lines alone, so the counter runtime
+            // would be missing from every link.
+            std::cerr << "Error: --instrument is not supported with --print-plugin-flags (obfuscate-cc); "
+                         "use the CLI, which links the counter runtime\n";
+            return 1;
+        }
+        std::cout << optFlags.substr(1) << " -obf-ep=" << (extensionPoint.empty() ? "optimizer-last" : extensionPoint);
+        if (enableCleanup) {
+            std::cout << " -obf-ep-cleanup";
+        }
+        std::cout << "\n";
+        return 0;
     }
     
     if (inputFile.empty()) {
@@ -139,6 +592,26 @@ int main(int argc, char *argv[]) {
     if (reportFile.rfind(buildDir + "/", 0) != 0) { // Check if reportFile already starts with buildDir/
         reportFile = buildDir + "/" + reportFile;
     }
+    if (stageTimingsFile.empty()) {
+        stageTimingsFile = outputFile + "_stages.json";
+    }
+    auto elapsed = [&] {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - toolStart).count();
+    };
+    // With --trace, clang and opt record their own spans; these files are
+    // merged into the trace and removed. clang names its file after -o.
+    std::vector<std::pair<std::string, std::string>> childTraces;
+    if (!traceFile.empty()) {
+        childTraces.push_back({"compile", outputFile + ".json"});
+        childTraces.push_back({"obfuscate", outputFile + "_opt_trace.json"});
+    }
+    auto finish = [&](bool succeeded) {
+        double totalSeconds = elapsed();
+        writeStageTimings(stageTimingsFile, inputFile, outputFile, succeeded, totalSeconds);
+        if (!traceFile.empty()) {
+            writeTrace(traceFile, inputFile, outputFile, totalSeconds, childTraces);
+        }
+    };
 
 
     // Check if output file exists
@@ -163,10 +636,17 @@ int main(int argc, char *argv[]) {
     // Step 1: Compile to LLVM IR
     std::cout << "[1/5] Compiling to LLVM IR...\n";
     std::string bcFile = outputFile + ".bc";
-    std::string cmd = "clang++ -emit-llvm -c " + inputFile + " -o " + bcFile;
-    int result = system(cmd.c_str());
+    // Late substitution and cleanup need IR the optimizer is allowed to touch
+    // (no optnone), so the front end runs at -O2 but leaves all LLVM passes
+    // to opt.
+    bool optimizeIR = subAfterVectorize || enableCleanup || !extensionPoint.empty();
+    std::string frontendFlags = optimizeIR ? "-O2 -Xclang -disable-llvm-passes " : "";
+    std::string traceFlags = traceFile.empty() ? "" : "-ftime-trace ";
+    std::string cmd = "clang++ -emit-llvm -c " + frontendFlags + traceFlags + inputFile + " -o " + bcFile;
+    int result = runStage("compile", cmd);
     if (result != 0) {
         std::cerr << "Error: Compilation failed\n";
+        finish(false);
         return 1;
     }
     std::cout << "      Generated: " << bcFile << "\n";
@@ -179,21 +659,54 @@ int main(int argc, char *argv[]) {
     // Get the directory where this binary is located
     std::string pluginPath = "obfuscator_pass/build/ObfuscatorPass.so";
     
-        std::string passes = "obfuscator-pass";
+    std::string passes = "obfuscator-pass";
+    if (!extensionPoint.empty()) {
+        // The plugin adds itself to default<O2> at the requested extension
+        // point (and obfuscator-sub at the end when substitution is late).
+        passes = "default<O2>";
+    } else if (subAfterVectorize) {
+        passes = "obfuscator-pass,default<O2>";
+        if (enableInstrSub) {
+            passes += ",obfuscator-sub";
+        }
+    }
+    if (enableStrings && extensionPoint.empty()) {
+        // inferattrs marks libc callees nocapture, which stack decryption
+        // needs; -O2 has already run it at the extension points.
+        passes = "inferattrs,obfuscator-strings," + passes;
+    }
+    if (extensionPoint.empty()) {
+        // Virtualized functions are skipped by the other passes, so the VM
+        // runs first; at an extension point it runs at optimizer-last and
+        // earlier extension points leave the selected functions to it.
+        passes = "obfuscator-vm," + passes;
+    }
+    if (enableCleanup) {
+        passes += ",obfuscator-cleanup";
+    }
     
-    std::string optFlags = " -bogus-blocks=" + std::string(enableBogusBlocks ? "true" : "false") +
-                           " -fake-loops=" + std::string(enableFakeLoops ? "true" : "false") +
-                           " -instr-sub=" + std::string(enableInstrSub ? "true" : "false");
+    if (!extensionPoint.empty()) {
+        optFlags += " -obf-ep=" + extensionPoint;
+    }
+    if (!remarksFile.empty()) {
+        optFlags += " -pass-remarks-output=" + remarksFile + " -pass-remarks-format=" + remarksFormat +
+                    " -pass-remarks-filter=obfuscator";
+    }
+    if (!traceFile.empty()) {
+        // Granularity 0: keep every pass and transformation span, however short.
+        optFlags += " -time-trace -time-trace-granularity=0 -time-trace-file=" + childTraces[1].second;
+    }
 
     std::string optLogFile = buildDir + "/opt_output.log";
     cmd = "opt -load-pass-plugin=./" + pluginPath + 
           " -passes='" + passes + "'" + optFlags + " " + 
           " -report-file=" + reportFile + 
           " " + bcFile + " -o " + obfBcFile;
-    result = system(cmd.c_str());
+    result = runStage("obfuscate", cmd);
 	if (result != 0) {
     std::cerr << "Error: Obfuscation pass failed\n";
     std::cerr << "Make sure ObfuscatorPass.so is built\n";
+    finish(false);
     return 1;
 }
     if (result != 0) {
@@ -208,7 +721,7 @@ int main(int argc, char *argv[]) {
         std::cout << "[3/5] Emitting human-readable LLVM IR...\n";
         std::string llFile = outputFile + "_obf.ll";
         cmd = "llvm-dis " + obfBcFile + " -o " + llFile;
-        result = system(cmd.c_str());
+        result = runStage("llvm-dis", cmd);
         if (result != 0) {
             std::cerr << "Error: llvm-dis failed\n";
         } else {
@@ -217,29 +730,34 @@ int main(int argc, char *argv[]) {
     }
 
     // Step 4: Generate executable
+    // Cleaned-up IR only needs an optimizing backend; running clang's IR
+    // pipeline again would fold the substitutions back.
+    std::string codegenFlags = enableCleanup ? "-O2 -Xclang -disable-llvm-passes " : "";
+    // The counters' runtime is linked in as source, unobfuscated.
+    std::string linkInputs = obfBcFile + (instrument ? " obfuscator_pass/runtime/obf_counters.cpp -pthread" : "");
     std::cout << "[4/5] Generating executable...\n";
     if (platform == "windows") {
         // Cross-compile for Windows
         std::cout << "      Attempting Windows cross-compilation...\n";
-        cmd = "x86_64-w64-mingw32-g++ " + obfBcFile + " -o " + outputFile + ".exe -static-libgcc -static-libstdc++";
-        result = system(cmd.c_str());
+        cmd = "x86_64-w64-mingw32-g++ " + linkInputs + " -o " + outputFile + ".exe -static-libgcc -static-libstdc++";
+        result = runStage("link", cmd);
         if (result != 0) {
             std::cerr << "      Warning: Windows cross-compilation failed.\n";
             std::cerr << "      Make sure mingw-w64 is installed: sudo pacman -S mingw-w64-gcc\n";
             std::cerr << "      Falling back to LLVM cross-compile...\n";
-            cmd = "clang++ --target=x86_64-w64-mingw32 " + obfBcFile + " -o " + outputFile + ".exe 2>&1";
-            result = system(cmd.c_str());
+            cmd = "clang++ --target=x86_64-w64-mingw32 " + codegenFlags + linkInputs + " -o " + outputFile + ".exe 2>&1";
+            result = runStage("link", cmd);
             if (result != 0) {
                 std::cerr << "      Error: Windows compilation failed. Generating Linux binary instead.\n";
                 platform = "linux";
-                cmd = "clang++ " + obfBcFile + " -o " + outputFile;
-                system(cmd.c_str());
+                cmd = "clang++ " + codegenFlags + linkInputs + " -o " + outputFile;
+                result = runStage("link", cmd);
             }
         }
     } else {
         // Compile for Linux
-        cmd = "clang++ " + obfBcFile + " -o " + outputFile;
-        result = system(cmd.c_str());
+        cmd = "clang++ " + codegenFlags + linkInputs + " -o " + outputFile;
+        result = runStage("link", cmd);
     }
     
     std::string finalBinary = outputFile + (platform == "windows" ? ".exe" : "");
@@ -266,7 +784,30 @@ int main(int argc, char *argv[]) {
     std::cout << "========================================\n";
     std::cout << "Output binary: " << outputFile << (platform == "windows" ? ".exe" : "") << "\n";
     std::cout << "Report: " << reportFile << "\n";
+    std::cout << "Stage timings: " << stageTimingsFile << "\n\n";
+    long memoryLimitKB = memoryWarnMB.empty() ? 0 : std::atol(memoryWarnMB.c_str()) * 1024;
+    char line[160];
+    std::snprintf(line, sizeof(line), "%-10s %9s %9s %9s %10s\n", "Stage", "Wall", "User", "System", "Peak RSS");
+    std::cout << line;
+    double stagesWall = 0;
+    for (const StageUsage &stage : stageUsage) {
+        std::snprintf(line, sizeof(line), "%-10s %8.2fs %8.2fs %8.2fs %7.1f MB%s\n", stage.name.c_str(),
+                      stage.wallSeconds, stage.userSeconds, stage.systemSeconds, stage.peakRssKB / 1024.0,
+                      memoryLimitKB > 0 && stage.peakRssKB > memoryLimitKB ? "  [over --memory-warn-mb]" : "");
+        std::cout << line;
+        stagesWall += stage.wallSeconds;
+    }
+    double totalWall = elapsed();
+    std::snprintf(line, sizeof(line), "%-10s %8.2fs  (%.2fs outside the steps above)\n", "Total", totalWall,
+                  totalWall - stagesWall);
+    std::cout << line;
+    if (!traceFile.empty()) {
+        std::cout << "Trace: " << traceFile << "\n";
+    }
     std::cout << "========================================\n";
+    finish(result == 0);
     
-    return 0;
+    // A failed link fails the run, so scripts do not mistake a stale or
+    // missing binary for the obfuscated one.
+    return result == 0 ? 0 : 1;
 }
@@ -6,13 +6,47 @@
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/InstrTypes.h"
+#include "llvm/IR/InlineAsm.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/MapVector.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/BranchProbabilityInfo.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/Analysis/ProfileSummaryInfo.h"
+#include "llvm/IR/GetElementPtrTypeIterator.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/IntrinsicInst.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/Local.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+#include "llvm/Transforms/Utils/PromoteMemToReg.h"
+#include "llvm/Transforms/InstCombine/InstCombine.h"
+#include "llvm/Transforms/Scalar/DCE.h"
+#include "llvm/Transforms/Scalar/GVN.h"
+#include "llvm/Transforms/Scalar/SROA.h"
+#include "llvm/Transforms/Scalar/Sink.h"
 #include "llvm/Support/Casting.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/TimeProfiler.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/Support/xxhash.h"
 #include <random>
+#include <map>
+#include <cstdio>
 #include <fstream>
 #include <chrono>
 #include <ctime>
+#ifdef LLVM_ON_UNIX
+#include <sys/resource.h>
+#endif
 
 #include "llvm/Support/CommandLine.h"
 
@@ -22,29 +56,426 @@ using namespace llvm;
 namespace {
 
 static cl::opt<std::string> ReportFileArg("report-file", cl::desc("Path to the obfuscation report file"), cl::init(""));
+enum class ReportFormat { Text, JSON };
+static cl::opt<ReportFormat> ReportFormatOpt("report-format", cl::desc("Format of the report file"),
+    cl::values(clEnumValN(ReportFormat::Text, "text", "Human-readable module totals"),
+               clEnumValN(ReportFormat::JSON, "json", "Module totals plus one record per function")),
+    cl::init(ReportFormat::Text));
+static cl::opt<std::string> ObfLevelOpt("obf-level", cl::desc("Name of the preset the options came from (the obfuscate CLI's -l), shown in the report"), cl::init("custom"));
 
 // Command line flags to enable/disable obfuscations
 static cl::opt<bool> BogusBlocksOpt("bogus-blocks", cl::desc("Enable bogus block obfuscation"), cl::init(true));
 static cl::opt<bool> FakeLoopsOpt("fake-loops", cl::desc("Enable fake loop obfuscation"), cl::init(true));
 static cl::opt<bool> InstrSubOpt("instr-sub", cl::desc("Enable instruction substitution obfuscation"), cl::init(true));
 
+// Where bogus blocks and fake loops go: each eligible block is a candidate
+// with the given probability, and at most density% of the eligible blocks
+// (at least one) and max per function are picked from the candidates.
+static cl::opt<double> BogusProbOpt("bogus-prob", cl::desc("Chance (0-1) that an eligible block is a bogus block candidate"), cl::init(1.0));
+static cl::opt<unsigned> BogusDensityOpt("bogus-density", cl::desc("Bogus blocks per function, in percent of its eligible blocks"), cl::init(25));
+static cl::opt<unsigned> BogusMaxOpt("bogus-max", cl::desc("Maximum bogus blocks per function"), cl::init(32));
+static cl::opt<double> FakeLoopProbOpt("fake-loop-prob", cl::desc("Chance (0-1) that an eligible block is a fake loop candidate"), cl::init(1.0));
+static cl::opt<unsigned> FakeLoopDensityOpt("fake-loop-density", cl::desc("Fake loops per function, in percent of its eligible blocks"), cl::init(10));
+static cl::opt<unsigned> FakeLoopMaxOpt("fake-loop-max", cl::desc("Maximum fake loops per function"), cl::init(8));
+static cl::opt<uint64_t> SeedOpt("obf-seed", cl::desc("Seed for the random choices; the same seed and input give the same output"), cl::init(0));
+static cl::opt<bool> InstrSubVectorOpt("instr-sub-vector", cl::desc("Substitute vector integer operations with vector-native sequences"), cl::init(true));
+static cl::opt<unsigned> OpaqueTierOpt("opaque-tier", cl::desc("Opaque predicate tier: 0 = cheap, 1 = number-theoretic, 2 = aliasing memory"), cl::init(1));
+static cl::opt<bool> ConstObfOpt("const-obf", cl::desc("Encode integer immediates and decode them outside of loops"), cl::init(false));
+static cl::opt<unsigned> MBALevelOpt("mba-level", cl::desc("Substitution complexity: 0 = a - (-b) for adds only, 1..7 = MBA rewrites of add/sub/xor/and/or/mul"), cl::init(1));
+static cl::opt<bool> IndirectCallsOpt("indirect-calls", cl::desc("Route direct calls through the function's encoded target table"), cl::init(false));
+static cl::opt<bool> IndirectBranchesOpt("indirect-branches", cl::desc("Route conditional branches outside loops through the function's encoded target table"), cl::init(false));
+static cl::opt<double> IndirectCallCyclesOpt("indirect-call-cycles", cl::desc("Extra cycles per routed call measured by benchmarks/run_indirect_bench.sh, shown in the report"), cl::init(0));
+static cl::opt<double> OverheadWarnOpt("overhead-warn", cl::desc("Warn about functions whose estimated cost grows by more than this factor (0 = never)"), cl::init(10.0));
+static cl::opt<double> OverheadLimitOpt("overhead-limit", cl::desc("Restore the original body of functions whose estimated cost grows by more than this factor (0 = never)"), cl::init(0));
+static cl::opt<unsigned> MemoryWarnOpt("memory-warn-mb", cl::desc("Flag stages after which the peak RSS of the process is above this many MB (0 = never)"), cl::init(0));
+static cl::opt<unsigned> IRGrowthWarnOpt("ir-growth-warn-kb", cl::desc("Flag functions whose IR grows by more than this many KB (0 = never)"), cl::init(0));
+static cl::opt<bool> InstrumentOpt("obf-instrument", cl::desc("Count executions of inserted code per function (link obfuscator_pass/runtime/obf_counters.cpp)"), cl::init(false));
+static cl::opt<bool> InstrSubLateOpt("instr-sub-late", cl::desc("Leave substitution to the obfuscator-sub pass so it can run after vectorization"), cl::init(false));
+
+// Selective virtualization (obfuscator-vm)
+static cl::list<std::string> VMFunctionsOpt("vm-functions", cl::desc("Functions to virtualize, in addition to those annotated obf:virtualize"), cl::CommaSeparated);
+static cl::opt<bool> VMCountOpsOpt("vm-count-ops", cl::desc("Count executed bytecode ops in the global __obf_vm_ops (for benchmarking)"), cl::init(false));
+
+static cl::opt<bool> StringEncryptionOpt("string-encryption", cl::desc("Encrypt constant C strings (obfuscator-strings, and the extension-point pipelines)"), cl::init(true));
+enum class StringDecryptMode { Global, Stack };
+static cl::opt<StringDecryptMode> StringDecryptOpt("string-decrypt", cl::desc("Where encrypted strings are decrypted"),
+    cl::values(clEnumValN(StringDecryptMode::Global, "global", "Once per process into a lazily filled private buffer"),
+               clEnumValN(StringDecryptMode::Stack, "stack", "At each call into a stack buffer that is wiped afterwards")),
+    cl::init(StringDecryptMode::Global));
+static cl::opt<unsigned> StringStackMaxOpt("string-stack-max", cl::desc("Largest string (bytes) decrypted on the stack in -string-decrypt=stack mode"), cl::init(256));
+
+// Control-flow flattening and its dispatcher back end
+enum class FlattenDispatch { Switch, IndirectBr };
+static cl::opt<bool> FlattenOpt("flatten", cl::desc("Enable control-flow flattening"), cl::init(false));
+static cl::opt<FlattenDispatch> FlattenDispatchOpt("flatten-dispatch", cl::desc("Dispatcher used by control-flow flattening"),
+    cl::values(clEnumValN(FlattenDispatch::Switch, "switch", "Central switch lowered to a dense jump table"),
+               clEnumValN(FlattenDispatch::IndirectBr, "indirectbr", "Per-block indirectbr through an encoded-state address table")),
+    cl::init(FlattenDispatch::Switch));
+
+// Where the pass inserts itself into the standard -O1/-O2/-O3 pipelines
+// (e.g. clang -fpass-plugin or opt -passes='default<O2>'). The default keeps
+// the pass out of those pipelines; it then only runs when named explicitly.
+enum class ExtensionPoint { None, PipelineStart, ScalarOptimizerLate, VectorizerStart, OptimizerLast };
+static cl::opt<ExtensionPoint> ExtensionPointOpt("obf-ep", cl::desc("Extension point to register the obfuscator at in the default pipelines"),
+    cl::values(clEnumValN(ExtensionPoint::None, "none", "Only run when named in -passes"),
+               clEnumValN(ExtensionPoint::PipelineStart, "pipeline-start", "Before any optimization"),
+               clEnumValN(ExtensionPoint::ScalarOptimizerLate, "scalar-late", "After the function simplification passes"),
+               clEnumValN(ExtensionPoint::VectorizerStart, "vectorizer-start", "Right before the loop and SLP vectorizers"),
+               clEnumValN(ExtensionPoint::OptimizerLast, "optimizer-last", "After the whole optimization pipeline")),
+    cl::init(ExtensionPoint::None));
+static cl::opt<bool> EPCleanupOpt("obf-ep-cleanup", cl::desc("With -obf-ep, also run obfuscator-cleanup at the end of the pipeline"), cl::init(false));
+
+// Peak resident set size of this process so far, in KB (0 where unknown).
+static long peakRSSKB() {
+#ifdef LLVM_ON_UNIX
+    struct rusage RU;
+    if (getrusage(RUSAGE_SELF, &RU) != 0) {
+        return 0;
+    }
+#ifdef __APPLE__
+    return RU.ru_maxrss / 1024;
+#else
+    return RU.ru_maxrss;
+#endif
+#else
+    return 0;
+#endif
+}
+
+// Lower bound on the memory F's IR takes: the block and instruction objects
+// and their operand lists. Subclass fields, names and metadata come on top.
+static long irBytes(const Function &F) {
+    long Bytes = F.size() * sizeof(BasicBlock);
+    for (const BasicBlock &BB : F) {
+        for (const Instruction &I : BB) {
+            Bytes += sizeof(Instruction) + I.getNumOperands() * sizeof(Use);
+        }
+    }
+    return Bytes;
+}
+
+static long irBytes(const Module &M) {
+    long Bytes = M.global_size() * sizeof(GlobalVariable);
+    for (const Function &F : M) {
+        Bytes += irBytes(F);
+    }
+    return Bytes;
+}
+
 // Statistics tracking structure
 struct ObfuscationStats {
     int stringObfuscations = 0;
+    int stringStackUses = 0;
+    long stringSharedBytes = 0;
+    long stringPrivateBytes = 0;
     int bogusBlocksAdded = 0;
     int fakeLoopsAdded = 0;
     int instructionSubstitutions = 0;
+    long substitutionExtraInstructions = 0;
+    int constantsEncoded = 0;
+    int indirectCalls = 0;
+    int indirectBranches = 0;
+    int indirectTables = 0;
+    long indirectTableBytes = 0;
+    int functionsVirtualized = 0;
+    int vmRejected = 0;
+    long vmBytecodeWords = 0;
+    long vmHandlers = 0;
+
+    // MBA rewrites per (level, opcode): count, total instructions and
+    // dependency depth of the generated expressions.
+    struct MBAShapeStats {
+        int rewrites = 0;
+        long instructions = 0;
+        long depthSum = 0;
+        unsigned maxDepth = 0;
+    };
+    std::map<std::pair<unsigned, std::string>, MBAShapeStats> mbaShapes;
+
+    void recordMBA(unsigned level, const char *opcode, unsigned instructions, unsigned depth) {
+        MBAShapeStats &S = mbaShapes[{level, opcode}];
+        S.rewrites++;
+        S.instructions += instructions;
+        S.depthSum += depth;
+        S.maxDepth = std::max(S.maxDepth, depth);
+    }
+    int opaquePredicates = 0;
+    int flattenedFunctions = 0;
+    int flattenedBlocks = 0;
+    int opaquePredicateCycles = 0;
     int totalInstructions = 0;
     int totalBasicBlocks = 0;
     int functionsObfuscated = 0;
+    int functionsSkipped = 0;
+    double costBefore = 0;
+    double costAfter = 0;
+    std::vector<std::string> overWarn;
+    std::vector<std::string> rolledBack;
     std::string inputFile;
     std::string outputFile;
     std::string timestamp;
+
+    // The totals obfuscator-pass adds to while transforming one function,
+    // so a rollback can take that function's work back out of the report.
+    struct TransformTotals {
+        int functionsObfuscated;
+        int bogusBlocksAdded;
+        int fakeLoopsAdded;
+        int instructionSubstitutions;
+        long substitutionExtraInstructions;
+        int constantsEncoded;
+        int opaquePredicates;
+        int opaquePredicateCycles;
+        int indirectCalls;
+        int indirectBranches;
+        int indirectTables;
+        long indirectTableBytes;
+        int flattenedFunctions;
+        int flattenedBlocks;
+        std::map<std::pair<unsigned, std::string>, MBAShapeStats> mbaShapes;
+    };
+
+    TransformTotals transformTotals() const {
+        return {functionsObfuscated, bogusBlocksAdded, fakeLoopsAdded, instructionSubstitutions,
+                substitutionExtraInstructions, constantsEncoded, opaquePredicates, opaquePredicateCycles,
+                indirectCalls, indirectBranches, indirectTables, indirectTableBytes, flattenedFunctions,
+                flattenedBlocks, mbaShapes};
+    }
+
+    void restoreTransformTotals(const TransformTotals &T) {
+        functionsObfuscated = T.functionsObfuscated;
+        bogusBlocksAdded = T.bogusBlocksAdded;
+        fakeLoopsAdded = T.fakeLoopsAdded;
+        instructionSubstitutions = T.instructionSubstitutions;
+        substitutionExtraInstructions = T.substitutionExtraInstructions;
+        constantsEncoded = T.constantsEncoded;
+        opaquePredicates = T.opaquePredicates;
+        opaquePredicateCycles = T.opaquePredicateCycles;
+        indirectCalls = T.indirectCalls;
+        indirectBranches = T.indirectBranches;
+        indirectTables = T.indirectTables;
+        indirectTableBytes = T.indirectTableBytes;
+        flattenedFunctions = T.flattenedFunctions;
+        flattenedBlocks = T.flattenedBlocks;
+        mbaShapes = T.mbaShapes;
+    }
+
+    // One record per function, in the order functions were first seen. The
+    // "before" counts are taken when the first pass reaches the function,
+    // the "after" counts when the last one is done with it.
+    struct FunctionRecord {
+        std::string name;
+        unsigned instructionsBefore = 0;
+        unsigned instructionsAfter = 0;
+        unsigned blocksBefore = 0;
+        unsigned blocksAfter = 0;
+        std::vector<std::string> transforms;
+        std::string skipped;
+        long estimatedCycles = 0;
+        // Block-frequency weighted TTI latency per call, around obfuscator-pass.
+        double costBefore = 0;
+        double costAfter = 0;
+        std::string overhead;
+        long irBytesBefore = 0;
+        long irBytesAfter = 0;
+        long peakRSSGrowthKB = 0;
+        bool overIRGrowth = false;
+        int predicateTier = -1;
+        int predicateCycles = 0;
+        double passTimeMs = 0;
+    };
+    std::vector<FunctionRecord> functions;
+    std::map<std::string, size_t> functionIndex;
+
+    size_t record(const Function &F) {
+        auto Inserted = functionIndex.insert({F.getName().str(), functions.size()});
+        if (Inserted.second) {
+            FunctionRecord R;
+            R.name = F.getName().str();
+            R.instructionsBefore = R.instructionsAfter = F.getInstructionCount();
+            R.blocksBefore = R.blocksAfter = F.size();
+            R.irBytesBefore = R.irBytesAfter = irBytes(F);
+            functions.push_back(R);
+        }
+        return Inserted.first->second;
+    }
+
+    // Memory per pass (stage), in the order the stages first ran.
+    struct StageMemory {
+        std::string name;
+        long peakRSSKB = 0;
+        long irGrowthBytes = 0;
+        bool overLimit = false;
+    };
+    std::vector<StageMemory> stages;
+
+    // Called when a stage is done with a function or module: adds the IR it
+    // grew by and samples the peak RSS.
+    void noteStage(const char *Name, long IRGrowth) {
+        auto It = std::find_if(stages.begin(), stages.end(), [&](const StageMemory &S) { return S.name == Name; });
+        if (It == stages.end()) {
+            stages.push_back(StageMemory());
+            stages.back().name = Name;
+            It = stages.end() - 1;
+        }
+        It->irGrowthBytes += IRGrowth;
+        It->peakRSSKB = std::max(It->peakRSSKB, peakRSSKB());
+        if (MemoryWarnOpt > 0 && !It->overLimit && It->peakRSSKB > (long)MemoryWarnOpt * 1024) {
+            It->overLimit = true;
+            errs() << "warning: " << Name << ": peak RSS " << It->peakRSSKB / 1024 << " MB, over -memory-warn-mb="
+                   << MemoryWarnOpt << "\n";
+        }
+    }
+
+    // Passes only collect; the report is written once, when the plugin is
+    // unloaded at exit. The options it reads are defined above and outlive
+    // this object.
+    bool reportPending = false;
+
+    ~ObfuscationStats() {
+        if (reportPending) {
+            writeReport(ReportFileArg.getValue());
+        }
+    }
+
+    static std::string currentTime() {
+        auto time = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+        char timeStr[100];
+        std::strftime(timeStr, sizeof(timeStr), "%Y-%m-%d %H:%M:%S", std::localtime(&time));
+        return timeStr;
+    }
+
+    void writeJSONReport(const std::string &reportFile) {
+        std::error_code EC;
+        raw_fd_ostream OS(reportFile, EC);
+        if (EC) {
+            errs() << "Error: Could not open report file for writing: " << reportFile << " (" << EC.message() << ")\n";
+            return;
+        }
+        json::OStream J(OS, 2);
+        J.object([&] {
+            J.attribute("format_version", 1);
+            J.attribute("generated", currentTime());
+            J.attributeObject("options", [&] {
+                J.attribute("level", ObfLevelOpt.getValue());
+                J.attribute("string_encryption", (bool)StringEncryptionOpt);
+                J.attribute("bogus_blocks", (bool)BogusBlocksOpt);
+                J.attribute("fake_loops", (bool)FakeLoopsOpt);
+                J.attribute("instruction_substitution", (bool)InstrSubOpt);
+                J.attribute("mba_level", (unsigned)MBALevelOpt);
+                J.attribute("flatten", (bool)FlattenOpt);
+                J.attribute("constant_encoding", (bool)ConstObfOpt);
+                J.attribute("indirect_calls", (bool)IndirectCallsOpt);
+                J.attribute("indirect_branches", (bool)IndirectBranchesOpt);
+                J.attribute("opaque_tier", (unsigned)OpaqueTierOpt);
+                J.attribute("seed", (uint64_t)SeedOpt);
+                J.attribute("overhead_warn", (double)OverheadWarnOpt);
+                J.attribute("overhead_limit", (double)OverheadLimitOpt);
+                J.attribute("memory_warn_mb", (unsigned)MemoryWarnOpt);
+                J.attribute("ir_growth_warn_kb", (unsigned)IRGrowthWarnOpt);
+                J.attribute("indirect_call_cycles", (double)IndirectCallCyclesOpt);
+                J.attribute("instrument", (bool)InstrumentOpt);
+            });
+            J.attributeObject("totals", [&] {
+                J.attribute("functions_obfuscated", functionsObfuscated);
+                J.attribute("functions_skipped", functionsSkipped);
+                J.attribute("instructions", totalInstructions);
+                J.attribute("basic_blocks", totalBasicBlocks);
+                J.attribute("strings_encrypted", stringObfuscations);
+                J.attribute("string_stack_uses", stringStackUses);
+                J.attribute("string_shared_bytes", stringSharedBytes);
+                J.attribute("string_private_bytes", stringPrivateBytes);
+                J.attribute("bogus_blocks", bogusBlocksAdded);
+                J.attribute("fake_loops", fakeLoopsAdded);
+                J.attribute("substitutions", instructionSubstitutions);
+                J.attribute("constants_encoded", constantsEncoded);
+                J.attribute("opaque_predicates", opaquePredicates);
+                J.attribute("opaque_predicate_cycles", opaquePredicateCycles);
+                J.attribute("flattened_functions", flattenedFunctions);
+                J.attribute("flattened_blocks", flattenedBlocks);
+                J.attribute("indirect_calls", indirectCalls);
+                J.attribute("indirect_branches", indirectBranches);
+                J.attribute("indirect_tables", indirectTables);
+                J.attribute("functions_virtualized", functionsVirtualized);
+                J.attribute("vm_rejected", vmRejected);
+                J.attribute("vm_bytecode_words", vmBytecodeWords);
+                J.attribute("vm_handlers", vmHandlers);
+                J.attribute("cost_before", costBefore);
+                J.attribute("cost_after", costAfter);
+                J.attribute("functions_over_warn", (int64_t)overWarn.size());
+                J.attribute("functions_rolled_back", (int64_t)rolledBack.size());
+                J.attribute("peak_rss_kb", (int64_t)peakRSSKB());
+            });
+            J.attributeArray("stages", [&] {
+                for (const StageMemory &S : stages) {
+                    J.object([&] {
+                        J.attribute("name", S.name);
+                        J.attribute("peak_rss_kb", (int64_t)S.peakRSSKB);
+                        J.attribute("ir_growth_bytes", (int64_t)S.irGrowthBytes);
+                        J.attribute("over_limit", S.overLimit);
+                    });
+                }
+            });
+            J.attributeArray("mba", [&] {
+                for (auto &Entry : mbaShapes) {
+                    J.object([&] {
+                        J.attribute("level", Entry.first.first);
+                        J.attribute("opcode", Entry.first.second);
+                        J.attribute("rewrites", Entry.second.rewrites);
+                        J.attribute("instructions", Entry.second.instructions);
+                        J.attribute("max_depth", Entry.second.maxDepth);
+                    });
+                }
+            });
+            J.attributeArray("functions", [&] {
+                for (const FunctionRecord &R : functions) {
+                    J.object([&] {
+                        J.attribute("name", R.name);
+                        J.attribute("instructions_before", R.instructionsBefore);
+                        J.attribute("instructions_after", R.instructionsAfter);
+                        J.attribute("blocks_before", R.blocksBefore);
+                        J.attribute("blocks_after", R.blocksAfter);
+                        J.attributeArray("transforms", [&] {
+                            for (const std::string &T : R.transforms) {
+                                J.value(T);
+                            }
+                        });
+                        if (!R.skipped.empty()) {
+                            J.attribute("skipped", R.skipped);
+                        }
+                        J.attribute("estimated_added_cycles", R.estimatedCycles);
+                        J.attribute("cost_before", R.costBefore);
+                        J.attribute("cost_after", R.costAfter);
+                        if (!R.overhead.empty()) {
+                            J.attribute("overhead", R.overhead);
+                        }
+                        J.attribute("ir_bytes_before", (int64_t)R.irBytesBefore);
+                        J.attribute("ir_bytes_after", (int64_t)R.irBytesAfter);
+                        J.attribute("peak_rss_growth_kb", (int64_t)R.peakRSSGrowthKB);
+                        if (R.overIRGrowth) {
+                            J.attribute("over_ir_growth", true);
+                        }
+                        if (R.predicateTier >= 0) {
+                            J.attribute("opaque_tier", R.predicateTier);
+                            J.attribute("predicate_cycles", R.predicateCycles);
+                        }
+                        J.attribute("pass_time_ms", R.passTimeMs);
+                    });
+                }
+            });
+        });
+        OS << "\n";
+        errs() << "[Report] Generated: " << reportFile << "\n";
+    }
     
     void writeReport(const std::string &reportFile) {
         if (reportFile.empty()) {
             return;
         }
+        if (ReportFormatOpt == ReportFormat::JSON) {
+            writeJSONReport(reportFile);
+            return;
+        }
         std::ofstream report(reportFile);
         if (!report.is_open()) {
             errs() << "Error: Could not open report file for writing: " << reportFile << "\n";
@@ -62,24 +493,24 @@ struct ObfuscationStats {
             return;
         }
         
-        auto now = std::chrono::system_clock::now();
-        auto time = std::chrono::system_clock::to_time_t(now);
-        char timeStr[100];
-        std::strftime(timeStr, sizeof(timeStr), "%Y-%m-%d %H:%M:%S", std::localtime(&time));
-        
         report << "========================================\n";
         report << "LLVM Obfuscation Report\n";
         report << "========================================\n";
-        report << "Generation Time: " << timeStr << "\n";
+        report << "Generation Time: " << currentTime() << "\n";
         report << "Input File: " << inputFile << "\n";
         report << "Output File: " << outputFile << "\n";
         report << "\n";
         report << "--- Input Parameters ---\n";
-        report << "Obfuscation Level: Standard\n";
-        report << "String Encryption: Enabled\n";
-        report << "Bogus Code Injection: Enabled\n";
-        report << "Fake Loop Insertion: Enabled\n";
-        report << "Instruction Substitution: Enabled\n";
+        report << "Obfuscation Level: " << ObfLevelOpt << "\n";
+        report << "String Encryption: " << (StringEncryptionOpt ? "Enabled" : "Disabled") << "\n";
+        report << "Bogus Code Injection: " << (BogusBlocksOpt ? "Enabled" : "Disabled") << "\n";
+        report << "Fake Loop Insertion: " << (FakeLoopsOpt ? "Enabled" : "Disabled") << "\n";
+        report << "Instruction Substitution: "
+               << (InstrSubOpt ? "Enabled (MBA level " + std::to_string(MBALevelOpt) + ")" : "Disabled") << "\n";
+        report << "Control-Flow Flattening: " << (FlattenOpt ? "Enabled" : "Disabled") << "\n";
+        report << "Constant Encoding: " << (ConstObfOpt ? "Enabled" : "Disabled") << "\n";
+        report << "Indirect Calls: " << (IndirectCallsOpt ? "Enabled" : "Disabled") << "\n";
+        report << "Opaque Predicate Tier: " << OpaqueTierOpt << "\n";
         report << "\n";
         report << "--- Obfuscation Statistics ---\n";
         report << "Total Instructions Processed: " << totalInstructions << "\n";
@@ -88,6 +519,96 @@ struct ObfuscationStats {
         report << "Bogus Code Blocks Added: " << bogusBlocksAdded << "\n";
         report << "Fake Loops Inserted: " << fakeLoopsAdded << "\n";
         report << "Instruction Substitutions: " << instructionSubstitutions << "\n";
+        report << "Constants Encoded: " << constantsEncoded << "\n";
+        report << "Flattened Functions: " << flattenedFunctions << " (" << flattenedBlocks << " blocks, "
+               << (FlattenDispatchOpt == FlattenDispatch::Switch ? "switch" : "indirectbr") << " dispatch)\n";
+        {
+            char line[160];
+            std::snprintf(line, sizeof(line), "Density: bogus p=%.2f %u%% max %u, fake loops p=%.2f %u%% max %u (seed %llu)\n",
+                          (double)BogusProbOpt, (unsigned)BogusDensityOpt, (unsigned)BogusMaxOpt, (double)FakeLoopProbOpt,
+                          (unsigned)FakeLoopDensityOpt, (unsigned)FakeLoopMaxOpt, (unsigned long long)SeedOpt);
+            report << line;
+        }
+        report << "Opaque Predicates: " << opaquePredicates << " (tier " << OpaqueTierOpt << ")\n";
+        report << "Estimated Predicate Cost: ~" << opaquePredicateCycles << " cycles per full pass over inserted branches\n";
+        report << "\n";
+        report << "--- MBA Substitution ---\n";
+        if (mbaShapes.empty()) {
+            report << "No MBA rewrites\n";
+        }
+        for (auto &Entry : mbaShapes) {
+            const MBAShapeStats &S = Entry.second;
+            char line[128];
+            std::snprintf(line, sizeof(line), "Level %u %s: %d rewrites, %.1f instructions, depth %.1f avg / %u max\n",
+                          Entry.first.first, Entry.first.second.c_str(), S.rewrites,
+                          (double)S.instructions / S.rewrites, (double)S.depthSum / S.rewrites, S.maxDepth);
+            report << line;
+        }
+        report << "\n";
+        report << "--- Estimated Overhead ---\n";
+        {
+            char line[160];
+            std::snprintf(line, sizeof(line), "Weighted Cost (TTI latency per call): %.1f -> %.1f (x%.2f)\n",
+                          costBefore, costAfter, costBefore > 0 ? costAfter / costBefore : 1.0);
+            report << line;
+        }
+        report << "Functions Over Warning Threshold (x" << OverheadWarnOpt << "): " << overWarn.size() << "\n";
+        for (const std::string &Name : overWarn) {
+            report << "  " << Name << "\n";
+        }
+        report << "Functions Rolled Back (limit x" << OverheadLimitOpt << "): " << rolledBack.size() << "\n";
+        for (const std::string &Name : rolledBack) {
+            report << "  " << Name << "\n";
+        }
+        report << "\n";
+        report << "--- Memory ---\n";
+        report << "Peak RSS: " << peakRSSKB() / 1024 << " MB\n";
+        for (const StageMemory &S : stages) {
+            char line[192];
+            std::snprintf(line, sizeof(line), "%s: peak RSS %.1f MB, IR %+.1f KB%s\n", S.name.c_str(),
+                          S.peakRSSKB / 1024.0, S.irGrowthBytes / 1024.0, S.overLimit ? " [over -memory-warn-mb]" : "");
+            report << line;
+        }
+        {
+            long growthKB = 0;
+            int flagged = 0;
+            for (const FunctionRecord &R : functions) {
+                growthKB = std::max(growthKB, (R.irBytesAfter - R.irBytesBefore) / 1024);
+                flagged += R.overIRGrowth;
+            }
+            report << "Largest Function IR Growth: " << growthKB << " KB\n";
+            report << "Functions Over -ir-growth-warn-kb (" << IRGrowthWarnOpt << "): " << flagged << "\n";
+            for (const FunctionRecord &R : functions) {
+                if (R.overIRGrowth) {
+                    report << "  " << R.name << " (+" << (R.irBytesAfter - R.irBytesBefore) / 1024 << " KB)\n";
+                }
+            }
+        }
+        report << "\n";
+        report << "--- Indirect Calls and Branches ---\n";
+        report << "Routed Calls: " << indirectCalls << "\n";
+        report << "Routed Branches: " << indirectBranches << "\n";
+        report << "Target Tables: " << indirectTables << " (" << indirectTableBytes << " bytes, one cache line each)\n";
+        if (IndirectCallCyclesOpt > 0) {
+            char line[128];
+            std::snprintf(line, sizeof(line), "Extra Cycles per Call: %.1f (measured by run_indirect_bench.sh)\n",
+                          (double)IndirectCallCyclesOpt);
+            report << line;
+        } else {
+            report << "Extra Cycles per Call: not measured (run benchmarks/run_indirect_bench.sh)\n";
+        }
+        report << "\n";
+        report << "--- Virtualization ---\n";
+        report << "Functions Virtualized: " << functionsVirtualized << "\n";
+        report << "Functions Not Virtualized (hot or unsupported): " << vmRejected << "\n";
+        report << "Bytecode Words: " << vmBytecodeWords << "\n";
+        report << "Interpreter Handlers: " << vmHandlers << "\n";
+        report << "\n";
+        report << "--- String Memory ---\n";
+        report << "Decrypt Mode: " << (StringDecryptOpt == StringDecryptMode::Stack ? "stack" : "global") << "\n";
+        report << "Encrypted Pool (read-only, shared): " << stringSharedBytes << " bytes\n";
+        report << "Decrypt Buffers (writable, private per process once touched): " << stringPrivateBytes << " bytes\n";
+        report << "Stack-Decrypted Call Sites: " << stringStackUses << "\n";
         report << "\n";
         report << "--- Code Size Impact ---\n";
         int originalSize = totalInstructions;
@@ -100,6 +621,7 @@ struct ObfuscationStats {
         report << "--- Obfuscation Cycles ---\n";
         report << "Number of Passes Completed: 1\n";
         report << "Functions Obfuscated: " << functionsObfuscated << "\n";
+        report << "Functions Skipped (obf:none): " << functionsSkipped << "\n";
         report << "\n";
         report << "========================================\n";
         
@@ -111,12 +633,506 @@ struct ObfuscationStats {
 // Global stats object
 static ObfuscationStats stats;
 
+// Times one pass (Stage) over one function and updates the function's report
+// record and the stage's memory when the pass is done with it.
+class FunctionScope {
+    const Function &F;
+    const char *Stage;
+    size_t Index;
+    long StartBytes;
+    long StartRSS;
+    std::chrono::steady_clock::time_point Start;
+
+public:
+    FunctionScope(const Function &F, const char *Stage)
+        : F(F), Stage(Stage), Index(stats.record(F)), StartBytes(irBytes(F)), StartRSS(peakRSSKB()),
+          Start(std::chrono::steady_clock::now()) {
+        stats.reportPending = true;
+    }
+
+    ObfuscationStats::FunctionRecord &record() { return stats.functions[Index]; }
+
+    void transform(const char *Name) { record().transforms.push_back(Name); }
+
+    ~FunctionScope() {
+        ObfuscationStats::FunctionRecord &R = record();
+        R.instructionsAfter = F.getInstructionCount();
+        R.blocksAfter = F.size();
+        R.irBytesAfter = irBytes(F);
+        R.peakRSSGrowthKB += peakRSSKB() - StartRSS;
+        stats.noteStage(Stage, R.irBytesAfter - StartBytes);
+        long growth = R.irBytesAfter - R.irBytesBefore;
+        if (IRGrowthWarnOpt > 0 && !R.overIRGrowth && growth > (long)IRGrowthWarnOpt * 1024) {
+            R.overIRGrowth = true;
+            errs() << "warning: " << F.getName() << ": IR grew by " << growth / 1024 << " KB, over -ir-growth-warn-kb="
+                   << IRGrowthWarnOpt << "\n";
+        }
+        R.passTimeMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - Start).count();
+    }
+};
+
+// Instructions that carry the obfuscation itself are tagged with !obf.keep so
+// obfuscator-cleanup can optimize the code around them without folding them
+// back into their plain form.
+static const char *const KeepMetadata = "obf.keep";
+
+// Pass name on every optimization remark, for -pass-remarks=obfuscator and
+// -foptimization-record-passes=obfuscator.
+static const char *const RemarkPass = "obfuscator";
+
+// Remark arguments are strings or integers; fractional values are printed.
+static std::string decimal(double V, int Digits = 1) {
+    char Buf[32];
+    std::snprintf(Buf, sizeof(Buf), "%.*f", Digits, V);
+    return Buf;
+}
+
+static Value *markKeep(Value *V) {
+    if (auto *I = dyn_cast<Instruction>(V)) {
+        I->setMetadata(KeepMetadata, MDNode::get(I->getContext(), {}));
+    }
+    return V;
+}
+
+static bool isKept(const Instruction &I) {
+    return I.getMetadata(KeepMetadata) != nullptr;
+}
+
+// Opaque predicate library.
+//
+// Every predicate below is false for all inputs, but its inputs are loaded
+// from weak globals whose value the optimizer may not assume (a weak
+// definition can be replaced at link time), so -O2 cannot fold the branch
+// and delete the guarded block. The identities hold for any value, and
+// values used as addresses are masked into range, so a replaced definition
+// does not change behavior.
+//
+// Cost per evaluation, estimated on a modern x86-64 core with the globals
+// resident in L1 (latency of the dependent chain; the loads are independent
+// of surrounding code and usually overlap with it):
+//
+//   Tier 0  x * (x + 1) is odd                      ~5 cycles,  5 instrs
+//   Tier 1  7*y*y - 1 == x*x                        ~8 cycles,  8 instrs
+//   Tier 2  tier 1 on values stored and reloaded   ~19 cycles, 20 instrs
+//           through two pointers into a slot pair
+//
+// Tier 1 is false because squares are 0, 1 or 4 mod 8 while 7*y*y - 1 is 3,
+// 6 or 7 mod 8; the argument only uses the low three bits, so it survives
+// 32-bit wrap-around. Tier 2 adds memory whose aliasing the optimizer cannot
+// resolve: after *p = x; *q = y the reload of *p is x or y, and the identity
+// holds either way. p and q index a pair of slots with the low bit of their
+// offsets, so they never point outside it. The pair is internal and
+// thread-local (initial-exec, one add to the thread pointer), so guarded
+// code running on several threads never writes to a shared cache line.
+static const unsigned NumPredicateTiers = 3;
+static const int PredicateTierCycles[NumPredicateTiers] = {5, 8, 19};
+
+class OpaquePredicates {
+public:
+
+    static unsigned clampTier(unsigned Tier) {
+        return Tier < NumPredicateTiers ? Tier : NumPredicateTiers - 1;
+    }
+
+    // Emit a predicate of the given tier at the builder's insertion point.
+    // The result is an i1 that is always false at run time.
+    static Value *create(IRBuilder<> &Builder, Module &M, unsigned Tier) {
+        Tier = clampTier(Tier);
+        Type *Int32Ty = Builder.getInt32Ty();
+
+        stats.opaquePredicates++;
+        stats.opaquePredicateCycles += PredicateTierCycles[Tier];
+
+        Value *X = Builder.CreateLoad(Int32Ty, getOrCreateInt(M, "__obf_opaque_x", 0x2f6b));
+        if (Tier == 0) {
+            Value *Next = markKeep(Builder.CreateAdd(X, ConstantInt::get(Int32Ty, 1)));
+            Value *Product = markKeep(Builder.CreateMul(X, Next));
+            Value *Low = markKeep(Builder.CreateAnd(Product, ConstantInt::get(Int32Ty, 1)));
+            return markKeep(Builder.CreateICmpNE(Low, ConstantInt::get(Int32Ty, 0)));
+        }
+
+        Value *Y = Builder.CreateLoad(Int32Ty, getOrCreateInt(M, "__obf_opaque_y", 0x51d));
+        if (Tier == 2) {
+            // p and q index the slot pair with offsets read from weak
+            // globals (both 0), so the optimizer cannot tell whether they
+            // alias.
+            GlobalVariable *Slots = getOrCreateSlots(M);
+            Value *P = slotPointer(Builder, Slots, getOrCreateInt(M, "__obf_opaque_poff", 0));
+            Value *Q = slotPointer(Builder, Slots, getOrCreateInt(M, "__obf_opaque_qoff", 0));
+            Builder.CreateAlignedStore(X, P, Align(4));
+            Builder.CreateAlignedStore(Y, Q, Align(4));
+            X = Builder.CreateAlignedLoad(Int32Ty, P, Align(4));
+            Y = Builder.CreateAlignedLoad(Int32Ty, Q, Align(4));
+        }
+
+        Value *XX = markKeep(Builder.CreateMul(X, X));
+        Value *YY = markKeep(Builder.CreateMul(Y, Y));
+        Value *Scaled = markKeep(Builder.CreateMul(YY, ConstantInt::get(Int32Ty, 7)));
+        Value *Lhs = markKeep(Builder.CreateSub(Scaled, ConstantInt::get(Int32Ty, 1)));
+        return markKeep(Builder.CreateICmpEQ(Lhs, XX));
+    }
+
+    // Emit a value that is always 0 at run time but unknown to the optimizer
+    // (the tier 0 identity). Used to hide constants such as dispatch keys.
+    static Value *createZero(IRBuilder<> &Builder, Module &M) {
+        Type *Int32Ty = Builder.getInt32Ty();
+        Value *X = Builder.CreateLoad(Int32Ty, getOrCreateInt(M, "__obf_opaque_x", 0x2f6b));
+        Value *Next = markKeep(Builder.CreateAdd(X, ConstantInt::get(Int32Ty, 1)));
+        Value *Product = markKeep(Builder.CreateMul(X, Next));
+        return markKeep(Builder.CreateAnd(Product, ConstantInt::get(Int32Ty, 1)));
+    }
+
+private:
+    static GlobalVariable *getOrCreateInt(Module &M, StringRef Name, uint32_t Init) {
+        if (GlobalVariable *GV = M.getNamedGlobal(Name)) {
+            return GV;
+        }
+        Type *Int32Ty = Type::getInt32Ty(M.getContext());
+        auto *GV = new GlobalVariable(M, Int32Ty, /*isConstant=*/false, GlobalValue::WeakAnyLinkage,
+                                      ConstantInt::get(Int32Ty, Init), Name);
+        GV->setAlignment(Align(4));
+        return GV;
+    }
+
+    // The tier 2 slot pair. Internal, so no other definition can replace
+    // it with a smaller one.
+    static GlobalVariable *getOrCreateSlots(Module &M) {
+        if (GlobalVariable *GV = M.getNamedGlobal("__obf_opaque_slots")) {
+            return GV;
+        }
+        auto *Ty = ArrayType::get(Type::getInt32Ty(M.getContext()), 2);
+        auto *GV = new GlobalVariable(M, Ty, /*isConstant=*/false, GlobalValue::InternalLinkage,
+                                      ConstantAggregateZero::get(Ty), "__obf_opaque_slots", nullptr,
+                                      GlobalValue::InitialExecTLSModel);
+        GV->setAlignment(Align(8));
+        return GV;
+    }
+
+    // &Slots[*Offset & 1]: in bounds whatever value the offset has.
+    static Value *slotPointer(IRBuilder<> &Builder, GlobalVariable *Slots, GlobalVariable *Offset) {
+        Value *Index = Builder.CreateLoad(Builder.getInt32Ty(), Offset);
+        Index = Builder.CreateAnd(Index, Builder.getInt32(1));
+        return Builder.CreateInBoundsGEP(Slots->getValueType(), Slots, {Builder.getInt32(0), Index});
+    }
+};
+
+// Mixed Boolean-Arithmetic rewriting for add, sub, xor, and, or and mul.
+//
+// A rewrite is a sum of signed terms over bitwise atoms of x and y (x & y,
+// x | ~y, ...). Level 1 is one base identity for the opcode, e.g.
+//   x + y  =  (x | y) + (x & y)
+// and every further level adds one identity that sums to zero, e.g.
+//   0  =  (x ^ y) - (x | y) + (x & y)
+// Atoms are built once per rewrite and only ever two operations deep, and
+// the terms are summed in a balanced tree, so the dependency chain grows
+// with log2 of the term count while the width grows linearly: the
+// expression stays shallow and leaves the extra work to spare ALUs instead
+// of lengthening the critical path.
+static const unsigned MBAMaxLevel = 7;
+
+class MBARewriter {
+public:
+    enum Atom { X, Y, NotX, NotY, And, Or, Xor, AndNotY, NotXAndY, OrNotY, NumAtoms };
+
+    struct Term {
+        Atom A;
+        int Coeff; // +-1 or +-2
+    };
+
+    struct Shape {
+        unsigned Instructions;
+        unsigned Depth;
+    };
+
+private:
+    IRBuilder<> &Builder;
+    Value *Ops[2];
+    Value *Atoms[NumAtoms] = {};
+    DenseMap<Value*, unsigned> Depth;
+    unsigned Created = 0;
+
+    Value *emit(Instruction::BinaryOps Opcode, Value *A, Value *B) {
+        Value *V = Builder.CreateBinOp(Opcode, A, B);
+        if (auto *I = dyn_cast<Instruction>(V)) {
+            markKeep(I);
+            Depth[I] = 1 + std::max(Depth.lookup(A), Depth.lookup(B));
+            Created++;
+        }
+        return V;
+    }
+
+    Value *atom(Atom A) {
+        if (Atoms[A]) {
+            return Atoms[A];
+        }
+        Value *X = Ops[0];
+        Value *Y = Ops[1];
+        Value *AllOnes = Constant::getAllOnesValue(X->getType());
+        Value *V = nullptr;
+        switch (A) {
+        case Atom::X: V = X; break;
+        case Atom::Y: V = Y; break;
+        case NotX: V = emit(Instruction::Xor, X, AllOnes); break;
+        case NotY: V = emit(Instruction::Xor, Y, AllOnes); break;
+        case And: V = emit(Instruction::And, X, Y); break;
+        case Or: V = emit(Instruction::Or, X, Y); break;
+        case Xor: V = emit(Instruction::Xor, X, Y); break;
+        case AndNotY: V = emit(Instruction::And, X, atom(NotY)); break;
+        case NotXAndY: V = emit(Instruction::And, atom(NotX), Y); break;
+        case OrNotY: V = emit(Instruction::Or, X, atom(NotY)); break;
+        case NumAtoms: break;
+        }
+        Atoms[A] = V;
+        return V;
+    }
+
+    // Sum signed values pairwise, level by level, so the adds form a
+    // balanced tree instead of a chain.
+    Value *sum(std::vector<std::pair<Value*, bool>> Terms) {
+        while (Terms.size() > 1) {
+            std::vector<std::pair<Value*, bool>> Next;
+            for (size_t i = 0; i + 1 < Terms.size(); i += 2) {
+                auto L = Terms[i];
+                auto R = Terms[i + 1];
+                if (L.second == R.second) {
+                    Next.push_back({emit(Instruction::Add, L.first, R.first), L.second});
+                } else if (!L.second) {
+                    Next.push_back({emit(Instruction::Sub, L.first, R.first), false});
+                } else {
+                    Next.push_back({emit(Instruction::Sub, R.first, L.first), false});
+                }
+            }
+            if (Terms.size() % 2) {
+                Next.push_back(Terms.back());
+            }
+            Terms.swap(Next);
+        }
+        // false = positive; the base identity always has a positive term,
+        // which survives every pairing above.
+        assert(!Terms[0].second && "MBA sum ended negative");
+        return Terms[0].first;
+    }
+
+    Value *term(const Term &T) {
+        Value *V = atom(T.A);
+        if (T.Coeff == 2 || T.Coeff == -2) {
+            V = emit(Instruction::Shl, V, ConstantInt::get(V->getType(), 1));
+        }
+        return V;
+    }
+
+public:
+    MBARewriter(IRBuilder<> &Builder, Value *X, Value *Y) : Builder(Builder), Ops{X, Y} {}
+
+    static bool supports(unsigned Opcode) {
+        switch (Opcode) {
+        case Instruction::Add:
+        case Instruction::Sub:
+        case Instruction::Xor:
+        case Instruction::And:
+        case Instruction::Or:
+        case Instruction::Mul:
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    // Base identity for Opcode (not used for mul, see rewrite()).
+    static std::vector<Term> baseTerms(unsigned Opcode) {
+        switch (Opcode) {
+        case Instruction::Add: return {{Or, 1}, {And, 1}};
+        case Instruction::Sub: return {{AndNotY, 1}, {NotXAndY, -1}};
+        case Instruction::Xor: return {{Or, 1}, {And, -1}};
+        case Instruction::And: return {{X, 1}, {Y, 1}, {Or, -1}};
+        case Instruction::Or: return {{Xor, 1}, {And, 1}};
+        default: return {};
+        }
+    }
+
+    // Identities that sum to zero for every x and y.
+    static std::vector<std::vector<Term>> zeroIdentities() {
+        return {
+            {{Xor, 1}, {Or, -1}, {And, 1}},
+            {{X, 1}, {Y, 1}, {Or, -1}, {And, -1}},
+            {{Or, 1}, {AndNotY, -1}, {Y, -1}},
+            {{And, 1}, {AndNotY, 1}, {X, -1}},
+            {{OrNotY, 1}, {NotY, -1}, {And, -1}},
+            {{Xor, 1}, {And, 2}, {X, -1}, {Y, -1}},
+        };
+    }
+
+    // Build the level-Level (1..MBAMaxLevel) expression for `x Opcode y` before
+    // the builder's insertion point.
+    Value *rewrite(unsigned Opcode, unsigned Level, std::mt19937 &rng) {
+        std::vector<std::pair<Value*, bool>> Terms;
+        if (Opcode == Instruction::Mul) {
+            // x * y = (x & y) * (x | y) + (x & ~y) * (~x & y); the two
+            // products are independent.
+            Terms.push_back({emit(Instruction::Mul, atom(And), atom(Or)), false});
+            Terms.push_back({emit(Instruction::Mul, atom(AndNotY), atom(NotXAndY)), false});
+        } else {
+            for (const Term &T : baseTerms(Opcode)) {
+                Terms.push_back({term(T), T.Coeff < 0});
+            }
+        }
+
+        std::vector<std::vector<Term>> Zeros = zeroIdentities();
+        std::shuffle(Zeros.begin(), Zeros.end(), rng);
+        for (unsigned i = 0; i + 1 < Level && i < Zeros.size(); ++i) {
+            for (const Term &T : Zeros[i]) {
+                Terms.push_back({term(T), T.Coeff < 0});
+            }
+        }
+        // Keep a positive term first so the tree never needs a negation.
+        std::shuffle(Terms.begin(), Terms.end(), rng);
+        std::stable_partition(Terms.begin(), Terms.end(),
+                              [](const std::pair<Value*, bool> &T) { return !T.second; });
+        return sum(Terms);
+    }
+
+    Shape shape(Value *Result) const {
+        return {Created, Depth.lookup(Result)};
+    }
+};
+
+// Routed calls and branches of a function share one table that must fit in
+// a single cache line.
+static const unsigned CacheLineBytes = 64;
+
+// -obf-instrument counters. Each function gets CounterShards rows of
+// CounterSlots 64-bit counters, one cache line per row; a thread always
+// uses the same row. Keep in sync with runtime/obf_counters.cpp.
+static const char *const InstrumentationAttr = "obf.instrumentation";
+enum CounterKind { CtrCalls, CtrPredicates, CtrInsertedTaken, CtrDispatches, CtrRouted, CtrSubstituted };
+static const unsigned CounterShards = 16;
+static const unsigned CounterSlots = 8;
+
+// Seed for a pass's random choices in one function or global: -obf-seed
+// mixed with the pass and the name, so a seed reproduces the output.
+static uint64_t seedFor(StringRef Pass, StringRef Name) {
+    return SeedOpt ^ xxHash64((Pass + "/" + Name).str());
+}
+
 class CodeObfuscator {
 private:
     std::mt19937 rng;
+    unsigned predicateTier;
+    // Blocks added behind an always-false predicate; they never execute.
+    SmallPtrSet<const BasicBlock*, 16> deadBlocks;
+    OptimizationRemarkEmitter *ORE = nullptr;
+
+    // Inserted code, remembered for instrument().
+    std::vector<BasicBlock*> guardBlocks;
+    std::vector<BasicBlock*> deadEntries;
+    std::vector<Instruction*> dispatchSites;
+    std::vector<Instruction*> routedSites;
+    MapVector<BasicBlock*, unsigned> substitutedPerBlock;
+
+    // The remark is only built when remarks are enabled for the context.
+    template <typename RemarkFn> void remark(RemarkFn Fn) {
+        if (ORE) {
+            ORE->emit(Fn);
+        }
+    }
     
 public:
-    CodeObfuscator() : rng(std::random_device{}()) {}
+    CodeObfuscator(uint64_t seed, unsigned predicateTier = OpaqueTierOpt)
+        : rng(seed), predicateTier(predicateTier) {}
+
+    const SmallPtrSetImpl<const BasicBlock*> &neverExecuted() const { return deadBlocks; }
+
+    void setRemarkEmitter(OptimizationRemarkEmitter *E) { ORE = E; }
+
+    // Count how often the code inserted so far runs: calls, predicate
+    // evaluations, entries into bogus blocks and fake loops (which must stay
+    // 0), dispatches, routed calls and branches, and extra instructions
+    // executed because of substitution. The row for the calling thread is
+    // looked up once per call; each count is then a plain load, add and
+    // store (monotonic atomics, so threads sharing a row may lose counts but
+    // never tear them). The table is registered with the runtime from a
+    // module constructor, which writes the sums at exit.
+    void instrument(Function &F) {
+        Module &M = *F.getParent();
+        LLVMContext &Ctx = F.getContext();
+        Type *Int32Ty = Type::getInt32Ty(Ctx);
+        Type *Int64Ty = Type::getInt64Ty(Ctx);
+        Type *PtrTy = PointerType::getUnqual(Type::getInt8Ty(Ctx));
+        ArrayType *RowTy = ArrayType::get(Int64Ty, CounterSlots);
+        ArrayType *TableTy = ArrayType::get(RowTy, CounterShards);
+
+        auto *Counters = new GlobalVariable(M, TableTy, /*isConstant=*/false, GlobalValue::PrivateLinkage,
+                                            ConstantAggregateZero::get(TableTy), F.getName() + ".obf.ctr");
+        Counters->setAlignment(Align(CacheLineBytes));
+
+        BasicBlock &Entry = F.getEntryBlock();
+        BasicBlock::iterator IP = Entry.getFirstInsertionPt();
+        while (isa<AllocaInst>(*IP)) {
+            ++IP;
+        }
+        IRBuilder<> Builder(&Entry, IP);
+        FunctionCallee ShardFn = M.getOrInsertFunction("__obf_ctr_shard", FunctionType::get(Int32Ty, false));
+        cast<Function>(ShardFn.getCallee())->addFnAttr(Attribute::NoUnwind);
+        Value *Shard = Builder.CreateZExt(Builder.CreateCall(ShardFn), Int64Ty);
+        Value *Row = Builder.CreateInBoundsGEP(TableTy, Counters, {Builder.getInt64(0), Shard});
+
+        auto bump = [&](Instruction *Before, CounterKind Kind, uint64_t N) {
+            IRBuilder<> B(Before);
+            Value *Slot = B.CreateConstInBoundsGEP2_32(RowTy, Row, 0, Kind);
+            LoadInst *Old = B.CreateAlignedLoad(Int64Ty, Slot, Align(8));
+            Old->setAtomic(AtomicOrdering::Monotonic);
+            StoreInst *New = B.CreateAlignedStore(B.CreateAdd(Old, B.getInt64(N)), Slot, Align(8));
+            New->setAtomic(AtomicOrdering::Monotonic);
+        };
+        bump(&*Builder.GetInsertPoint(), CtrCalls, 1);
+        for (BasicBlock *BB : guardBlocks) {
+            bump(BB->getTerminator(), CtrPredicates, 1);
+        }
+        for (BasicBlock *BB : deadEntries) {
+            bump(&*BB->getFirstInsertionPt(), CtrInsertedTaken, 1);
+        }
+        for (Instruction *I : dispatchSites) {
+            bump(I, CtrDispatches, 1);
+        }
+        for (Instruction *I : routedSites) {
+            bump(I, CtrRouted, 1);
+        }
+        for (auto &Entry : substitutedPerBlock) {
+            bump(Entry.first->getTerminator(), CtrSubstituted, Entry.second);
+        }
+
+        // One constructor per module registers every instrumented function.
+        Function *Init = M.getFunction("obf.ctr.init");
+        if (!Init) {
+            Init = Function::Create(FunctionType::get(Type::getVoidTy(Ctx), false), GlobalValue::PrivateLinkage,
+                                    "obf.ctr.init", M);
+            Init->addFnAttr(InstrumentationAttr);
+            ReturnInst::Create(Ctx, BasicBlock::Create(Ctx, "entry", Init));
+            appendToGlobalCtors(M, Init, 0);
+        }
+        IRBuilder<> InitBuilder(Init->getEntryBlock().getTerminator());
+        FunctionCallee RegisterFn = M.getOrInsertFunction("__obf_ctr_register",
+            FunctionType::get(Type::getVoidTy(Ctx), {PtrTy, PtrTy}, false));
+        Constant *Name = InitBuilder.CreateGlobalStringPtr(F.getName(), F.getName() + ".obf.ctr.name");
+        InitBuilder.CreateCall(RegisterFn, {Name, InitBuilder.CreatePointerCast(Counters, PtrTy)});
+    }
+    
+    // Split insertAfter right before its terminator and guard the edge into
+    // the tail with an opaque predicate. Returns the conditional branch whose
+    // true successor is still to be filled in by the caller. The original
+    // terminator moves to the tail unchanged, so successors and their PHI
+    // nodes keep seeing the same predecessor edges they had before.
+    BranchInst *guardTerminator(BasicBlock *insertAfter, BasicBlock *target) {
+        BasicBlock *Tail = insertAfter->splitBasicBlock(insertAfter->getTerminator(), "obf.tail");
+        Instruction *Br = insertAfter->getTerminator();
+        
+        IRBuilder<> Builder(Br);
+        Value *Cond = OpaquePredicates::create(Builder, *insertAfter->getModule(), predicateTier);
+        BranchInst *CondBr = Builder.CreateCondBr(Cond, target, Tail);
+        Br->eraseFromParent();
+        guardBlocks.push_back(insertAfter);
+        return CondBr;
+    }
     
     // Add bogus basic block with fake computations
     void addBogusBlock(Function &F, BasicBlock *insertAfter) {
@@ -125,40 +1141,29 @@ public:
         
         // Create bogus block
         BasicBlock *BogusBB = BasicBlock::Create(Ctx, "bogus", &F);
-        IRBuilder<> Builder(BogusBB);
+        deadBlocks.insert(BogusBB);
+        deadEntries.push_back(BogusBB);
+        BranchInst *Guard = guardTerminator(insertAfter, BogusBB);
+        BasicBlock *Tail = Guard->getSuccessor(1);
+        remark([&] {
+            return OptimizationRemark(RemarkPass, "BogusBlock", Guard)
+                   << "inserted bogus block behind a tier " << ore::NV("Tier", predicateTier)
+                   << " opaque predicate";
+        });
         
-        // Add some fake computations that look real
+        // Add some fake computations that look real. They read and write the
+        // opaque-predicate globals, which keeps them alive through -O2
+        // without a dynamic alloca in a non-entry block.
+        IRBuilder<> Builder(BogusBB);
         Type *Int32Ty = Type::getInt32Ty(Ctx);
-        Value *FakeVar1 = Builder.CreateAlloca(Int32Ty);
-        Value *FakeVar2 = Builder.CreateAlloca(Int32Ty);
-        
-        Builder.CreateStore(ConstantInt::get(Int32Ty, 42), FakeVar1);
-        Value *Load1 = Builder.CreateLoad(Int32Ty, FakeVar1);
-        Value *Add = Builder.CreateAdd(Load1, ConstantInt::get(Int32Ty, 13));
-        Builder.CreateStore(Add, FakeVar2);
-        
-        // Always false condition to make this block unreachable
-        Value *Cond = Builder.CreateICmpEQ(
-            ConstantInt::get(Int32Ty, 1),
-            ConstantInt::get(Int32Ty, 0)
-        );
-        
-        // Get the next block
-        BasicBlock *NextBB = insertAfter->getNextNode();
-        if (!NextBB) {
-            NextBB = &F.getEntryBlock();
-        }
+        Value *FakeVar = M->getNamedGlobal("__obf_opaque_x");
+        Value *Load1 = Builder.CreateLoad(Int32Ty, FakeVar);
+        Value *Mul = Builder.CreateMul(Load1, ConstantInt::get(Int32Ty, 42));
+        Value *Add = Builder.CreateAdd(Mul, ConstantInt::get(Int32Ty, 13));
+        Builder.CreateStore(Add, FakeVar);
         
         // Branch back to real code
-        Builder.CreateBr(NextBB);
-        
-        // Insert conditional branch in the original block
-        Instruction *OrigTerm = insertAfter->getTerminator();
-        if (OrigTerm) {
-            IRBuilder<> OrigBuilder(OrigTerm);
-            OrigBuilder.CreateCondBr(Cond, BogusBB, NextBB);
-            OrigTerm->eraseFromParent();
-        }
+        Builder.CreateBr(Tail);
         
         stats.bogusBlocksAdded++;
     }
@@ -172,6 +1177,19 @@ public:
         BasicBlock *LoopHeader = BasicBlock::Create(Ctx, "fake.loop.header", &F);
         BasicBlock *LoopBody = BasicBlock::Create(Ctx, "fake.loop.body", &F);
         BasicBlock *LoopExit = BasicBlock::Create(Ctx, "fake.loop.exit", &F);
+        deadBlocks.insert(LoopHeader);
+        deadBlocks.insert(LoopBody);
+        deadBlocks.insert(LoopExit);
+        deadEntries.push_back(LoopHeader);
+        
+        // Guard the loop with an opaque predicate (always false)
+        BranchInst *Guard = guardTerminator(insertAfter, LoopHeader);
+        BasicBlock *Tail = Guard->getSuccessor(1);
+        remark([&] {
+            return OptimizationRemark(RemarkPass, "FakeLoop", Guard)
+                   << "inserted fake loop behind a tier " << ore::NV("Tier", predicateTier)
+                   << " opaque predicate";
+        });
         
         // Loop header
         IRBuilder<> HeaderBuilder(LoopHeader);
@@ -189,161 +1207,2648 @@ public:
         
         // Loop exit
         IRBuilder<> ExitBuilder(LoopExit);
-        BasicBlock *NextBB = insertAfter->getNextNode();
-        if (!NextBB) NextBB = &F.getEntryBlock();
-        ExitBuilder.CreateBr(NextBB);
-        
-        // Insert conditional to fake loop (always false)
-        Instruction *OrigTerm = insertAfter->getTerminator();
-        if (OrigTerm) {
-            IRBuilder<> OrigBuilder(OrigTerm);
-            Value *FakeCond = OrigBuilder.CreateICmpEQ(
-                ConstantInt::get(Int32Ty, 1),
-                ConstantInt::get(Int32Ty, 0)
-            );
-            OrigBuilder.CreateCondBr(FakeCond, LoopHeader, NextBB);
-            OrigTerm->eraseFromParent();
-        }
+        ExitBuilder.CreateBr(Tail);
         
         stats.fakeLoopsAdded++;
     }
     
-    // Substitute simple operations with complex equivalents
-    void substituteInstructions(Function &F) {
-        std::vector<Instruction*> toSubstitute;
-        
+    // Control-flow flattening.
+    //
+    // Every block except the entry becomes a case of a dispatcher, and each
+    // original branch becomes "set next state, go to dispatcher". The state
+    // is encoded as index ^ Key and decoded with Key ^ zero, where zero is an
+    // opaque 0 computed once in the entry block; jump threading therefore
+    // cannot see which case a store selects and cannot undo the transform.
+    //
+    // Switch back end: one dispatcher block switches on the decoded state.
+    // Case values are 0..N-1 and the default is unreachable, so codegen
+    // emits a dense jump table without a range check: load, decode, one
+    // indirect jump per transition, all from a single (poorly predicted)
+    // site.
+    //
+    // IndirectBr back end: no central dispatcher. Each block decodes its next
+    // state, loads the target from a per-function blockaddress table and
+    // ends in its own indirectbr, so the branch target buffer predicts every
+    // site separately, as in a direct-threaded interpreter. Each indirectbr
+    // lists only the block's real successors (plus one decoy when there is
+    // a single successor, so SimplifyCFG cannot turn it back into a br).
+    //
+    // Values live across blocks are demoted to stack slots first. Functions
+    // with exception handling or existing indirect branches are left alone.
+    bool flattenControlFlow(Function &F, FlattenDispatch Dispatch) {
+        if (F.size() < 3) {
+            return false;
+        }
         for (BasicBlock &BB : F) {
-            for (Instruction &I : BB) {
-                // Find add instructions to substitute
-                if (auto *Add = dyn_cast<BinaryOperator>(&I)) {
-                    if (Add->getOpcode() == Instruction::Add) {
-                        toSubstitute.push_back(Add);
-                    }
-                }
+            Instruction *Term = BB.getTerminator();
+            if (BB.isEHPad() || BB.hasAddressTaken() || !Term || isa<InvokeInst>(Term) ||
+                isa<IndirectBrInst>(Term) || isa<CallBrInst>(Term) || isa<ResumeInst>(Term)) {
+                return false;
             }
         }
-        
-        for (Instruction *Add : toSubstitute) {
-            IRBuilder<> Builder(Add);
-            
-            // Replace: a + b with: (a - (-b))
-            Value *A = Add->getOperand(0);
-            Value *B = Add->getOperand(1);
-            
-            Value *NegB = Builder.CreateNeg(B);
-            Value *Result = Builder.CreateSub(A, NegB);
-            
-            Add->replaceAllUsesWith(Result);
-            Add->eraseFromParent();
-            
-            stats.instructionSubstitutions++;
-        }
-    }
-};
-
-struct ObfuscatorPass : public PassInfoMixin<ObfuscatorPass> {
-    bool BogusBlocks; 
-    bool FakeLoops;
-    bool InstrSub;
-
-    ObfuscatorPass(bool BogusBlocks, bool FakeLoops, bool InstrSub) : BogusBlocks(BogusBlocks), FakeLoops(FakeLoops), InstrSub(InstrSub) {}
 
-    PreservedAnalyses run(Function &F, FunctionAnalysisManager &AM) {
-        CodeObfuscator obf;
-        bool modified = false;
+        LLVMContext &Ctx = F.getContext();
+        Module &M = *F.getParent();
+        IntegerType *Int32Ty = Type::getInt32Ty(Ctx);
+        BasicBlock *Entry = &F.getEntryBlock();
 
-        // Capture initial stats
-        int bogusBefore = stats.bogusBlocksAdded;
-        int loopsBefore = stats.fakeLoopsAdded;
-        int subsBefore = stats.instructionSubstitutions;
+        // The entry block keeps its straight-line code and allocas; its
+        // terminator moves to the first flattened block.
+        Entry->splitBasicBlock(Entry->getTerminator(), "obf.flat.first");
 
-        stats.functionsObfuscated++;
+        std::vector<BasicBlock*> blocks;
         for (BasicBlock &BB : F) {
-            stats.totalBasicBlocks++;
-            for (Instruction &I : BB) {
-                stats.totalInstructions++;
+            if (&BB != Entry) {
+                blocks.push_back(&BB);
             }
         }
-        
-        errs() << "========================================\n";
-        errs() << "[ObfuscatorPass] Processing: " << F.getName() << "\n";
-        errs() << "  Instructions: " << F.getInstructionCount() << "\n";
-        errs() << "  Basic Blocks: " << F.size() << "\n";
 
-        // Apply obfuscations
-        std::vector<BasicBlock*> blocks;
-        for (BasicBlock &BB : F) {
-            blocks.push_back(&BB);
+        demoteCrossBlockValues(F);
+
+        std::shuffle(blocks.begin(), blocks.end(), rng);
+        DenseMap<BasicBlock*, uint32_t> caseIndex;
+        for (uint32_t i = 0; i < blocks.size(); i++) {
+            caseIndex[blocks[i]] = i;
         }
-        
-        if (BogusBlocks) {
-            errs() << "  [Bogus Blocks] Enabled\n";
-            int bogusAdded = 0;
-            for (size_t i = 0; i < blocks.size() && bogusAdded < 3; i++) {
-                Instruction *term = blocks[i]->getTerminator();
-                if (term && (isa<ReturnInst>(term) || isa<UnreachableInst>(term))) {
-                    errs() << "    Skipping block " << i << " (terminal block)\n";
-                    continue;
-                }
-                errs() << "    Adding bogus block after block " << i << "\n";
-                obf.addBogusBlock(F, blocks[i]);
-                bogusAdded++;
-                modified = true;
-            }
+        uint32_t Key = rng();
+        auto encode = [&](BasicBlock *BB) {
+            return ConstantInt::get(Int32Ty, caseIndex.lookup(BB) ^ Key);
+        };
+
+        // Decoding key, computed once: Key ^ (opaque zero).
+        IRBuilder<> EntryBuilder(Entry->getTerminator());
+        Value *DecodeKey = markKeep(EntryBuilder.CreateXor(
+            OpaquePredicates::createZero(EntryBuilder, M), ConstantInt::get(Int32Ty, Key)));
+
+        if (Dispatch == FlattenDispatch::Switch) {
+            IRBuilder<> AllocaBuilder(Entry, Entry->getFirstInsertionPt());
+            AllocaInst *State = AllocaBuilder.CreateAlloca(Int32Ty, nullptr, "obf.state");
+
+            BasicBlock *Dispatcher = BasicBlock::Create(Ctx, "obf.dispatch", &F);
+            BasicBlock *Default = BasicBlock::Create(Ctx, "obf.dispatch.default", &F);
+            new UnreachableInst(Ctx, Default);
+
+            IRBuilder<> DispatchBuilder(Dispatcher);
+            Value *Encoded = DispatchBuilder.CreateLoad(Int32Ty, State, "obf.state.enc");
+            Value *Decoded = markKeep(DispatchBuilder.CreateXor(Encoded, DecodeKey));
+            SwitchInst *Switch = DispatchBuilder.CreateSwitch(Decoded, Default, blocks.size());
+            dispatchSites.push_back(Switch);
+            for (BasicBlock *BB : blocks) {
+                Switch->addCase(ConstantInt::get(Int32Ty, caseIndex.lookup(BB)), BB);
+            }
+
+            // Route every edge through the dispatcher.
+            auto route = [&](Instruction *Term, Value *Next) {
+                IRBuilder<> Builder(Term);
+                Builder.CreateStore(Next, State);
+                Builder.CreateBr(Dispatcher);
+                Term->eraseFromParent();
+            };
+
+            route(Entry->getTerminator(), encode(Entry->getSingleSuccessor()));
+            for (BasicBlock *BB : blocks) {
+                rewriteTerminator(BB, encode, [&](Instruction *Term, Value *Next, ArrayRef<BasicBlock*>) {
+                    route(Term, Next);
+                }, [&](BasicBlock *Target) {
+                    BasicBlock *Trampoline = BasicBlock::Create(Ctx, "obf.flat.edge", &F);
+                    IRBuilder<> Builder(Trampoline);
+                    Builder.CreateStore(encode(Target), State);
+                    Builder.CreateBr(Dispatcher);
+                    return Trampoline;
+                });
+            }
+        } else {
+            // Per-function table of case targets, indexed by decoded state.
+            std::vector<Constant*> targets;
+            for (BasicBlock *BB : blocks) {
+                targets.push_back(BlockAddress::get(&F, BB));
+            }
+            Type *PtrTy = PointerType::getUnqual(Type::getInt8Ty(Ctx));
+            ArrayType *TableTy = ArrayType::get(PtrTy, targets.size());
+            std::vector<Constant*> casted;
+            for (Constant *C : targets) {
+                casted.push_back(ConstantExpr::getBitCast(C, PtrTy));
+            }
+            auto *Table = new GlobalVariable(M, TableTy, /*isConstant=*/true, GlobalValue::PrivateLinkage,
+                                             ConstantArray::get(TableTy, casted), F.getName() + ".obf.targets");
+
+            auto jump = [&](Instruction *Term, Value *Next, ArrayRef<BasicBlock*> Succs) {
+                IRBuilder<> Builder(Term);
+                Value *Index = markKeep(Builder.CreateXor(Next, DecodeKey));
+                Value *Slot = Builder.CreateInBoundsGEP(TableTy, Table,
+                    {ConstantInt::get(Int32Ty, 0), Builder.CreateZExt(Index, Type::getInt64Ty(Ctx))});
+                Value *Target = Builder.CreateLoad(PtrTy, Slot, "obf.target");
+                IndirectBrInst *IBr = Builder.CreateIndirectBr(Target, Succs.size() + 1);
+                dispatchSites.push_back(IBr);
+                for (BasicBlock *Succ : Succs) {
+                    IBr->addDestination(Succ);
+                }
+                if (IBr->getNumDestinations() == 1) {
+                    IBr->addDestination(blocks[rng() % blocks.size()]);
+                }
+                Term->eraseFromParent();
+            };
+
+            BasicBlock *First = Entry->getSingleSuccessor();
+            jump(Entry->getTerminator(), encode(First), {First});
+            for (BasicBlock *BB : blocks) {
+                rewriteTerminator(BB, encode, jump, [&](BasicBlock *Target) {
+                    BasicBlock *Trampoline = BasicBlock::Create(Ctx, "obf.flat.edge", &F);
+                    IRBuilder<> Builder(Trampoline);
+                    Instruction *Placeholder = Builder.CreateUnreachable();
+                    jump(Placeholder, encode(Target), {Target});
+                    return Trampoline;
+                });
+            }
+        }
+
+        stats.flattenedFunctions++;
+        stats.flattenedBlocks += blocks.size();
+        return true;
+    }
+
+    // Route direct calls and conditional branches through a per-function
+    // table of encoded targets:
+    //
+    //   slot   = (i ^ K) ^ D            // D = K ^ Z, computed once
+    //   target = table[slot] + D        // table[i] = target_i - K
+    //
+    // where Z is the opaque zero, so the table holds no plain addresses and
+    // neither the slot nor the target folds back into a constant. The table
+    // is cache-line aligned and limited to one line (8 targets on 64-bit);
+    // sites whose targets do not fit stay direct. Each routed site keeps its
+    // own indirect call or indirectbr with a fixed (calls) or two-way
+    // (branches) target, which the BTB and the indirect predictor learn like
+    // any other, and the decode is one L1 load and an add off the critical
+    // path of a correctly predicted jump.
+    //
+    // Branches inside loops, or into loop headers, stay direct: the target
+    // of an indirectbr cannot get a preheader, which would disable LICM and
+    // vectorization of the loop.
+    int routeIndirect(Function &F, bool Calls, bool Branches) {
+        DominatorTree DT(F);
+        LoopInfo LI(DT);
+
+        struct Site {
+            Instruction *I;
+            SmallVector<Constant*, 2> Targets;
+        };
+        std::vector<Site> sites;
+        for (BasicBlock &BB : F) {
+            for (Instruction &I : BB) {
+                auto *Call = dyn_cast<CallBase>(&I);
+                if (Calls && Call && isRoutableCall(*Call)) {
+                    sites.push_back({Call, {cast<Function>(Call->getCalledOperand())}});
+                }
+            }
+            auto *Br = dyn_cast<BranchInst>(BB.getTerminator());
+            if (Branches && Br && Br->isConditional() && !isKept(*Br) && !LI.getLoopFor(&BB)) {
+                BasicBlock *T = Br->getSuccessor(0);
+                BasicBlock *E = Br->getSuccessor(1);
+                if (T != E && !LI.isLoopHeader(T) && !LI.isLoopHeader(E)) {
+                    sites.push_back({Br, {BlockAddress::get(&F, T), BlockAddress::get(&F, E)}});
+                }
+            }
+        }
+        if (sites.empty()) {
+            return 0;
+        }
+
+        // Fill the line with randomly chosen sites; a site goes in only if
+        // all of its targets fit.
+        const DataLayout &DL = F.getParent()->getDataLayout();
+        unsigned MaxSlots = CacheLineBytes / DL.getPointerSize();
+        std::shuffle(sites.begin(), sites.end(), rng);
+        MapVector<Constant*, unsigned> slots;
+        std::vector<Site*> chosen;
+        for (Site &S : sites) {
+            unsigned added = 0;
+            for (Constant *T : S.Targets) {
+                added += !slots.count(T);
+            }
+            if (slots.size() + added > MaxSlots) {
+                continue;
+            }
+            for (Constant *T : S.Targets) {
+                slots.insert({T, slots.size()});
+            }
+            chosen.push_back(&S);
+        }
+
+        LLVMContext &Ctx = F.getContext();
+        Module &M = *F.getParent();
+        IntegerType *IntPtrTy = DL.getIntPtrType(Ctx);
+        uint64_t Key = ((uint64_t)rng() << 32) | rng();
+        Constant *KeyC = ConstantInt::get(IntPtrTy, Key);
+
+        std::vector<Constant*> entries;
+        for (auto &Slot : slots) {
+            entries.push_back(ConstantExpr::getSub(ConstantExpr::getPtrToInt(Slot.first, IntPtrTy), KeyC));
+        }
+        ArrayType *TableTy = ArrayType::get(IntPtrTy, entries.size());
+        auto *Table = new GlobalVariable(M, TableTy, /*isConstant=*/true, GlobalValue::PrivateLinkage,
+                                         ConstantArray::get(TableTy, entries), F.getName() + ".obf.routes");
+        Table->setAlignment(Align(CacheLineBytes));
+
+        BasicBlock &Entry = F.getEntryBlock();
+        IRBuilder<> EntryBuilder(&Entry, Entry.getFirstInsertionPt());
+        while (isa<AllocaInst>(&*EntryBuilder.GetInsertPoint())) {
+            EntryBuilder.SetInsertPoint(EntryBuilder.GetInsertPoint()->getNextNode());
+        }
+        Value *Zero = EntryBuilder.CreateZExt(OpaquePredicates::createZero(EntryBuilder, M), IntPtrTy);
+        Value *DecodeKey = markKeep(EntryBuilder.CreateXor(Zero, KeyC));
+
+        auto encodedSlot = [&](Constant *Target) {
+            return ConstantInt::get(IntPtrTy, slots.lookup(Target) ^ Key);
+        };
+        auto decode = [&](IRBuilder<> &Builder, Value *EncodedSlot) {
+            Value *Index = markKeep(Builder.CreateXor(EncodedSlot, DecodeKey));
+            Value *Ptr = Builder.CreateInBoundsGEP(TableTy, Table, {ConstantInt::get(IntPtrTy, 0), Index});
+            Value *Encoded = Builder.CreateLoad(IntPtrTy, Ptr, "obf.route");
+            return markKeep(Builder.CreateAdd(Encoded, DecodeKey));
+        };
+
+        for (Site *S : chosen) {
+            IRBuilder<> Builder(S->I);
+            if (auto *Call = dyn_cast<CallBase>(S->I)) {
+                Value *Target = decode(Builder, encodedSlot(S->Targets[0]));
+                copyABIAttributes(*Call, *cast<Function>(S->Targets[0]));
+                Call->setCalledOperand(Builder.CreateIntToPtr(Target, Call->getCalledOperand()->getType()));
+                routedSites.push_back(Call);
+                stats.indirectCalls++;
+                continue;
+            }
+            auto *Br = cast<BranchInst>(S->I);
+            Value *Slot = Builder.CreateSelect(Br->getCondition(), encodedSlot(S->Targets[0]),
+                                               encodedSlot(S->Targets[1]));
+            Value *Target = Builder.CreateIntToPtr(decode(Builder, Slot), PointerType::getUnqual(Type::getInt8Ty(Ctx)));
+            IndirectBrInst *IBr = Builder.CreateIndirectBr(Target, 2);
+            IBr->addDestination(Br->getSuccessor(0));
+            IBr->addDestination(Br->getSuccessor(1));
+            Br->eraseFromParent();
+            routedSites.push_back(IBr);
+            stats.indirectBranches++;
+        }
+
+        stats.indirectTables++;
+        stats.indirectTableBytes += DL.getTypeAllocSize(TableTy);
+        return chosen.size();
+    }
+
+    // Calls whose callee must stay visible (intrinsics, musttail, setjmp-like
+    // and always_inline callees, operand bundles) or whose type differs from
+    // the callee's are left direct.
+    static bool isRoutableCall(const CallBase &Call) {
+        auto *Callee = dyn_cast<Function>(Call.getCalledOperand());
+        if (!Callee || Callee->isIntrinsic() || Call.isInlineAsm() || isKept(Call) || isa<CallBrInst>(Call) ||
+            Call.hasOperandBundles() || Call.getFunctionType() != Callee->getFunctionType()) {
+            return false;
+        }
+        if (auto *CI = dyn_cast<CallInst>(&Call)) {
+            if (CI->isMustTailCall()) {
+                return false;
+            }
+        }
+        return !Callee->hasFnAttribute(Attribute::ReturnsTwice) && !Callee->hasFnAttribute(Attribute::AlwaysInline);
+    }
+
+    // A direct call falls back to its callee's attributes for the calling
+    // convention details (signext, byval, sret, ...); an indirect one cannot,
+    // so they are copied to the call site first.
+    static void copyABIAttributes(CallBase &Call, Function &Callee) {
+        static const Attribute::AttrKind Kinds[] = {
+            Attribute::ZExt, Attribute::SExt, Attribute::InReg, Attribute::ByVal, Attribute::ByRef,
+            Attribute::StructRet, Attribute::InAlloca, Attribute::Preallocated, Attribute::Nest,
+            Attribute::SwiftSelf, Attribute::SwiftError};
+        AttributeList Own = Call.getAttributes();
+        AttributeList Inherited = Callee.getAttributes();
+        for (Attribute::AttrKind Kind : Kinds) {
+            for (unsigned i = 0; i < Callee.arg_size(); i++) {
+                if (Inherited.hasParamAttr(i, Kind) && !Own.hasParamAttr(i, Kind)) {
+                    Call.addParamAttr(i, Inherited.getParamAttr(i, Kind));
+                }
+            }
+            if (Inherited.hasRetAttr(Kind) && !Own.hasRetAttr(Kind)) {
+                Call.addRetAttr(Inherited.getRetAttrs().getAttribute(Kind));
+            }
+        }
+        Call.setCallingConv(Callee.getCallingConv());
+    }
+
+    // Demote PHIs and every value used outside its defining block to stack
+    // slots. Once all blocks hang off the dispatcher only the entry block
+    // dominates anything, so entry values can stay in registers.
+    static void demoteCrossBlockValues(Function &F) {
+        BasicBlock *Entry = &F.getEntryBlock();
+        std::vector<PHINode*> phis;
+        for (BasicBlock &BB : F) {
+            for (PHINode &Phi : BB.phis()) {
+                phis.push_back(&Phi);
+            }
+        }
+        for (PHINode *Phi : phis) {
+            DemotePHIToStack(Phi);
+        }
+
+        std::vector<Instruction*> escaping;
+        for (BasicBlock &BB : F) {
+            if (&BB == Entry) {
+                continue;
+            }
+            for (Instruction &I : BB) {
+                if (I.isUsedOutsideOfBlock(&BB)) {
+                    escaping.push_back(&I);
+                }
+            }
+        }
+        for (Instruction *I : escaping) {
+            DemoteRegToStack(*I);
+        }
+    }
+
+    // Replace BB's terminator with a dispatch to the encoded next state.
+    // Switch terminators keep their comparison but send each distinct
+    // successor through a trampoline that dispatches to it.
+    template <typename EncodeFn, typename DispatchFn, typename TrampolineFn>
+    static void rewriteTerminator(BasicBlock *BB, EncodeFn encode, DispatchFn dispatch, TrampolineFn trampoline) {
+        Instruction *Term = BB->getTerminator();
+        if (auto *Br = dyn_cast<BranchInst>(Term)) {
+            if (Br->isUnconditional()) {
+                BasicBlock *Succ = Br->getSuccessor(0);
+                dispatch(Term, encode(Succ), {Succ});
+            } else {
+                BasicBlock *T = Br->getSuccessor(0);
+                BasicBlock *F = Br->getSuccessor(1);
+                IRBuilder<> Builder(Term);
+                Value *Next = Builder.CreateSelect(Br->getCondition(), encode(T), encode(F));
+                dispatch(Term, Next, {T, F});
+            }
+        } else if (auto *Switch = dyn_cast<SwitchInst>(Term)) {
+            DenseMap<BasicBlock*, BasicBlock*> trampolines;
+            for (unsigned i = 0; i < Switch->getNumSuccessors(); i++) {
+                BasicBlock *Succ = Switch->getSuccessor(i);
+                BasicBlock *&Trampoline = trampolines[Succ];
+                if (!Trampoline) {
+                    Trampoline = trampoline(Succ);
+                }
+                Switch->setSuccessor(i, Trampoline);
+            }
+        }
+        // Returns and unreachable leave the function and need no dispatch.
+    }
+
+    // Replace integer immediates with C' ^ R decoded as (C' + Z) ^ R, where
+    // Z is the opaque zero computed once in the entry block. The decode
+    // depends only on Z and constants, so it is loop-invariant: it goes into
+    // the preheader of the outermost loop around the use when there is one
+    // (or right before the use, where LICM can still hoist it), never into a
+    // loop body. 0, 1 and -1 are left alone; they are everywhere and give
+    // nothing away. So are multipliers, divisors and shift amounts: as
+    // immediates they become lea, magic-number multiplies and fixed shifts,
+    // and as registers they would cost a real mul or div every iteration.
+    int encodeConstants(Function &F) {
+        std::vector<std::pair<Instruction*, unsigned>> sites;
+        for (BasicBlock &BB : F) {
+            for (Instruction &I : BB) {
+                if (!canEncodeOperands(I)) {
+                    continue;
+                }
+                for (unsigned i = 0; i < I.getNumOperands(); ++i) {
+                    if (needsImmediate(I, i)) {
+                        continue;
+                    }
+                    auto *C = dyn_cast<ConstantInt>(I.getOperand(i));
+                    if (C && C->getBitWidth() >= 8 && C->getBitWidth() <= 64 &&
+                        !C->isZero() && !C->isOne() && !C->isMinusOne()) {
+                        sites.emplace_back(&I, i);
+                    }
+                }
+            }
+        }
+        if (sites.empty()) {
+            return 0;
+        }
+
+        DominatorTree DT(F);
+        LoopInfo LI(DT);
+        Module &M = *F.getParent();
+        BasicBlock &Entry = F.getEntryBlock();
+        IRBuilder<> EntryBuilder(&Entry, Entry.getFirstInsertionPt());
+        while (isa<AllocaInst>(&*EntryBuilder.GetInsertPoint())) {
+            EntryBuilder.SetInsertPoint(EntryBuilder.GetInsertPoint()->getNextNode());
+        }
+        Value *Zero = OpaquePredicates::createZero(EntryBuilder, M);
+
+        for (auto &Site : sites) {
+            Instruction *I = Site.first;
+            auto *C = cast<ConstantInt>(I->getOperand(Site.second));
+            IntegerType *Ty = C->getType();
+
+            Instruction *InsertBefore = I;
+            if (Loop *L = LI.getLoopFor(I->getParent())) {
+                while (L->getParentLoop()) {
+                    L = L->getParentLoop();
+                }
+                if (BasicBlock *Preheader = L->getLoopPreheader()) {
+                    InsertBefore = Preheader->getTerminator();
+                }
+            }
+
+            // A mask with only the sign bit set would let InstCombine turn
+            // the xor into an add and fold it into the encoded constant.
+            APInt Mask = APInt(64, ((uint64_t)rng() << 32) | rng()).trunc(Ty->getBitWidth());
+            if (Mask.isSignMask() || Mask.isZero()) {
+                Mask.setBit(0);
+            }
+            APInt Encoded = C->getValue() ^ Mask;
+
+            IRBuilder<> Builder(InsertBefore);
+            Value *Z = Builder.CreateZExtOrTrunc(Zero, Ty);
+            Value *Sum = markKeep(Builder.CreateAdd(ConstantInt::get(Ty, Encoded), Z));
+            Value *Decoded = markKeep(Builder.CreateXor(Sum, ConstantInt::get(Ty, Mask)));
+            I->setOperand(Site.second, Decoded);
+            stats.constantsEncoded++;
+        }
+        return sites.size();
+    }
+
+    // Operands that must stay immediates (GEP struct indices, switch cases,
+    // alloca sizes, intrinsic immargs) or that have no single insertion point
+    // (PHIs) are not encoded; neither is the obfuscation's own arithmetic.
+    static bool needsImmediate(const Instruction &I, unsigned OpNo) {
+        switch (I.getOpcode()) {
+        case Instruction::Mul:
+            return true;
+        case Instruction::UDiv:
+        case Instruction::SDiv:
+        case Instruction::URem:
+        case Instruction::SRem:
+        case Instruction::Shl:
+        case Instruction::LShr:
+        case Instruction::AShr:
+            return OpNo == 1;
+        default:
+            return false;
+        }
+    }
+
+    static bool canEncodeOperands(const Instruction &I) {
+        if (isKept(I) || I.isEHPad() || isa<PHINode>(I) || isa<GetElementPtrInst>(I) ||
+            isa<SwitchInst>(I) || isa<AllocaInst>(I) || I.getType()->isVectorTy()) {
+            return false;
+        }
+        if (auto *Call = dyn_cast<CallBase>(&I)) {
+            return !Call->isInlineAsm() && !isa<IntrinsicInst>(Call);
+        }
+        return true;
+    }
+
+    // True when BB can reach itself again, i.e. it is part of a loop.
+    static bool inCycle(BasicBlock *BB) {
+        SmallPtrSet<BasicBlock *, 16> Seen;
+        SmallVector<BasicBlock *, 16> Worklist(succ_begin(BB), succ_end(BB));
+        while (!Worklist.empty()) {
+            BasicBlock *Next = Worklist.pop_back_val();
+            if (Next == BB) {
+                return true;
+            }
+            if (Seen.insert(Next).second) {
+                Worklist.append(succ_begin(Next), succ_end(Next));
+            }
+        }
+        return false;
+    }
+
+    // An operation is a reduction step when it feeds the PHI it reads from.
+    // The vectorizers only recognize such chains when they are plain
+    // binary operators, so the early (pre-vectorization) run leaves them
+    // alone. Before SROA/mem2reg (the CLI's -disable-llvm-passes IR, or
+    // pipeline-start) the accumulator is still a stack slot: the step loads
+    // the slot and stores its result back to it inside a loop.
+    static bool isReductionStep(BinaryOperator *Op) {
+        for (Value *Operand : Op->operands()) {
+            if (auto *Phi = dyn_cast<PHINode>(Operand)) {
+                for (Value *Incoming : Phi->incoming_values()) {
+                    if (Incoming == Op) {
+                        return true;
+                    }
+                }
+                continue;
+            }
+            auto *Load = dyn_cast<LoadInst>(Operand);
+            if (!Load || Load->isVolatile() || !isa<AllocaInst>(Load->getPointerOperand()->stripPointerCasts())) {
+                continue;
+            }
+            for (User *U : Op->users()) {
+                auto *Store = dyn_cast<StoreInst>(U);
+                if (Store && Store->getValueOperand() == Op &&
+                    Store->getPointerOperand() == Load->getPointerOperand() && inCycle(Op->getParent())) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    static bool isSubstitutable(BinaryOperator *Op, unsigned mbaLevel) {
+        if (isKept(*Op)) {
+            return false;
+        }
+        if (mbaLevel == 0) {
+            return Op->getOpcode() == Instruction::Add;
+        }
+        return MBARewriter::supports(Op->getOpcode()) && Op->getType()->getScalarSizeInBits() >= 8;
+    }
+
+    // Substitute simple operations with complex equivalents. Level 0 is the
+    // original add-only rewrite; levels 1..MBAMaxLevel use MBARewriter.
+    void substituteInstructions(Function &F, bool preserveReductions, unsigned mbaLevel) {
+        std::vector<BinaryOperator*> toSubstitute;
+        mbaLevel = std::min(mbaLevel, MBAMaxLevel);
+        
+        for (BasicBlock &BB : F) {
+            for (Instruction &I : BB) {
+                if (auto *Op = dyn_cast<BinaryOperator>(&I)) {
+                    if (!isSubstitutable(Op, mbaLevel)) {
+                        continue;
+                    }
+                    if (Op->getType()->isVectorTy() && !InstrSubVectorOpt) {
+                        remark([&] {
+                            return OptimizationRemarkMissed(RemarkPass, "NotSubstituted", Op)
+                                   << "vector " << ore::NV("Opcode", Op->getOpcodeName())
+                                   << " kept: -instr-sub-vector is off";
+                        });
+                        continue;
+                    }
+                    if (preserveReductions && isReductionStep(Op)) {
+                        remark([&] {
+                            return OptimizationRemarkMissed(RemarkPass, "NotSubstituted", Op)
+                                   << ore::NV("Opcode", Op->getOpcodeName())
+                                   << " kept: reduction step, left for the vectorizer (see -instr-sub-late)";
+                        });
+                        continue;
+                    }
+                    toSubstitute.push_back(Op);
+                }
+            }
+        }
+        
+        for (BinaryOperator *Op : toSubstitute) {
+            IRBuilder<> Builder(Op);
+            
+            Value *A = Op->getOperand(0);
+            Value *B = Op->getOperand(1);
+            Value *Result;
+            unsigned Instructions;
+            
+            if (mbaLevel > 0) {
+                MBARewriter MBA(Builder, A, B);
+                Result = MBA.rewrite(Op->getOpcode(), mbaLevel, rng);
+                MBARewriter::Shape Shape = MBA.shape(Result);
+                stats.recordMBA(mbaLevel, Op->getOpcodeName(), Shape.Instructions, Shape.Depth);
+                Instructions = Shape.Instructions;
+            } else if (Op->getType()->isVectorTy()) {
+                // Replace: a + b with: (a ^ b) + ((a & b) << 1)
+                // Every step is a lane-wise vector op, so the value never
+                // gets scalarized; the shift amount is a splat constant.
+                Value *Xor = markKeep(Builder.CreateXor(A, B));
+                Value *And = markKeep(Builder.CreateAnd(A, B));
+                Value *Carry = markKeep(Builder.CreateShl(And, ConstantInt::get(Op->getType(), 1)));
+                Result = markKeep(Builder.CreateAdd(Xor, Carry));
+                Instructions = 4;
+            } else {
+                // Replace: a + b with: (a - (-b))
+                Value *NegB = markKeep(Builder.CreateNeg(B));
+                Result = markKeep(Builder.CreateSub(A, NegB));
+                Instructions = 2;
+            }
+            stats.substitutionExtraInstructions += Instructions - 1;
+            substitutedPerBlock[Op->getParent()] += Instructions - 1;
+            remark([&] {
+                return OptimizationRemark(RemarkPass, "Substituted", Op)
+                       << "rewrote " << ore::NV("Opcode", Op->getOpcodeName()) << " as "
+                       << ore::NV("Instructions", Instructions) << " instructions (MBA level "
+                       << ore::NV("Level", mbaLevel) << ")";
+            });
+            
+            Op->replaceAllUsesWith(Result);
+            Op->eraseFromParent();
+            
+            stats.instructionSubstitutions++;
+        }
+    }
+};
+
+// Per-function obfuscation level requested in the source with
+// __attribute__((annotate("obf:none"))), "obf:light" or "obf:heavy".
+enum class AnnotatedLevel { Default, None, Light, Heavy };
+
+// Reads llvm.global.annotations once per module and answers per-function
+// lookups from a map, so annotated hot paths cost nothing to check.
+class FunctionAnnotations {
+private:
+    const Module *Parsed = nullptr;
+    DenseMap<const Function*, AnnotatedLevel> Levels;
+    DenseMap<const Function*, unsigned> MBALevels;
+    DenseSet<const Function*> Virtualized;
+
+    // "obf:mba=<n>" picks the substitution level for one function.
+    static bool parseMBALevel(StringRef Annotation, unsigned &Level) {
+        return Annotation.consume_front("obf:mba=") && !Annotation.getAsInteger(10, Level);
+    }
+
+    static AnnotatedLevel parseLevel(StringRef Annotation) {
+        if (Annotation == "obf:none") {
+            return AnnotatedLevel::None;
+        }
+        if (Annotation == "obf:light") {
+            return AnnotatedLevel::Light;
+        }
+        if (Annotation == "obf:heavy") {
+            return AnnotatedLevel::Heavy;
+        }
+        return AnnotatedLevel::Default;
+    }
+
+    void parse(const Module &M) {
+        Parsed = &M;
+        Levels.clear();
+        MBALevels.clear();
+        Virtualized.clear();
+
+        // Each entry is { ptr function, ptr string, ptr file, i32 line, ... }.
+        const GlobalVariable *GA = M.getNamedGlobal("llvm.global.annotations");
+        if (!GA || !GA->hasInitializer()) {
+            return;
+        }
+        auto *Entries = dyn_cast<ConstantArray>(GA->getInitializer());
+        if (!Entries) {
+            return;
+        }
+        for (const Use &U : Entries->operands()) {
+            auto *Entry = dyn_cast<ConstantStruct>(U.get());
+            if (!Entry || Entry->getNumOperands() < 2) {
+                continue;
+            }
+            auto *Fn = dyn_cast<Function>(Entry->getOperand(0)->stripPointerCasts());
+            auto *Str = dyn_cast<GlobalVariable>(Entry->getOperand(1)->stripPointerCasts());
+            if (!Fn || !Str || !Str->hasInitializer()) {
+                continue;
+            }
+            auto *Data = dyn_cast<ConstantDataArray>(Str->getInitializer());
+            if (!Data || !Data->isCString()) {
+                continue;
+            }
+            AnnotatedLevel Level = parseLevel(Data->getAsCString());
+            unsigned MBALevel;
+            if (Level != AnnotatedLevel::Default) {
+                Levels[Fn] = Level;
+            } else if (parseMBALevel(Data->getAsCString(), MBALevel)) {
+                MBALevels[Fn] = MBALevel;
+            } else if (Data->getAsCString() == "obf:virtualize") {
+                Virtualized.insert(Fn);
+            }
+        }
+    }
+
+public:
+    AnnotatedLevel lookup(const Function &F) {
+        if (Parsed != F.getParent()) {
+            parse(*F.getParent());
+        }
+        auto It = Levels.find(&F);
+        return It == Levels.end() ? AnnotatedLevel::Default : It->second;
+    }
+
+    bool isVirtualized(const Function &F) {
+        if (Parsed != F.getParent()) {
+            parse(*F.getParent());
+        }
+        return Virtualized.count(&F);
+    }
+
+    // MBA level for F: its obf:mba annotation if it has one, else the level
+    // implied by obf:light (at most 1) or obf:heavy, else Default.
+    unsigned lookupMBALevel(const Function &F, unsigned Default) {
+        AnnotatedLevel Level = lookup(F);
+        auto It = MBALevels.find(&F);
+        if (It != MBALevels.end()) {
+            return It->second;
+        }
+        if (Level == AnnotatedLevel::Light) {
+            return std::min(Default, 1u);
+        }
+        if (Level == AnnotatedLevel::Heavy) {
+            return MBAMaxLevel;
+        }
+        return Default;
+    }
+};
+
+// Functions picked for virtualization (obf:virtualize or -vm-functions).
+static bool isSelectedForVM(FunctionAnnotations &Annotations, const Function &F) {
+    if (Annotations.isVirtualized(F)) {
+        return true;
+    }
+    for (const std::string &Name : VMFunctionsOpt) {
+        if (F.getName() == Name) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// The other transforms leave a selected function to obfuscator-vm, also
+// when it has not run yet (extension points before optimizer-last). Only
+// the functions it could not compile, marked obf.vm-rejected, are
+// obfuscated as usual.
+static const char *const VMRejectedAttr = "obf.vm-rejected";
+
+static bool isLeftToVM(FunctionAnnotations &Annotations, const Function &F) {
+    return F.hasFnAttribute("obf.virtualized") ||
+           (isSelectedForVM(Annotations, F) && !F.hasFnAttribute(VMRejectedAttr));
+}
+
+// Static overhead estimate.
+//
+// The cost of a function is the TTI latency of each instruction, weighted by
+// its block's frequency relative to the entry block, i.e. the expected
+// latency of one call. Blocks in Dead sit behind always-false predicates
+// and are left out; static branch probabilities would otherwise count
+// them as taken half of the time. Without profile data the frequencies
+// are heuristic too, so the ratio before/after is the useful number,
+// not the absolute value.
+
+static double estimateCost(Function &F, const TargetTransformInfo &TTI,
+                           const SmallPtrSetImpl<const BasicBlock*> &Dead) {
+    DominatorTree DT(F);
+    LoopInfo LI(DT);
+    BranchProbabilityInfo BPI(F, LI);
+    BlockFrequencyInfo BFI(F, BPI, LI);
+    double EntryFreq = BFI.getBlockFreq(&F.getEntryBlock()).getFrequency();
+    double Total = 0;
+    for (BasicBlock &BB : F) {
+        if (Dead.count(&BB)) {
+            continue;
+        }
+        double Block = 0;
+        for (Instruction &I : BB) {
+            InstructionCost C = TTI.getInstructionCost(&I, TargetTransformInfo::TCK_Latency);
+            if (C.isValid()) {
+                Block += *C.getValue();
+            }
+        }
+        Total += Block * BFI.getBlockFreq(&BB).getFrequency() / EntryFreq;
+    }
+    return Total;
+}
+
+// Swap the body of Backup, a CloneFunction copy of F, back into F and delete
+// Backup. Globals the transforms created for F become unused and are left
+// to GlobalDCE.
+static void restoreBody(Function &F, Function *Backup) {
+    for (BasicBlock &BB : F) {
+        BB.dropAllReferences();
+    }
+    while (!F.empty()) {
+        F.begin()->eraseFromParent();
+    }
+    for (auto Args : zip(Backup->args(), F.args())) {
+        std::get<0>(Args).replaceAllUsesWith(&std::get<1>(Args));
+    }
+#if LLVM_VERSION_MAJOR >= 16
+    F.splice(F.end(), Backup);
+#else
+    F.getBasicBlockList().splice(F.end(), Backup->getBasicBlockList());
+#endif
+    Backup->eraseFromParent();
+}
+
+struct ObfuscatorPass : public PassInfoMixin<ObfuscatorPass> {
+    bool BogusBlocks; 
+    bool FakeLoops;
+    bool InstrSub;
+    // Set for the optimizer-last run that follows an earlier extension
+    // point: only the functions obfuscator-vm rejected are left to do.
+    bool VMRejectedOnly = false;
+    FunctionAnnotations Annotations;
+
+    ObfuscatorPass(bool BogusBlocks, bool FakeLoops, bool InstrSub) : BogusBlocks(BogusBlocks), FakeLoops(FakeLoops), InstrSub(InstrSub) {}
+
+    PreservedAnalyses run(Function &F, FunctionAnalysisManager &AM) {
+        // Source annotations override the command line for this function:
+        // light keeps only substitution and cheap bogus blocks, heavy turns
+        // everything on with the strongest predicates.
+        bool BogusBlocks = this->BogusBlocks;
+        bool FakeLoops = this->FakeLoops;
+        bool InstrSub = this->InstrSub;
+        bool Flatten = FlattenOpt;
+        bool ConstObf = ConstObfOpt;
+        bool IndirectCalls = IndirectCallsOpt;
+        bool IndirectBranches = IndirectBranchesOpt;
+        unsigned PredicateTier = OpaqueTierOpt;
+        AnnotatedLevel Level = Annotations.lookup(F);
+        if (F.hasFnAttribute(InstrumentationAttr) || (VMRejectedOnly && !F.hasFnAttribute(VMRejectedAttr))) {
+            return PreservedAnalyses::all();
+        }
+        FunctionScope scope(F, "obfuscator-pass");
+        OptimizationRemarkEmitter &ORE = AM.getResult<OptimizationRemarkEmitterAnalysis>(F);
+        auto skipped = [&](const char *Reason) {
+            ORE.emit([&] {
+                return OptimizationRemarkMissed(RemarkPass, "SkippedFunction", DiagnosticLocation(F.getSubprogram()),
+                                                &F.getEntryBlock())
+                       << "function not obfuscated: " << ore::NV("Reason", Reason);
+            });
+        };
+        if (isLeftToVM(Annotations, F)) {
+            // The interpreter is already the protection; transforming its
+            // handlers would only slow every bytecode op down, and the VM
+            // cannot compile flattened or indirect-routed code.
+            const char *Reason = F.hasFnAttribute("obf.virtualized") ? "virtualized" : "left to obfuscator-vm";
+            errs() << "[ObfuscatorPass] Skipping " << F.getName() << " (" << Reason << ")\n";
+            skipped(Reason);
+            return PreservedAnalyses::all();
+        }
+        if (Level == AnnotatedLevel::None) {
+            errs() << "[ObfuscatorPass] Skipping " << F.getName() << " (obf:none)\n";
+            skipped("obf:none");
+            stats.functionsSkipped++;
+            scope.record().skipped = "obf:none";
+            return PreservedAnalyses::all();
+        } else if (Level == AnnotatedLevel::Light) {
+            // Light only ever reduces the command-line settings.
+            FakeLoops = false;
+            Flatten = false;
+            ConstObf = false;
+            IndirectCalls = false;
+            IndirectBranches = false;
+            PredicateTier = 0;
+        } else if (Level == AnnotatedLevel::Heavy) {
+            BogusBlocks = true;
+            FakeLoops = true;
+            InstrSub = true;
+            Flatten = true;
+            ConstObf = true;
+            IndirectCalls = true;
+            IndirectBranches = true;
+            PredicateTier = NumPredicateTiers - 1;
+        }
+
+        CodeObfuscator obf(seedFor("obfuscator", F.getName()), PredicateTier);
+        obf.setRemarkEmitter(&ORE);
+        bool modified = false;
+
+        // Each transformation below gets its own span in opt -time-trace
+        // (CLI: --trace), nested in the pass manager's span for F.
+        const TargetTransformInfo &TTI = AM.getResult<TargetIRAnalysis>(F);
+        double costBefore;
+        {
+            TimeTraceScope Span("overhead-estimate", F.getName());
+            costBefore = estimateCost(F, TTI, obf.neverExecuted());
+        }
+        // Keep a copy to roll back to. Functions with address-taken blocks
+        // are not copied: blockaddress users outside F would keep pointing
+        // at the deleted blocks.
+        Function *Backup = nullptr;
+        if (OverheadLimitOpt > 0 &&
+            none_of(F, [](const BasicBlock &BB) { return BB.hasAddressTaken(); })) {
+            ValueToValueMapTy VMap;
+            Backup = CloneFunction(&F, VMap);
+            Backup->setLinkage(GlobalValue::PrivateLinkage);
+        }
+
+        // Capture initial stats
+        ObfuscationStats::TransformTotals totalsBefore;
+        if (Backup) {
+            totalsBefore = stats.transformTotals();
+        }
+        int bogusBefore = stats.bogusBlocksAdded;
+        int loopsBefore = stats.fakeLoopsAdded;
+        int subsBefore = stats.instructionSubstitutions;
+        int cyclesBefore = stats.opaquePredicateCycles;
+        long extraBefore = stats.substitutionExtraInstructions;
+
+        stats.functionsObfuscated++;
+        for (BasicBlock &BB : F) {
+            stats.totalBasicBlocks++;
+            for (Instruction &I : BB) {
+                stats.totalInstructions++;
+            }
+        }
+        
+        errs() << "========================================\n";
+        errs() << "[ObfuscatorPass] Processing: " << F.getName() << "\n";
+        errs() << "  Instructions: " << F.getInstructionCount() << "\n";
+        errs() << "  Basic Blocks: " << F.size() << "\n";
+        if (Level == AnnotatedLevel::Light) {
+            errs() << "  Level: light (annotated)\n";
+        } else if (Level == AnnotatedLevel::Heavy) {
+            errs() << "  Level: heavy (annotated)\n";
+        }
+
+        // Apply obfuscations
+        std::vector<BasicBlock*> blocks;
+        for (BasicBlock &BB : F) {
+            blocks.push_back(&BB);
+        }
+        
+        // Blocks ending in ret/unreachable get nothing: there is no edge
+        // left to guard.
+        std::vector<size_t> eligible;
+        for (size_t i = 0; i < blocks.size(); i++) {
+            Instruction *term = blocks[i]->getTerminator();
+            if (term && !isa<ReturnInst>(term) && !isa<UnreachableInst>(term)) {
+                eligible.push_back(i);
+            } else if (term && (BogusBlocks || FakeLoops)) {
+                ORE.emit([&] {
+                    return OptimizationRemarkMissed(RemarkPass, "SkippedBlock", term)
+                           << "no bogus block or fake loop: block ends in "
+                           << ore::NV("Terminator", term->getOpcodeName()) << ", no edge to guard";
+                });
+            }
+        }
+        std::mt19937_64 selectRng(SeedOpt ^ xxHash64(F.getName()));
+        // Eligible blocks the density draw passed over.
+        auto notSelected = [&](const std::vector<size_t> &chosen, const char *Name, const char *What,
+                               unsigned Density, unsigned Max) {
+            for (size_t i : eligible) {
+                if (std::binary_search(chosen.begin(), chosen.end(), i)) {
+                    continue;
+                }
+                ORE.emit([&] {
+                    return OptimizationRemarkMissed(RemarkPass, Name, blocks[i]->getTerminator())
+                           << "no " << What << ": not drawn (density " << ore::NV("Density", Density)
+                           << "%, max " << ore::NV("Max", Max) << " per function)";
+                });
+            }
+        };
+
+        if (BogusBlocks) {
+            TimeTraceScope Span("bogus-blocks", F.getName());
+            errs() << "  [Bogus Blocks] Enabled\n";
+            std::vector<size_t> chosen = selectBlocks(eligible, BogusProbOpt, BogusDensityOpt, BogusMaxOpt, selectRng);
+            notSelected(chosen, "BogusBlockNotSelected", "bogus block", BogusDensityOpt, BogusMaxOpt);
+            for (size_t i : chosen) {
+                errs() << "    Adding bogus block after block " << i << "\n";
+                obf.addBogusBlock(F, blocks[i]);
+                modified = true;
+            }
+            if (stats.bogusBlocksAdded > bogusBefore) {
+                scope.transform("bogus-blocks");
+            }
             errs() << "    Added " << (stats.bogusBlocksAdded - bogusBefore) << " bogus blocks\n";
         }
-        
-        if (FakeLoops) {
-            errs() << "  [Fake Loops] Enabled\n";
-            int loopsAdded = 0;
-            for (size_t i = 0; i < blocks.size() && loopsAdded < 2; i++) {
-                Instruction *term = blocks[i]->getTerminator();
-                if (term && (isa<ReturnInst>(term) || isa<UnreachableInst>(term))) {
+        
+        if (FakeLoops) {
+            TimeTraceScope Span("fake-loops", F.getName());
+            errs() << "  [Fake Loops] Enabled\n";
+            std::vector<size_t> chosen =
+                selectBlocks(eligible, FakeLoopProbOpt, FakeLoopDensityOpt, FakeLoopMaxOpt, selectRng);
+            notSelected(chosen, "FakeLoopNotSelected", "fake loop", FakeLoopDensityOpt, FakeLoopMaxOpt);
+            for (size_t i : chosen) {
+                errs() << "    Adding fake loop after block " << i << "\n";
+                obf.addFakeLoop(F, blocks[i]);
+                modified = true;
+            }
+            if (stats.fakeLoopsAdded > loopsBefore) {
+                scope.transform("fake-loops");
+            }
+            errs() << "    Added " << (stats.fakeLoopsAdded - loopsBefore) << " fake loops\n";
+        }
+        
+        // After bogus blocks and fake loops, so their constants are encoded
+        // too; before flattening, which turns every loop into one.
+        if (ConstObf) {
+            TimeTraceScope Span("constant-encoding", F.getName());
+            errs() << "  [Constant Encoding] Enabled\n";
+            int encoded = obf.encodeConstants(F);
+            if (encoded > 0) {
+                modified = true;
+                scope.transform("constant-encoding");
+                ORE.emit([&] {
+                    return OptimizationRemark(RemarkPass, "ConstantsEncoded", DiagnosticLocation(F.getSubprogram()),
+                                              &F.getEntryBlock())
+                           << "encoded " << ore::NV("Constants", encoded) << " constants";
+                });
+            }
+            errs() << "    Encoded " << encoded << " constants\n";
+        }
+
+        if (Flatten) {
+            TimeTraceScope Span("flatten", F.getName());
+            errs() << "  [Control-Flow Flattening] Enabled ("
+                   << (FlattenDispatchOpt == FlattenDispatch::Switch ? "switch" : "indirectbr") << " dispatch)\n";
+            if (obf.flattenControlFlow(F, FlattenDispatchOpt)) {
+                modified = true;
+                scope.transform("flatten");
+                errs() << "    Flattened " << F.size() << " blocks\n";
+                ORE.emit([&] {
+                    return OptimizationRemark(RemarkPass, "Flattened", DiagnosticLocation(F.getSubprogram()),
+                                              &F.getEntryBlock())
+                           << "flattened " << ore::NV("Blocks", (unsigned)F.size()) << " blocks";
+                });
+            } else {
+                errs() << "    Skipped (too small, EH or indirect branches)\n";
+                ORE.emit([&] {
+                    return OptimizationRemarkMissed(RemarkPass, "NotFlattened", DiagnosticLocation(F.getSubprogram()),
+                                                    &F.getEntryBlock())
+                           << "not flattened: fewer than 3 blocks, EH, or address-taken or indirect branches";
+                });
+            }
+        }
+
+        // After flattening, which refuses functions with address-taken blocks.
+        if (IndirectCalls || IndirectBranches) {
+            TimeTraceScope Span("indirect-routing", F.getName());
+            errs() << "  [Indirect Routing] Enabled\n";
+            int routed = obf.routeIndirect(F, IndirectCalls, IndirectBranches);
+            if (routed > 0) {
+                modified = true;
+                scope.transform("indirect-routing");
+                ORE.emit([&] {
+                    return OptimizationRemark(RemarkPass, "IndirectRouted", DiagnosticLocation(F.getSubprogram()),
+                                              &F.getEntryBlock())
+                           << "routed " << ore::NV("Sites", routed) << " calls and branches through the target table";
+                });
+            }
+            errs() << "    Routed " << routed << " calls and branches\n";
+        }
+        
+        if (InstrSub && InstrSubLateOpt) {
+            errs() << "  [Instruction Substitution] Deferred to obfuscator-sub\n";
+        } else if (InstrSub) {
+            TimeTraceScope Span("substitution", F.getName());
+            errs() << "  [Instruction Substitution] Enabled\n";
+            obf.substituteInstructions(F, /*preserveReductions=*/true, Annotations.lookupMBALevel(F, MBALevelOpt));
+            if (stats.instructionSubstitutions > subsBefore) {
+                modified = true;
+                scope.transform("substitution");
+            }
+            errs() << "    Substituted " << (stats.instructionSubstitutions - subsBefore) << " instructions\n";
+        }
+        
+        
+        double costAfter = costBefore;
+        if (modified) {
+            TimeTraceScope Span("overhead-estimate", F.getName());
+            costAfter = estimateCost(F, TTI, obf.neverExecuted());
+        }
+        double ratio = costBefore > 0 ? costAfter / costBefore : 1.0;
+        ObfuscationStats::FunctionRecord &R = scope.record();
+        char line[160];
+        std::snprintf(line, sizeof(line), "  [Overhead] Weighted cost %.1f -> %.1f (x%.2f)\n", costBefore, costAfter, ratio);
+        errs() << line;
+        ORE.emit([&] {
+            return OptimizationRemarkAnalysis(RemarkPass, "Overhead", DiagnosticLocation(F.getSubprogram()),
+                                              &F.getEntryBlock())
+                   << "estimated cost per call " << ore::NV("CostBefore", decimal(costBefore)) << " -> "
+                   << ore::NV("CostAfter", decimal(costAfter)) << " (x" << ore::NV("Ratio", decimal(ratio, 2)) << ")";
+        });
+        bool overLimit = OverheadLimitOpt > 0 && ratio > OverheadLimitOpt;
+        if (overLimit && Backup) {
+            std::snprintf(line, sizeof(line), "  [Overhead] Over -overhead-limit=%g, restoring the original body\n",
+                          (double)OverheadLimitOpt);
+            errs() << line;
+            {
+                TimeTraceScope Span("rollback", F.getName());
+                restoreBody(F, Backup);
+            }
+            Backup = nullptr;
+            stats.restoreTransformTotals(totalsBefore);
+            ORE.emit([&] {
+                return OptimizationRemarkMissed(RemarkPass, "RolledBack", DiagnosticLocation(F.getSubprogram()),
+                                                &F.getEntryBlock())
+                       << "original body restored: estimated cost x" << ore::NV("Ratio", decimal(ratio, 2))
+                       << " is over -overhead-limit=" << ore::NV("Limit", decimal(OverheadLimitOpt, 2));
+            });
+            costAfter = costBefore;
+            R.transforms.clear();
+            R.overhead = "rolled-back";
+            stats.rolledBack.push_back(F.getName().str());
+        } else if (overLimit || (OverheadWarnOpt > 0 && ratio > OverheadWarnOpt)) {
+            std::snprintf(line, sizeof(line), "estimated cost grows x%.1f, over -overhead-%s=%g\n", ratio,
+                          overLimit ? "limit" : "warn", overLimit ? (double)OverheadLimitOpt : (double)OverheadWarnOpt);
+            errs() << "warning: " << F.getName() << ": " << line;
+            R.overhead = "over-warn";
+            stats.overWarn.push_back(F.getName().str());
+        }
+        if (Backup) {
+            Backup->eraseFromParent();
+        }
+        if (modified && R.overhead != "rolled-back") {
+            R.predicateTier = OpaquePredicates::clampTier(PredicateTier);
+            R.predicateCycles = PredicateTierCycles[R.predicateTier];
+            if (InstrumentOpt) {
+                TimeTraceScope Span("instrument", F.getName());
+                obf.instrument(F);
+            }
+        }
+        R.costBefore = costBefore;
+        R.costAfter = costAfter;
+        stats.costBefore += costBefore;
+        stats.costAfter += costAfter;
+        errs() << "========================================\n";
+
+        // Static estimate: predicate latency on the guarded edges plus one
+        // cycle per extra instruction from substitution.
+        if (R.overhead != "rolled-back") {
+            R.estimatedCycles += (stats.opaquePredicateCycles - cyclesBefore) +
+                                 (stats.substitutionExtraInstructions - extraBefore);
+        }
+
+        return modified ? PreservedAnalyses::none() : PreservedAnalyses::all();
+    }
+    
+    static bool isRequired() { return true; }
+
+    // Pick blocks spread over the whole function: every eligible block is a
+    // candidate with probability Prob, and up to Density% of the eligible
+    // blocks (at least one, at most Max) are drawn from the candidates. The
+    // result is in layout order, so the same seed gives the same blocks.
+    static std::vector<size_t> selectBlocks(const std::vector<size_t> &eligible, double Prob,
+                                            unsigned Density, unsigned Max, std::mt19937_64 &rng) {
+        std::vector<size_t> candidates;
+        std::uniform_real_distribution<double> chance(0.0, 1.0);
+        for (size_t i = 0; i < eligible.size(); i++) {
+            if (chance(rng) < Prob) {
+                candidates.push_back(eligible[i]);
+            }
+        }
+        size_t budget = (eligible.size() * std::min(Density, 100u) + 99) / 100;
+        budget = std::min<size_t>(std::min<size_t>(budget, Max), candidates.size());
+
+        // Partial Fisher-Yates: the first budget entries are a uniform draw.
+        for (size_t i = 0; i < budget; i++) {
+            std::swap(candidates[i], candidates[i + rng() % (candidates.size() - i)]);
+        }
+        candidates.resize(budget);
+        std::sort(candidates.begin(), candidates.end());
+        return candidates;
+    }
+};
+
+// Substitution-only pass meant to be scheduled after the loop and SLP
+// vectorizers, e.g. -passes='obfuscator-pass,default<O2>,obfuscator-sub'
+// together with -instr-sub-late. By then reductions are already vectorized,
+// so every add (scalar or vector) is rewritten.
+struct ObfuscatorSubPass : public PassInfoMixin<ObfuscatorSubPass> {
+    FunctionAnnotations Annotations;
+
+    PreservedAnalyses run(Function &F, FunctionAnalysisManager &AM) {
+        if (Annotations.lookup(F) == AnnotatedLevel::None || isLeftToVM(Annotations, F) ||
+            F.hasFnAttribute(InstrumentationAttr)) {
+            return PreservedAnalyses::all();
+        }
+
+        FunctionScope scope(F, "obfuscator-sub");
+        CodeObfuscator obf(seedFor("obfuscator-sub", F.getName()));
+        obf.setRemarkEmitter(&AM.getResult<OptimizationRemarkEmitterAnalysis>(F));
+        int subsBefore = stats.instructionSubstitutions;
+        long extraBefore = stats.substitutionExtraInstructions;
+
+        {
+            TimeTraceScope Span("substitution-late", F.getName());
+            obf.substituteInstructions(F, /*preserveReductions=*/false, Annotations.lookupMBALevel(F, MBALevelOpt));
+        }
+
+        int substituted = stats.instructionSubstitutions - subsBefore;
+        scope.record().estimatedCycles += stats.substitutionExtraInstructions - extraBefore;
+        if (substituted > 0) {
+            scope.transform("substitution-late");
+            errs() << "[ObfuscatorSubPass] " << F.getName() << ": substituted "
+                   << substituted << " instructions\n";
+        }
+        return substituted > 0 ? PreservedAnalyses::none() : PreservedAnalyses::all();
+    }
+
+    static bool isRequired() { return true; }
+};
+
+
+// Post-obfuscation cleanup, scheduled as -passes='obfuscator-pass,obfuscator-cleanup'.
+//
+// Runs SROA, GVN, InstCombine and DCE over the obfuscated function to get
+// back the performance lost to unoptimized IR and leftover neg/sub chains,
+// without undoing the transforms. Every !obf.keep instruction is routed
+// through an empty inline-asm copy for the duration of the pipeline; the
+// optimizer cannot see through it, so nothing is combined into or across a
+// kept value. The copies are removed afterwards and never reach codegen.
+// Finally, kept instructions are sunk next to their first use to shorten
+// the live ranges the opaque predicates would otherwise hold open.
+struct ObfuscatorCleanupPass : public PassInfoMixin<ObfuscatorCleanupPass> {
+    // Distinctive asm string so the copies can be found again after GVN has
+    // merged or moved some of them.
+    static constexpr const char *BarrierAsm = "# obf.keep";
+
+    static bool isBarrier(const Instruction &I) {
+        auto *Call = dyn_cast<CallInst>(&I);
+        if (!Call) {
+            return false;
+        }
+        auto *IA = dyn_cast<InlineAsm>(Call->getCalledOperand());
+        return IA && IA->getAsmString() == BarrierAsm;
+    }
+
+    static CallInst *createBarrier(IRBuilder<> &Builder, Value *V) {
+        FunctionType *FTy = FunctionType::get(V->getType(), {V->getType()}, false);
+        InlineAsm *IA = InlineAsm::get(FTy, BarrierAsm, "=r,0", /*hasSideEffects=*/false);
+        CallInst *Copy = Builder.CreateCall(FTy, IA, {V});
+        Copy->setDoesNotAccessMemory();
+        Copy->setDoesNotThrow();
+        return Copy;
+    }
+
+    // Shield kept instructions from both sides: users see a copy of the
+    // result, and the instruction itself only sees copies of its operands,
+    // so InstCombine can neither fold it into a user nor rewrite it in place
+    // (e.g. canonicalize sub x, -5 back to add x, 5).
+    static void insertBarriers(Function &F) {
+        std::vector<Instruction*> kept;
+        for (BasicBlock &BB : F) {
+            for (Instruction &I : BB) {
+                if (isKept(I) && !I.getType()->isVoidTy() && !isa<PHINode>(I)) {
+                    kept.push_back(&I);
+                }
+            }
+        }
+
+        for (Instruction *I : kept) {
+            IRBuilder<> Builder(I->getParent(), std::next(I->getIterator()));
+            CallInst *Copy = createBarrier(Builder, I);
+            I->replaceUsesWithIf(Copy, [Copy](Use &U) { return U.getUser() != Copy; });
+        }
+
+        for (Instruction *I : kept) {
+            IRBuilder<> Builder(I);
+            for (Use &Op : I->operands()) {
+                auto *OpInst = dyn_cast<Instruction>(Op.get());
+                if (OpInst && isBarrier(*OpInst)) {
+                    continue;
+                }
+                if (!Op->getType()->isIntOrIntVectorTy()) {
+                    continue;
+                }
+                Op.set(createBarrier(Builder, Op.get()));
+            }
+        }
+    }
+
+    static void removeBarriers(Function &F) {
+        std::vector<Instruction*> barriers;
+        for (BasicBlock &BB : F) {
+            for (Instruction &I : BB) {
+                if (isBarrier(I)) {
+                    barriers.push_back(&I);
+                }
+            }
+        }
+
+        for (Instruction *Copy : barriers) {
+            Copy->replaceAllUsesWith(cast<CallInst>(Copy)->getArgOperand(0));
+            Copy->eraseFromParent();
+        }
+    }
+
+    // Move side-effect-free kept instructions down to their first user when
+    // all users live in the same block. Walking each block bottom-up lets a
+    // whole dependency chain follow its final user.
+    static int sinkKeptToUses(Function &F) {
+        int sunk = 0;
+        for (BasicBlock &BB : F) {
+            for (auto It = BB.rbegin(); It != BB.rend();) {
+                Instruction &I = *It++;
+                if (!isKept(I) || isa<PHINode>(I) || I.mayReadOrWriteMemory() || I.isTerminator()) {
+                    continue;
+                }
+
+                Instruction *FirstUser = nullptr;
+                bool sameBlock = true;
+                for (User *U : I.users()) {
+                    auto *UI = cast<Instruction>(U);
+                    if (UI->getParent() != &BB || isa<PHINode>(UI)) {
+                        sameBlock = false;
+                        break;
+                    }
+                    if (!FirstUser || UI->comesBefore(FirstUser)) {
+                        FirstUser = UI;
+                    }
+                }
+
+                if (sameBlock && FirstUser && I.getNextNode() != FirstUser) {
+                    I.moveBefore(FirstUser);
+                    sunk++;
+                }
+            }
+        }
+        return sunk;
+    }
+
+    PreservedAnalyses run(Function &F, FunctionAnalysisManager &AM) {
+        FunctionScope scope(F, "obfuscator-cleanup");
+        insertBarriers(F);
+
+        FunctionPassManager FPM;
+#if LLVM_VERSION_MAJOR >= 16
+        FPM.addPass(SROAPass(SROAOptions::ModifyCFG));
+#else
+        FPM.addPass(SROAPass());
+#endif
+        FPM.addPass(GVNPass());
+        FPM.addPass(InstCombinePass());
+        FPM.addPass(DCEPass());
+        FPM.addPass(SinkingPass());
+        FPM.run(F, AM);
+
+        removeBarriers(F);
+        int sunk = sinkKeptToUses(F);
+
+        errs() << "[ObfuscatorCleanupPass] " << F.getName() << ": " << F.getInstructionCount()
+               << " instructions after cleanup, " << sunk << " kept instructions sunk\n";
+        return PreservedAnalyses::none();
+    }
+};
+
+// String encryption, scheduled as -passes='obfuscator-strings'.
+//
+// Every private constant C string that is only referenced from instructions
+// is replaced by an XOR-encrypted copy in .rodata plus a zeroed buffer of the
+// same size. Each use first checks a per-string guard byte with an acquire
+// load (a plain mov on x86); only the first use of a given string takes the
+// cold path, which claims the guard with a cmpxchg, decrypts into the buffer
+// and publishes it with a release store. Threads that lose the race spin
+// until the winner is done. Strings that are never used in a run are never
+// decrypted, and nothing runs at load time.
+//
+// Strings referenced from other globals (string tables, vtables) or from
+// obf:none functions are left in plain text, so hot paths marked untouchable
+// do not pay for the guard.
+//
+// The buffers above are private writable pages: every process that touches a
+// string gets its own dirty copy. With -string-decrypt=stack, a string passed
+// straight to a call argument the callee does not capture (puts, printf,
+// strcmp after inferattrs) is instead decrypted into a stack buffer right
+// before the call and wiped right after it, so only the read-only encrypted
+// pool is resident and it stays shared between processes. Uses that may
+// outlive the call, and strings above -string-stack-max, keep the global
+// buffer.
+struct StringEncryptionPass : public PassInfoMixin<StringEncryptionPass> {
+    // Guard states
+    static const uint8_t GuardClear = 0;
+    static const uint8_t GuardBusy = 1;
+    static const uint8_t GuardReady = 2;
+
+    FunctionAnnotations Annotations;
+
+    static uint32_t nextKey(uint32_t &State) {
+        State ^= State << 13;
+        State ^= State >> 17;
+        State ^= State << 5;
+        return State >> 24;
+    }
+
+    // Collect the instruction operands that reference C, directly or
+    // through constant expressions. Returns false if any user cannot be
+    // rewritten per use (another global's initializer, an obf:none function).
+    bool collectUses(Constant *C, std::vector<Use*> &Uses) {
+        for (Use &U : C->uses()) {
+            User *Usr = U.getUser();
+            if (auto *I = dyn_cast<Instruction>(Usr)) {
+                if (Annotations.lookup(*I->getFunction()) == AnnotatedLevel::None) {
+                    return false;
+                }
+                Uses.push_back(&U);
+            } else if (auto *CE = dyn_cast<ConstantExpr>(Usr)) {
+                if (!collectUses(CE, Uses)) {
+                    return false;
+                }
+            } else {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Rebuild a constant expression with From replaced by To.
+    static Constant *remap(Constant *C, Constant *From, Constant *To) {
+        if (C == From) {
+            return To;
+        }
+        auto *CE = dyn_cast<ConstantExpr>(C);
+        if (!CE) {
+            return C;
+        }
+        std::vector<Constant*> Ops;
+        bool changed = false;
+        for (Use &Op : CE->operands()) {
+            Constant *New = remap(cast<Constant>(Op.get()), From, To);
+            changed |= New != Op.get();
+            Ops.push_back(New);
+        }
+        return changed ? CE->getWithOperands(Ops) : C;
+    }
+
+    static bool isCandidate(const GlobalVariable &GV) {
+        if (!GV.isConstant() || !GV.hasLocalLinkage() || !GV.hasInitializer() ||
+            GV.hasSection() || GV.getName().startswith("llvm.")) {
+            return false;
+        }
+        auto *Data = dyn_cast<ConstantDataArray>(GV.getInitializer());
+        return Data && Data->isCString() && Data->getNumElements() > 1;
+    }
+
+    // Fill Loop with the xorshift32 keystream decryption of Len bytes from
+    // Src to Dst, one byte per step (see nextKey), then branch to Exit.
+    static void emitDecryptLoop(IRBuilder<> &Builder, BasicBlock *Pred, BasicBlock *Loop, BasicBlock *Exit,
+                                Value *Dst, Value *Src, Value *Len, Value *Seed) {
+        Type *Int8Ty = Builder.getInt8Ty();
+        Type *Int32Ty = Builder.getInt32Ty();
+        PHINode *Index = Builder.CreatePHI(Int32Ty, 2, "i");
+        PHINode *State = Builder.CreatePHI(Int32Ty, 2, "state");
+        Index->addIncoming(Builder.getInt32(0), Pred);
+        State->addIncoming(Seed, Pred);
+        Value *X = State;
+        X = Builder.CreateXor(X, Builder.CreateShl(X, 13));
+        X = Builder.CreateXor(X, Builder.CreateLShr(X, 17));
+        X = Builder.CreateXor(X, Builder.CreateShl(X, 5));
+        Value *Key = Builder.CreateTrunc(Builder.CreateLShr(X, 24), Int8Ty);
+        Value *Byte = Builder.CreateLoad(Int8Ty, Builder.CreateInBoundsGEP(Int8Ty, Src, Index));
+        Builder.CreateStore(Builder.CreateXor(Byte, Key), Builder.CreateInBoundsGEP(Int8Ty, Dst, Index));
+        Value *Next = Builder.CreateAdd(Index, Builder.getInt32(1));
+        Index->addIncoming(Next, Loop);
+        State->addIncoming(X, Loop);
+        Builder.CreateCondBr(Builder.CreateICmpULT(Next, Len), Loop, Exit);
+    }
+
+    // void __obf_decrypt_string(i8 *dst, i8 *src, i32 len, i32 seed, i8 *guard)
+    static Function *getOrCreateDecryptFunction(Module &M) {
+        if (Function *F = M.getFunction("__obf_decrypt_string")) {
+            return F;
+        }
+        LLVMContext &Ctx = M.getContext();
+        Type *Int8Ty = Type::getInt8Ty(Ctx);
+        Type *Int32Ty = Type::getInt32Ty(Ctx);
+        Type *PtrTy = PointerType::getUnqual(Int8Ty);
+        FunctionType *FTy = FunctionType::get(Type::getVoidTy(Ctx), {PtrTy, PtrTy, Int32Ty, Int32Ty, PtrTy}, false);
+        Function *F = Function::Create(FTy, GlobalValue::PrivateLinkage, "__obf_decrypt_string", M);
+        F->addFnAttr(Attribute::NoInline);
+        F->addFnAttr(Attribute::Cold);
+        F->addFnAttr(Attribute::NoUnwind);
+
+        Value *Dst = F->getArg(0);
+        Value *Src = F->getArg(1);
+        Value *Len = F->getArg(2);
+        Value *Seed = F->getArg(3);
+        Value *Guard = F->getArg(4);
+
+        BasicBlock *Entry = BasicBlock::Create(Ctx, "entry", F);
+        BasicBlock *Loop = BasicBlock::Create(Ctx, "decrypt", F);
+        BasicBlock *Done = BasicBlock::Create(Ctx, "publish", F);
+        BasicBlock *Wait = BasicBlock::Create(Ctx, "wait", F);
+        BasicBlock *Exit = BasicBlock::Create(Ctx, "exit", F);
+
+        IRBuilder<> Builder(Entry);
+        Value *Pair = Builder.CreateAtomicCmpXchg(Guard, Builder.getInt8(GuardClear), Builder.getInt8(GuardBusy),
+                                                  MaybeAlign(1), AtomicOrdering::AcquireRelease,
+                                                  AtomicOrdering::Acquire);
+        Builder.CreateCondBr(Builder.CreateExtractValue(Pair, 1), Loop, Wait);
+
+        Builder.SetInsertPoint(Loop);
+        emitDecryptLoop(Builder, Entry, Loop, Done, Dst, Src, Len, Seed);
+
+        Builder.SetInsertPoint(Done);
+        StoreInst *Publish = Builder.CreateAlignedStore(Builder.getInt8(GuardReady), Guard, Align(1));
+        Publish->setAtomic(AtomicOrdering::Release);
+        Builder.CreateBr(Exit);
+
+        // Another thread is decrypting this string: wait for it to publish.
+        Builder.SetInsertPoint(Wait);
+        LoadInst *Seen = Builder.CreateAlignedLoad(Int8Ty, Guard, Align(1));
+        Seen->setAtomic(AtomicOrdering::Acquire);
+        Builder.CreateCondBr(Builder.CreateICmpEQ(Seen, Builder.getInt8(GuardReady)), Exit, Wait);
+
+        Builder.SetInsertPoint(Exit);
+        Builder.CreateRetVoid();
+        return F;
+    }
+
+    // void __obf_decrypt_stack(i8 *dst, i8 *src, i32 len, i32 seed)
+    static Function *getOrCreateStackDecryptFunction(Module &M) {
+        if (Function *F = M.getFunction("__obf_decrypt_stack")) {
+            return F;
+        }
+        LLVMContext &Ctx = M.getContext();
+        Type *Int32Ty = Type::getInt32Ty(Ctx);
+        Type *PtrTy = PointerType::getUnqual(Type::getInt8Ty(Ctx));
+        FunctionType *FTy = FunctionType::get(Type::getVoidTy(Ctx), {PtrTy, PtrTy, Int32Ty, Int32Ty}, false);
+        Function *F = Function::Create(FTy, GlobalValue::PrivateLinkage, "__obf_decrypt_stack", M);
+        F->addFnAttr(Attribute::NoInline);
+        F->addFnAttr(Attribute::NoUnwind);
+
+        BasicBlock *Entry = BasicBlock::Create(Ctx, "entry", F);
+        BasicBlock *Loop = BasicBlock::Create(Ctx, "decrypt", F);
+        BasicBlock *Exit = BasicBlock::Create(Ctx, "exit", F);
+        IRBuilder<> Builder(Entry);
+        Builder.CreateBr(Loop);
+        Builder.SetInsertPoint(Loop);
+        emitDecryptLoop(Builder, Entry, Loop, Exit, F->getArg(0), F->getArg(1), F->getArg(2), F->getArg(3));
+        Builder.SetInsertPoint(Exit);
+        Builder.CreateRetVoid();
+        return F;
+    }
+
+    // A use can be decrypted on the stack if it is an argument of a plain
+    // call that does not capture it, so the plaintext is dead once the call
+    // returns.
+    static bool isStackUse(const Use &U) {
+        auto *Call = dyn_cast<CallInst>(U.getUser());
+        if (!Call || !Call->isArgOperand(&U) || Call->isMustTailCall()) {
+            return false;
+        }
+        return Call->doesNotCapture(Call->getArgOperandNo(&U));
+    }
+
+    // Rebuild C as instructions before InsertBefore with From replaced by
+    // To, which is not a constant.
+    static Value *materialize(Constant *C, Constant *From, Value *To, Instruction *InsertBefore) {
+        if (C == From) {
+            return To;
+        }
+        auto *CE = dyn_cast<ConstantExpr>(C);
+        if (!CE) {
+            return C;
+        }
+        Instruction *I = nullptr;
+        for (unsigned i = 0; i < CE->getNumOperands(); ++i) {
+            Constant *Op = CE->getOperand(i);
+            Value *New = materialize(Op, From, To, InsertBefore);
+            if (New == Op) {
+                continue;
+            }
+            if (!I) {
+                I = CE->getAsInstruction();
+                I->insertBefore(InsertBefore);
+            }
+            I->setOperand(i, New);
+        }
+        return I ? static_cast<Value*>(I) : C;
+    }
+
+    // Decrypt GV into a stack buffer around each call in Uses.
+    void decryptOnStack(Module &M, GlobalVariable &GV, GlobalVariable *Enc, uint32_t Seed,
+                        const std::vector<Use*> &Uses) {
+        LLVMContext &Ctx = M.getContext();
+        Type *PtrTy = PointerType::getUnqual(Type::getInt8Ty(Ctx));
+        uint64_t Size = cast<ConstantDataArray>(GV.getInitializer())->getNumElements();
+        Function *Decrypt = getOrCreateStackDecryptFunction(M);
+
+        // One buffer per call, shared by all of its arguments that use GV.
+        MapVector<CallInst*, std::vector<Use*>> byCall;
+        for (Use *U : Uses) {
+            byCall[cast<CallInst>(U->getUser())].push_back(U);
+        }
+
+        for (auto &Entry : byCall) {
+            CallInst *Call = Entry.first;
+            Function *F = Call->getFunction();
+            IRBuilder<> Builder(&*F->getEntryBlock().getFirstInsertionPt());
+            AllocaInst *Buf = Builder.CreateAlloca(GV.getValueType(), nullptr, GV.getName() + ".obf.buf");
+            Buf->setAlignment(GV.getAlign().valueOrOne());
+            // The buffer now lives in the caller's frame.
+            Call->setTailCall(false);
+
+            Builder.SetInsertPoint(Call);
+            Builder.CreateLifetimeStart(Buf, Builder.getInt64(Size));
+            Builder.CreateCall(Decrypt, {Builder.CreatePointerCast(Buf, PtrTy), Builder.CreatePointerCast(Enc, PtrTy),
+                                         Builder.getInt32(Size), Builder.getInt32(Seed)});
+            for (Use *U : Entry.second) {
+                U->set(materialize(cast<Constant>(U->get()), &GV, Buf, Call));
+            }
+
+            // Volatile so the wipe is not dropped as a dead store.
+            Builder.SetInsertPoint(Call->getNextNode());
+            Builder.CreateMemSet(Buf, Builder.getInt8(0), Size, Buf->getAlign(), /*isVolatile=*/true);
+            Builder.CreateLifetimeEnd(Buf, Builder.getInt64(Size));
+            stats.stringStackUses++;
+        }
+    }
+
+    bool encryptString(Module &M, GlobalVariable &GV) {
+        std::vector<Use*> uses;
+        if (!collectUses(&GV, uses) || uses.empty()) {
+            return false;
+        }
+
+        LLVMContext &Ctx = M.getContext();
+        Type *Int8Ty = Type::getInt8Ty(Ctx);
+        Type *PtrTy = PointerType::getUnqual(Int8Ty);
+        StringRef Plain = cast<ConstantDataArray>(GV.getInitializer())->getRawDataValues();
+        uint32_t Seed = (uint32_t)seedFor("obfuscator-strings", GV.getName()) | 1;
+
+        std::vector<uint8_t> cipher;
+        uint32_t State = Seed;
+        for (char C : Plain) {
+            cipher.push_back((uint8_t)C ^ (uint8_t)nextKey(State));
+        }
+
+        auto *Enc = new GlobalVariable(M, GV.getValueType(), /*isConstant=*/true, GlobalValue::PrivateLinkage,
+                                       ConstantDataArray::get(Ctx, cipher), GV.getName() + ".obf.enc");
+        stats.stringSharedBytes += Plain.size();
+
+        std::vector<Use*> stackUses;
+        if (StringDecryptOpt == StringDecryptMode::Stack && Plain.size() <= StringStackMaxOpt) {
+            auto IsStack = [](Use *U) { return isStackUse(*U); };
+            auto Split = std::stable_partition(uses.begin(), uses.end(), IsStack);
+            stackUses.assign(uses.begin(), Split);
+            uses.erase(uses.begin(), Split);
+            decryptOnStack(M, GV, Enc, Seed, stackUses);
+        }
+        if (uses.empty()) {
+            GV.removeDeadConstantUsers();
+            GV.eraseFromParent();
+            stats.stringObfuscations++;
+            return true;
+        }
+
+        auto *Dec = new GlobalVariable(M, GV.getValueType(), /*isConstant=*/false, GlobalValue::PrivateLinkage,
+                                       ConstantAggregateZero::get(GV.getValueType()), GV.getName() + ".obf.dec");
+        Dec->setAlignment(GV.getAlign());
+        stats.stringPrivateBytes += Plain.size();
+        auto *Guard = new GlobalVariable(M, Int8Ty, /*isConstant=*/false, GlobalValue::PrivateLinkage,
+                                         ConstantInt::get(Int8Ty, GuardClear), GV.getName() + ".obf.once");
+
+        Function *Decrypt = getOrCreateDecryptFunction(M);
+        MDNode *Unlikely = MDBuilder(Ctx).createBranchWeights(1, 2000);
+
+        for (Use *U : uses) {
+            auto *I = cast<Instruction>(U->getUser());
+
+            // Check right before the use; for PHIs, at the end of the
+            // incoming block.
+            Instruction *CheckBefore = I;
+            if (auto *Phi = dyn_cast<PHINode>(I)) {
+                CheckBefore = Phi->getIncomingBlock(*U)->getTerminator();
+            }
+
+            IRBuilder<> Builder(CheckBefore);
+            LoadInst *Ready = Builder.CreateAlignedLoad(Int8Ty, Guard, Align(1));
+            Ready->setAtomic(AtomicOrdering::Acquire);
+            Value *NotReady = Builder.CreateICmpNE(Ready, Builder.getInt8(GuardReady));
+            Instruction *SlowTerm = SplitBlockAndInsertIfThen(NotReady, CheckBefore, false, Unlikely);
+            Builder.SetInsertPoint(SlowTerm);
+            Builder.CreateCall(Decrypt, {
+                Builder.CreatePointerCast(Dec, PtrTy), Builder.CreatePointerCast(Enc, PtrTy),
+                Builder.getInt32(Plain.size()), Builder.getInt32(Seed), Builder.CreatePointerCast(Guard, PtrTy)});
+
+            U->set(remap(cast<Constant>(U->get()), &GV, Dec));
+        }
+
+        GV.removeDeadConstantUsers();
+        if (GV.use_empty()) {
+            GV.eraseFromParent();
+        }
+        stats.stringObfuscations++;
+        return true;
+    }
+
+    PreservedAnalyses run(Module &M, ModuleAnalysisManager &) {
+        long bytesBefore = irBytes(M);
+        std::vector<GlobalVariable*> candidates;
+        for (GlobalVariable &GV : M.globals()) {
+            if (isCandidate(GV)) {
+                candidates.push_back(&GV);
+            }
+        }
+
+        int encrypted = 0;
+        for (GlobalVariable *GV : candidates) {
+            TimeTraceScope Span("string-encryption", GV->getName());
+            if (encryptString(M, *GV)) {
+                encrypted++;
+            }
+        }
+
+        errs() << "[StringEncryptionPass] Encrypted " << encrypted << " of " << candidates.size()
+               << " strings (" << stats.stringStackUses << " call sites decrypt on the stack)\n";
+        stats.noteStage("obfuscator-strings", irBytes(M) - bytesBefore);
+        stats.reportPending = true;
+        return encrypted > 0 ? PreservedAnalyses::none() : PreservedAnalyses::all();
+    }
+
+    static bool isRequired() { return true; }
+};
+
+// Selective virtualization, scheduled as -passes='obfuscator-vm'.
+//
+// Functions annotated obf:virtualize (or named in -vm-functions) are compiled
+// to a bytecode for a small accumulator machine, and their body is replaced
+// by an interpreter for exactly that bytecode:
+//
+//   - Direct threading: the bytecode is an array of i64 words where every
+//     opcode word is the address of its handler block (a blockaddress), so
+//     each handler ends with its own load + indirectbr and there is no
+//     central dispatch switch or opcode table.
+//   - The machine is an accumulator machine. The accumulator and pc are
+//     promoted to SSA values across handlers; only the virtual registers
+//     (one per argument and IR value) are an in-frame array.
+//   - Operand words are XOR-encoded with a per-function key, and only the
+//     handlers the function needs are emitted. Call sites get their own
+//     handler with the callee's exact signature.
+//   - Every value is kept zero-extended to 64 bits; signed operations
+//     sign-extend their inputs explicitly.
+//
+// Only integer/pointer code is supported: no floating point, vectors,
+// exceptions, atomics, volatile accesses or dynamic allocas. Functions that
+// do not qualify are reported and left alone. Functions the profile (or a
+// hot attribute) marks as hot are never virtualized.
+class VMCompiler {
+public:
+    enum Opcode {
+        LDA, LDI, STA,
+        ADD, SUB, MUL, UDIV, SDIV, UREM, SREM, AND, OR, XOR, SHL, LSHR, ASHR,
+        ADDI, MULI, ANDI, SEXT,
+        CMP_EQ, CMP_NE, CMP_UGT, CMP_UGE, CMP_ULT, CMP_ULE, CMP_SGT, CMP_SGE, CMP_SLT, CMP_SLE,
+        SEL,
+        LOAD8, LOAD16, LOAD32, LOAD64, STORE8, STORE16, STORE32, STORE64,
+        JMP, JNZ, JEQI,
+        RET, RETV, UNREACHABLE,
+        CALL // one handler per call site: CALL + index
+    };
+
+    struct Result {
+        unsigned Words = 0;
+        unsigned Handlers = 0;
+    };
+
+private:
+    Function &F;
+    const DataLayout &DL;
+    uint64_t Key;
+
+    // Code is assembled as words that are either a handler, a plain operand
+    // or a reference to a label resolved at the end.
+    struct Word {
+        int Handler;
+        int Label;
+        uint64_t Value;
+    };
+    std::vector<Word> Code;
+    std::vector<int> Labels;
+
+    DenseMap<Value*, unsigned> Regs;
+    DenseMap<PHINode*, unsigned> PhiTemps;
+    // In first-use order, so the prologue is the same on every run.
+    MapVector<Constant*, unsigned> ConstRegs;
+    // What a call handler needs; the original call is gone by the time the
+    // handlers are built.
+    struct CallSite {
+        FunctionType *FTy;
+        Constant *DirectCallee; // null for indirect calls
+        unsigned CalleeReg;
+        std::vector<unsigned> ArgRegs;
+        std::vector<Type*> ArgTypes;
+        AttributeList Attrs;
+        CallingConv::ID CC;
+        DebugLoc Loc;
+    };
+    std::vector<CallSite> Calls;
+    DenseMap<BasicBlock*, unsigned> BlockLabels;
+    unsigned NumRegs = 0;
+    unsigned Scratch[3];
+
+    static bool isScalarType(Type *Ty) {
+        if (auto *IT = dyn_cast<IntegerType>(Ty)) {
+            return IT->getBitWidth() <= 64;
+        }
+        return Ty->isPointerTy();
+    }
+
+    static bool isMemoryType(Type *Ty) {
+        if (Ty->isPointerTy()) {
+            return true;
+        }
+        unsigned Bits = Ty->isIntegerTy() ? Ty->getIntegerBitWidth() : 0;
+        return Bits == 1 || Bits == 8 || Bits == 16 || Bits == 32 || Bits == 64;
+    }
+
+    static bool containsVector(Type *Ty) {
+        if (Ty->isVectorTy()) {
+            return true;
+        }
+        for (Type *Sub : Ty->subtypes()) {
+            if (containsVector(Sub)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static unsigned bits(Type *Ty) {
+        return Ty->isPointerTy() ? 64 : Ty->getIntegerBitWidth();
+    }
+
+    static bool isIgnoredIntrinsic(const Instruction &I) {
+        auto *II = dyn_cast<IntrinsicInst>(&I);
+        return II && (isa<DbgInfoIntrinsic>(II) || II->isLifetimeStartOrEnd());
+    }
+
+    unsigned newReg() { return NumRegs++; }
+
+    unsigned newLabel() {
+        Labels.push_back(-1);
+        return Labels.size() - 1;
+    }
+
+    void bind(unsigned L) { Labels[L] = Code.size(); }
+    void op(unsigned H) { Code.push_back({(int)H, -1, 0}); }
+    void imm(uint64_t V) { Code.push_back({-1, -1, V}); }
+    void target(unsigned L) { Code.push_back({-1, (int)L, 0}); }
+
+    void op(unsigned H, uint64_t Operand) {
+        op(H);
+        imm(Operand);
+    }
+
+    unsigned constReg(Constant *C) {
+        auto It = ConstRegs.find(C);
+        if (It != ConstRegs.end()) {
+            return It->second;
+        }
+        unsigned R = newReg();
+        ConstRegs[C] = R;
+        return R;
+    }
+
+    // acc = V
+    void load(Value *V) {
+        if (auto *CI = dyn_cast<ConstantInt>(V)) {
+            op(LDI, CI->getZExtValue());
+        } else if (isa<UndefValue>(V) || isa<ConstantPointerNull>(V)) {
+            op(LDI, 0);
+        } else if (auto *C = dyn_cast<Constant>(V)) {
+            op(LDA, constReg(C));
+        } else {
+            op(LDA, Regs.lookup(V));
+        }
+    }
+
+    // Register holding V; immediates go through scratch register Slot.
+    unsigned inReg(Value *V, unsigned Slot) {
+        if (isa<ConstantInt>(V) || isa<UndefValue>(V) || isa<ConstantPointerNull>(V)) {
+            load(V);
+            op(STA, Scratch[Slot]);
+            return Scratch[Slot];
+        }
+        if (auto *C = dyn_cast<Constant>(V)) {
+            return constReg(C);
+        }
+        return Regs.lookup(V);
+    }
+
+    void zeroExtend(unsigned Bits) {
+        if (Bits < 64) {
+            op(ANDI, Bits == 0 ? 0 : (~0ULL >> (64 - Bits)));
+        }
+    }
+
+    void signExtend(unsigned Bits) {
+        if (Bits < 64) {
+            op(SEXT, 64 - Bits);
+        }
+    }
+
+    void store(Instruction *I) { op(STA, Regs.lookup(I)); }
+
+    void compileBinary(BinaryOperator *BO) {
+        static const DenseMap<unsigned, unsigned> Ops = {
+            {Instruction::Add, ADD}, {Instruction::Sub, SUB}, {Instruction::Mul, MUL},
+            {Instruction::UDiv, UDIV}, {Instruction::SDiv, SDIV}, {Instruction::URem, UREM},
+            {Instruction::SRem, SREM}, {Instruction::And, AND}, {Instruction::Or, OR},
+            {Instruction::Xor, XOR}, {Instruction::Shl, SHL}, {Instruction::LShr, LSHR},
+            {Instruction::AShr, ASHR}};
+        unsigned Opcode = BO->getOpcode();
+        unsigned Bits = bits(BO->getType());
+        bool Signed = Opcode == Instruction::SDiv || Opcode == Instruction::SRem;
+
+        unsigned RHS;
+        if (Signed && Bits < 64) {
+            load(BO->getOperand(1));
+            signExtend(Bits);
+            op(STA, Scratch[0]);
+            RHS = Scratch[0];
+        } else {
+            RHS = inReg(BO->getOperand(1), 0);
+        }
+        load(BO->getOperand(0));
+        if (Signed || Opcode == Instruction::AShr) {
+            signExtend(Bits);
+        }
+        op(Ops.lookup(Opcode), RHS);
+        // and/or/xor/lshr/udiv/urem of zero-extended values stay in range.
+        if (Opcode != Instruction::And && Opcode != Instruction::Or && Opcode != Instruction::Xor &&
+            Opcode != Instruction::LShr && Opcode != Instruction::UDiv && Opcode != Instruction::URem) {
+            zeroExtend(Bits);
+        }
+        store(BO);
+    }
+
+    void compileCompare(ICmpInst *Cmp) {
+        unsigned Bits = bits(Cmp->getOperand(0)->getType());
+        bool Signed = Cmp->isSigned();
+        unsigned RHS;
+        if (Signed && Bits < 64) {
+            load(Cmp->getOperand(1));
+            signExtend(Bits);
+            op(STA, Scratch[0]);
+            RHS = Scratch[0];
+        } else {
+            RHS = inReg(Cmp->getOperand(1), 0);
+        }
+        load(Cmp->getOperand(0));
+        if (Signed) {
+            signExtend(Bits);
+        }
+        op(CMP_EQ + (Cmp->getPredicate() - CmpInst::ICMP_EQ), RHS);
+        store(Cmp);
+    }
+
+    void compileGEP(GetElementPtrInst *GEP) {
+        load(GEP->getPointerOperand());
+        for (auto GTI = gep_type_begin(GEP), E = gep_type_end(GEP); GTI != E; ++GTI) {
+            Value *Idx = GTI.getOperand();
+            if (StructType *STy = GTI.getStructTypeOrNull()) {
+                unsigned Field = cast<ConstantInt>(Idx)->getZExtValue();
+                uint64_t Offset = DL.getStructLayout(STy)->getElementOffset(Field);
+                if (Offset) {
+                    op(ADDI, Offset);
+                }
+                continue;
+            }
+            uint64_t Size = DL.getTypeAllocSize(GTI.getIndexedType());
+            if (auto *CI = dyn_cast<ConstantInt>(Idx)) {
+                if (!CI->isZero()) {
+                    op(ADDI, (uint64_t)CI->getSExtValue() * Size);
+                }
+                continue;
+            }
+            // acc = base + sext(idx) * size
+            op(STA, Scratch[1]);
+            load(Idx);
+            signExtend(bits(Idx->getType()));
+            if (Size != 1) {
+                op(MULI, Size);
+            }
+            op(ADD, Scratch[1]);
+        }
+        store(GEP);
+    }
+
+    void compileCall(CallBase *Call) {
+        CallSite Site;
+        Site.FTy = Call->getFunctionType();
+        Site.DirectCallee = nullptr;
+        Site.CalleeReg = 0;
+        Site.Attrs = Call->getAttributes();
+        Site.CC = Call->getCallingConv();
+        Site.Loc = Call->getDebugLoc();
+        for (Value *Arg : Call->args()) {
+            unsigned R = newReg();
+            load(Arg);
+            op(STA, R);
+            Site.ArgRegs.push_back(R);
+            Site.ArgTypes.push_back(Arg->getType());
+        }
+        Value *Callee = Call->getCalledOperand();
+        if (isa<Function>(Callee->stripPointerCasts())) {
+            Site.DirectCallee = cast<Constant>(Callee);
+        } else {
+            Site.CalleeReg = inReg(Callee, 2);
+        }
+        op(CALL + Calls.size());
+        Calls.push_back(Site);
+        if (!Call->getType()->isVoidTy()) {
+            store(Call);
+        }
+    }
+
+    // Copy the PHI inputs for the edge From -> To, in two steps so PHIs that
+    // read each other see the old values.
+    void compileEdge(BasicBlock *From, BasicBlock *To) {
+        std::vector<PHINode*> Phis;
+        for (PHINode &Phi : To->phis()) {
+            Phis.push_back(&Phi);
+        }
+        for (PHINode *Phi : Phis) {
+            load(Phi->getIncomingValueForBlock(From));
+            op(STA, PhiTemps.lookup(Phi));
+        }
+        for (PHINode *Phi : Phis) {
+            op(LDA, PhiTemps.lookup(Phi));
+            op(STA, Regs.lookup(Phi));
+        }
+    }
+
+    void jumpEdge(BasicBlock *From, BasicBlock *To) {
+        compileEdge(From, To);
+        op(JMP);
+        target(BlockLabels.lookup(To));
+    }
+
+    void compileTerminator(Instruction *Term) {
+        BasicBlock *BB = Term->getParent();
+        if (auto *Ret = dyn_cast<ReturnInst>(Term)) {
+            if (Value *V = Ret->getReturnValue()) {
+                load(V);
+                op(RET);
+            } else {
+                op(RETV);
+            }
+        } else if (auto *Br = dyn_cast<BranchInst>(Term)) {
+            if (Br->isUnconditional()) {
+                jumpEdge(BB, Br->getSuccessor(0));
+                return;
+            }
+            unsigned TrueEdge = newLabel();
+            load(Br->getCondition());
+            op(JNZ);
+            target(TrueEdge);
+            jumpEdge(BB, Br->getSuccessor(1));
+            bind(TrueEdge);
+            jumpEdge(BB, Br->getSuccessor(0));
+        } else if (auto *Switch = dyn_cast<SwitchInst>(Term)) {
+            std::vector<std::pair<unsigned, BasicBlock*>> Cases;
+            load(Switch->getCondition());
+            for (auto &Case : Switch->cases()) {
+                unsigned L = newLabel();
+                op(JEQI, Case.getCaseValue()->getZExtValue());
+                target(L);
+                Cases.push_back({L, Case.getCaseSuccessor()});
+            }
+            jumpEdge(BB, Switch->getDefaultDest());
+            for (auto &Case : Cases) {
+                bind(Case.first);
+                jumpEdge(BB, Case.second);
+            }
+        } else {
+            op(UNREACHABLE);
+        }
+    }
+
+    void compileInstruction(Instruction &I) {
+        if (isa<PHINode>(I) || isa<AllocaInst>(I) || isIgnoredIntrinsic(I)) {
+            return;
+        }
+        if (I.isTerminator()) {
+            compileTerminator(&I);
+        } else if (auto *BO = dyn_cast<BinaryOperator>(&I)) {
+            compileBinary(BO);
+        } else if (auto *Cmp = dyn_cast<ICmpInst>(&I)) {
+            compileCompare(Cmp);
+        } else if (auto *Sel = dyn_cast<SelectInst>(&I)) {
+            unsigned T = inReg(Sel->getTrueValue(), 1);
+            unsigned Fl = inReg(Sel->getFalseValue(), 2);
+            load(Sel->getCondition());
+            op(SEL, T);
+            imm(Fl);
+            store(Sel);
+        } else if (auto *GEP = dyn_cast<GetElementPtrInst>(&I)) {
+            compileGEP(GEP);
+        } else if (auto *Load = dyn_cast<LoadInst>(&I)) {
+            load(Load->getPointerOperand());
+            unsigned Bytes = DL.getTypeStoreSize(Load->getType());
+            op(Bytes == 1 ? LOAD8 : Bytes == 2 ? LOAD16 : Bytes == 4 ? LOAD32 : LOAD64);
+            store(Load);
+        } else if (auto *Store = dyn_cast<StoreInst>(&I)) {
+            unsigned R = inReg(Store->getValueOperand(), 0);
+            load(Store->getPointerOperand());
+            unsigned Bytes = DL.getTypeStoreSize(Store->getValueOperand()->getType());
+            op(Bytes == 1 ? STORE8 : Bytes == 2 ? STORE16 : Bytes == 4 ? STORE32 : STORE64, R);
+        } else if (auto *Call = dyn_cast<CallBase>(&I)) {
+            compileCall(Call);
+        } else if (auto *Cast = dyn_cast<CastInst>(&I)) {
+            load(Cast->getOperand(0));
+            if (Cast->getOpcode() == Instruction::SExt) {
+                signExtend(bits(Cast->getSrcTy()));
+            }
+            zeroExtend(bits(Cast->getDestTy()));
+            store(Cast);
+        } else if (auto *Freeze = dyn_cast<FreezeInst>(&I)) {
+            load(Freeze->getOperand(0));
+            store(Freeze);
+        }
+    }
+
+public:
+    VMCompiler(Function &F, uint64_t Key) : F(F), DL(F.getParent()->getDataLayout()), Key(Key) {}
+
+    // Returns an empty string if F can be virtualized, else why not.
+    static std::string unsupportedReason(Function &F) {
+        const DataLayout &DL = F.getParent()->getDataLayout();
+        if (F.isDeclaration() || F.isVarArg() || F.hasPersonalityFn()) {
+            return "declaration, varargs or exception handling";
+        }
+        if (DL.getPointerSizeInBits() != 64) {
+            return "needs 64-bit pointers";
+        }
+        if (!F.getReturnType()->isVoidTy() && !isScalarType(F.getReturnType())) {
+            return "unsupported return type";
+        }
+        for (Argument &Arg : F.args()) {
+            if (!isScalarType(Arg.getType())) {
+                return "unsupported argument type";
+            }
+        }
+        for (BasicBlock &BB : F) {
+            for (Instruction &I : BB) {
+                if (isIgnoredIntrinsic(I)) {
                     continue;
                 }
-                errs() << "    Adding fake loop after block " << i << "\n";
-                obf.addFakeLoop(F, blocks[i]);
-                loopsAdded++;
-                modified = true;
+                if (!I.getType()->isVoidTy() && !isScalarType(I.getType())) {
+                    return std::string("non-integer value in ") + I.getOpcodeName();
+                }
+                for (Value *Op : I.operands()) {
+                    if (!isa<BasicBlock>(Op) && !isa<Function>(Op) && !isScalarType(Op->getType())) {
+                        return std::string("non-integer operand in ") + I.getOpcodeName();
+                    }
+                }
+                if (auto *AI = dyn_cast<AllocaInst>(&I)) {
+                    if (&BB != &F.getEntryBlock() || !AI->isStaticAlloca()) {
+                        return "dynamic alloca";
+                    }
+                } else if (auto *LI = dyn_cast<LoadInst>(&I)) {
+                    if (!LI->isSimple() || !isMemoryType(LI->getType())) {
+                        return "volatile, atomic or odd-sized load";
+                    }
+                } else if (auto *SI = dyn_cast<StoreInst>(&I)) {
+                    if (!SI->isSimple() || !isMemoryType(SI->getValueOperand()->getType())) {
+                        return "volatile, atomic or odd-sized store";
+                    }
+                } else if (auto *GEP = dyn_cast<GetElementPtrInst>(&I)) {
+                    if (containsVector(GEP->getSourceElementType())) {
+                        return "vector GEP";
+                    }
+                } else if (auto *Call = dyn_cast<CallBase>(&I)) {
+                    if (!isa<CallInst>(Call) || Call->isInlineAsm() || isa<IntrinsicInst>(Call) ||
+                        cast<CallInst>(Call)->isMustTailCall() || Call->hasOperandBundles()) {
+                        return "invoke, inline asm, intrinsic or musttail call";
+                    }
+                    for (unsigned i = 0; i < Call->arg_size(); ++i) {
+                        if (Call->isByValArgument(i) || Call->paramHasAttr(i, Attribute::InAlloca) ||
+                            Call->paramHasAttr(i, Attribute::StructRet) ||
+                            Call->paramHasAttr(i, Attribute::Preallocated)) {
+                            return "byval, inalloca, sret or preallocated argument";
+                        }
+                    }
+                } else if (!isa<BinaryOperator>(I) && !isa<ICmpInst>(I) && !isa<SelectInst>(I) &&
+                           !isa<PHINode>(I) && !isa<FreezeInst>(I) && !isa<ReturnInst>(I) &&
+                           !isa<BranchInst>(I) && !isa<SwitchInst>(I) && !isa<UnreachableInst>(I) &&
+                           !isa<ZExtInst>(I) && !isa<SExtInst>(I) && !isa<TruncInst>(I) &&
+                           !isa<PtrToIntInst>(I) && !isa<IntToPtrInst>(I) && !isa<BitCastInst>(I)) {
+                    return std::string("unsupported instruction ") + I.getOpcodeName();
+                }
             }
-            errs() << "    Added " << (stats.fakeLoopsAdded - loopsBefore) << " fake loops\n";
         }
-        
-        if (InstrSub) {
-            errs() << "  [Instruction Substitution] Enabled\n";
-            obf.substituteInstructions(F);
-            if (stats.instructionSubstitutions > subsBefore) {
-                modified = true;
+        return "";
+    }
+
+    // Compile F to bytecode and replace its body with the interpreter.
+    Result run() {
+        for (Argument &Arg : F.args()) {
+            Regs[&Arg] = newReg();
+        }
+        for (BasicBlock &BB : F) {
+            BlockLabels[&BB] = newLabel();
+            for (Instruction &I : BB) {
+                if (!I.getType()->isVoidTy()) {
+                    Regs[&I] = newReg();
+                }
+                if (auto *Phi = dyn_cast<PHINode>(&I)) {
+                    PhiTemps[Phi] = newReg();
+                }
             }
-            errs() << "    Substituted " << (stats.instructionSubstitutions - subsBefore) << " instructions\n";
         }
-        
-        
-        errs() << "========================================\n";
-        
-        stats.writeReport(ReportFileArg.getValue());
+        for (unsigned &S : Scratch) {
+            S = newReg();
+        }
 
-        return modified ? PreservedAnalyses::none() : PreservedAnalyses::all();
+        // The entry block comes first, so execution starts at word 0.
+        for (BasicBlock &BB : F) {
+            bind(BlockLabels.lookup(&BB));
+            for (Instruction &I : BB) {
+                compileInstruction(I);
+            }
+        }
+
+        return buildInterpreter();
     }
-    
+
+private:
+    Result buildInterpreter() {
+        LLVMContext &Ctx = F.getContext();
+        Module &M = *F.getParent();
+        Type *Int64Ty = Type::getInt64Ty(Ctx);
+
+        // Keep the static allocas, drop the old body.
+        BasicBlock *Entry = BasicBlock::Create(Ctx, "vm.entry", &F, &F.getEntryBlock());
+        std::vector<AllocaInst*> Allocas;
+        for (Instruction &I : *Entry->getNextNode()) {
+            if (auto *AI = dyn_cast<AllocaInst>(&I)) {
+                Allocas.push_back(AI);
+            }
+        }
+        for (AllocaInst *AI : Allocas) {
+            AI->moveBefore(*Entry, Entry->end());
+        }
+        std::vector<BasicBlock*> OldBlocks;
+        for (BasicBlock &BB : F) {
+            if (&BB != Entry) {
+                OldBlocks.push_back(&BB);
+            }
+        }
+        // Values that still have uses (allocas) are mapped to registers
+        // before the old instructions disappear.
+        MapVector<Value*, unsigned> AllocaRegs;
+        for (AllocaInst *AI : Allocas) {
+            AllocaRegs[AI] = Regs.lookup(AI);
+        }
+        for (BasicBlock *BB : OldBlocks) {
+            BB->dropAllReferences();
+        }
+        for (BasicBlock *BB : OldBlocks) {
+            BB->eraseFromParent();
+        }
+
+        // Used handlers, in first-use order.
+        std::vector<unsigned> Used;
+        DenseMap<unsigned, BasicBlock*> Handlers;
+        for (const Word &W : Code) {
+            if (W.Handler >= 0 && !Handlers.count(W.Handler)) {
+                Handlers[W.Handler] = BasicBlock::Create(Ctx, "vm.op", &F);
+                Used.push_back(W.Handler);
+            }
+        }
+
+        // Assemble the code array.
+        std::vector<Constant*> Words;
+        for (const Word &W : Code) {
+            if (W.Handler >= 0) {
+                Words.push_back(ConstantExpr::getPtrToInt(BlockAddress::get(&F, Handlers.lookup(W.Handler)), Int64Ty));
+            } else {
+                uint64_t V = W.Label >= 0 ? (uint64_t)Labels[W.Label] : W.Value;
+                Words.push_back(ConstantInt::get(Int64Ty, V ^ Key));
+            }
+        }
+        ArrayType *CodeTy = ArrayType::get(Int64Ty, Words.size());
+        auto *CodeGV = new GlobalVariable(M, CodeTy, /*isConstant=*/true, GlobalValue::PrivateLinkage,
+                                          ConstantArray::get(CodeTy, Words), F.getName() + ".obf.vmcode");
+
+        // Prologue: register file, arguments, allocas and non-integer
+        // constants, then the first dispatch.
+        IRBuilder<> B(Entry);
+        ArrayType *RegsTy = ArrayType::get(Int64Ty, NumRegs);
+        AllocaInst *RegFile = B.CreateAlloca(RegsTy, nullptr, "vm.regs");
+        AllocaInst *PCAddr = B.CreateAlloca(Int64Ty, nullptr, "vm.pc");
+        AllocaInst *AccAddr = B.CreateAlloca(Int64Ty, nullptr, "vm.acc");
+        auto RegPtr = [&](IRBuilder<> &IRB, Value *Index) {
+            return IRB.CreateInBoundsGEP(RegsTy, RegFile, {IRB.getInt64(0), Index});
+        };
+        auto ToWord = [&](IRBuilder<> &IRB, Value *V) -> Value* {
+            return V->getType()->isPointerTy() ? IRB.CreatePtrToInt(V, Int64Ty) : IRB.CreateZExt(V, Int64Ty);
+        };
+        auto FromWord = [&](IRBuilder<> &IRB, Value *V, Type *Ty) -> Value* {
+            return Ty->isPointerTy() ? IRB.CreateIntToPtr(V, Ty) : IRB.CreateTrunc(V, Ty);
+        };
+        for (Argument &Arg : F.args()) {
+            B.CreateStore(ToWord(B, &Arg), RegPtr(B, B.getInt64(Regs.lookup(&Arg))));
+        }
+        for (auto &KV : AllocaRegs) {
+            B.CreateStore(ToWord(B, KV.first), RegPtr(B, B.getInt64(KV.second)));
+        }
+        for (auto &KV : ConstRegs) {
+            B.CreateStore(ToWord(B, KV.first), RegPtr(B, B.getInt64(KV.second)));
+        }
+        B.CreateStore(B.getInt64(0), PCAddr);
+        B.CreateStore(B.getInt64(0), AccAddr);
+
+        GlobalVariable *Counter = nullptr;
+        if (VMCountOpsOpt) {
+            Counter = M.getNamedGlobal("__obf_vm_ops");
+            if (!Counter) {
+                Counter = new GlobalVariable(M, Int64Ty, /*isConstant=*/false, GlobalValue::WeakAnyLinkage,
+                                             ConstantInt::get(Int64Ty, 0), "__obf_vm_ops");
+            } else if (Counter->isDeclaration()) {
+                Counter->setInitializer(ConstantInt::get(Int64Ty, 0));
+                Counter->setLinkage(GlobalValue::WeakAnyLinkage);
+            }
+        }
+
+        std::vector<IndirectBrInst*> Dispatches;
+        auto Dispatch = [&](IRBuilder<> &IRB, Value *PC) {
+            Value *Slot = IRB.CreateInBoundsGEP(CodeTy, CodeGV, {IRB.getInt64(0), PC});
+            Value *Next = IRB.CreateLoad(Int64Ty, Slot, "vm.next");
+            if (Counter) {
+                Value *Count = IRB.CreateLoad(Int64Ty, Counter);
+                IRB.CreateStore(IRB.CreateAdd(Count, IRB.getInt64(1)), Counter);
+            }
+            Dispatches.push_back(IRB.CreateIndirectBr(IRB.CreateIntToPtr(Next, PointerType::getUnqual(IRB.getInt8Ty())), Used.size()));
+        };
+        Dispatch(B, B.getInt64(0));
+
+        for (unsigned H : Used) {
+            IRBuilder<> IRB(Handlers.lookup(H));
+            Value *PC = IRB.CreateLoad(Int64Ty, PCAddr, "vm.pc");
+            Value *Acc = IRB.CreateLoad(Int64Ty, AccAddr, "vm.acc");
+            auto Operand = [&](unsigned K) -> Value* {
+                Value *Slot = IRB.CreateInBoundsGEP(CodeTy, CodeGV, {IRB.getInt64(0), IRB.CreateAdd(PC, IRB.getInt64(1 + K))});
+                return IRB.CreateXor(IRB.CreateLoad(Int64Ty, Slot), IRB.getInt64(Key));
+            };
+            auto Reg = [&](Value *Index) { return IRB.CreateLoad(Int64Ty, RegPtr(IRB, Index)); };
+            auto Advance = [&](unsigned Words) { return IRB.CreateAdd(PC, IRB.getInt64(Words)); };
+
+            Value *NewAcc = Acc;
+            Value *NewPC = nullptr;
+            static const Instruction::BinaryOps BinOps[] = {
+                Instruction::Add, Instruction::Sub, Instruction::Mul, Instruction::UDiv, Instruction::SDiv,
+                Instruction::URem, Instruction::SRem, Instruction::And, Instruction::Or, Instruction::Xor,
+                Instruction::Shl, Instruction::LShr, Instruction::AShr};
+            if (H >= CALL) {
+                const CallSite &Site = Calls[H - CALL];
+                std::vector<Value*> Args;
+                for (unsigned i = 0; i < Site.ArgRegs.size(); ++i) {
+                    Args.push_back(FromWord(IRB, Reg(IRB.getInt64(Site.ArgRegs[i])), Site.ArgTypes[i]));
+                }
+                FunctionType *FTy = Site.FTy;
+                Value *Callee = Site.DirectCallee;
+                if (!Callee) {
+                    Callee = IRB.CreateIntToPtr(Reg(IRB.getInt64(Site.CalleeReg)), PointerType::getUnqual(FTy));
+                }
+                CallInst *NewCall = IRB.CreateCall(FTy, Callee, Args);
+                NewCall->setCallingConv(Site.CC);
+                NewCall->setAttributes(Site.Attrs);
+                NewCall->setDebugLoc(Site.Loc);
+                if (!FTy->getReturnType()->isVoidTy()) {
+                    NewAcc = ToWord(IRB, NewCall);
+                }
+                NewPC = Advance(1);
+            } else if (H >= ADD && H <= ASHR) {
+                NewAcc = IRB.CreateBinOp(BinOps[H - ADD], Acc, Reg(Operand(0)));
+                NewPC = Advance(2);
+            } else if (H >= CMP_EQ && H <= CMP_SLE) {
+                auto Pred = (CmpInst::Predicate)(CmpInst::ICMP_EQ + (H - CMP_EQ));
+                NewAcc = IRB.CreateZExt(IRB.CreateICmp(Pred, Acc, Reg(Operand(0))), Int64Ty);
+                NewPC = Advance(2);
+            } else if (H >= LOAD8 && H <= LOAD64) {
+                Type *Ty = IRB.getIntNTy(8 << (H - LOAD8));
+                Value *Ptr = IRB.CreateIntToPtr(Acc, PointerType::getUnqual(Ty));
+                NewAcc = IRB.CreateZExt(IRB.CreateAlignedLoad(Ty, Ptr, Align(1)), Int64Ty);
+                NewPC = Advance(1);
+            } else if (H >= STORE8 && H <= STORE64) {
+                Type *Ty = IRB.getIntNTy(8 << (H - STORE8));
+                Value *Ptr = IRB.CreateIntToPtr(Acc, PointerType::getUnqual(Ty));
+                IRB.CreateAlignedStore(IRB.CreateTrunc(Reg(Operand(0)), Ty), Ptr, Align(1));
+                NewPC = Advance(2);
+            } else {
+                switch (H) {
+                case LDA: NewAcc = Reg(Operand(0)); NewPC = Advance(2); break;
+                case LDI: NewAcc = Operand(0); NewPC = Advance(2); break;
+                case STA:
+                    IRB.CreateStore(Acc, RegPtr(IRB, Operand(0)));
+                    NewPC = Advance(2);
+                    break;
+                case ADDI: NewAcc = IRB.CreateAdd(Acc, Operand(0)); NewPC = Advance(2); break;
+                case MULI: NewAcc = IRB.CreateMul(Acc, Operand(0)); NewPC = Advance(2); break;
+                case ANDI: NewAcc = IRB.CreateAnd(Acc, Operand(0)); NewPC = Advance(2); break;
+                case SEXT: {
+                    Value *Shift = Operand(0);
+                    NewAcc = IRB.CreateAShr(IRB.CreateShl(Acc, Shift), Shift);
+                    NewPC = Advance(2);
+                    break;
+                }
+                case SEL:
+                    NewAcc = IRB.CreateSelect(IRB.CreateICmpNE(Acc, IRB.getInt64(0)), Reg(Operand(0)), Reg(Operand(1)));
+                    NewPC = Advance(3);
+                    break;
+                case JMP: NewPC = Operand(0); break;
+                case JNZ:
+                    NewPC = IRB.CreateSelect(IRB.CreateICmpNE(Acc, IRB.getInt64(0)), Operand(0), Advance(2));
+                    break;
+                case JEQI:
+                    NewPC = IRB.CreateSelect(IRB.CreateICmpEQ(Acc, Operand(0)), Operand(1), Advance(3));
+                    break;
+                case RET:
+                    IRB.CreateRet(FromWord(IRB, Acc, F.getReturnType()));
+                    break;
+                case RETV:
+                    IRB.CreateRetVoid();
+                    break;
+                default:
+                    IRB.CreateUnreachable();
+                    break;
+                }
+            }
+            if (NewPC) {
+                IRB.CreateStore(NewAcc, AccAddr);
+                IRB.CreateStore(NewPC, PCAddr);
+                Dispatch(IRB, NewPC);
+            }
+        }
+
+        for (IndirectBrInst *IBr : Dispatches) {
+            for (unsigned H : Used) {
+                IBr->addDestination(Handlers.lookup(H));
+            }
+        }
+
+        // pc and acc become SSA values carried between handlers.
+        DominatorTree DT(F);
+        PromoteMemToReg({PCAddr, AccAddr}, DT);
+
+        Result R;
+        R.Words = Code.size();
+        R.Handlers = Used.size();
+        return R;
+    }
+};
+
+struct VirtualizePass : public PassInfoMixin<VirtualizePass> {
+    FunctionAnnotations Annotations;
+
+    PreservedAnalyses run(Module &M, ModuleAnalysisManager &MAM) {
+        ProfileSummaryInfo &PSI = MAM.getResult<ProfileSummaryAnalysis>(M);
+        FunctionAnalysisManager &FAM = MAM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+
+        bool changed = false;
+        for (Function &F : M) {
+            if (F.isDeclaration() || !isSelectedForVM(Annotations, F)) {
+                continue;
+            }
+            bool Hot = F.hasFnAttribute(Attribute::Hot);
+            if (!Hot && PSI.hasProfileSummary()) {
+                Hot = PSI.isFunctionEntryHot(&F) ||
+                      PSI.isFunctionHotInCallGraph(&F, FAM.getResult<BlockFrequencyAnalysis>(F));
+            }
+            std::string Reason = Hot ? "hot in the profile" : VMCompiler::unsupportedReason(F);
+            if (!Reason.empty()) {
+                errs() << "[VirtualizePass] Not virtualizing " << F.getName() << ": " << Reason << "\n";
+                FAM.getResult<OptimizationRemarkEmitterAnalysis>(F).emit([&] {
+                    return OptimizationRemarkMissed(RemarkPass, "NotVirtualized", DiagnosticLocation(F.getSubprogram()),
+                                                    &F.getEntryBlock())
+                           << "not virtualized: " << ore::NV("Reason", Reason);
+                });
+                F.addFnAttr(VMRejectedAttr);
+                stats.vmRejected++;
+                continue;
+            }
+
+            FAM.clear(F, F.getName());
+            FunctionScope scope(F, "obfuscator-vm");
+            scope.transform("virtualize");
+            TimeTraceScope Span("virtualize", F.getName());
+            VMCompiler::Result R = VMCompiler(F, seedFor("obfuscator-vm", F.getName())).run();
+            F.addFnAttr("obf.virtualized");
+            errs() << "[VirtualizePass] Virtualized " << F.getName() << ": " << R.Words << " bytecode words, "
+                   << R.Handlers << " handlers\n";
+            FAM.getResult<OptimizationRemarkEmitterAnalysis>(F).emit([&] {
+                return OptimizationRemark(RemarkPass, "Virtualized", DiagnosticLocation(F.getSubprogram()),
+                                          &F.getEntryBlock())
+                       << "compiled to " << ore::NV("Words", R.Words) << " bytecode words for "
+                       << ore::NV("Handlers", R.Handlers) << " interpreter handlers";
+            });
+            stats.functionsVirtualized++;
+            stats.vmBytecodeWords += R.Words;
+            stats.vmHandlers += R.Handlers;
+            changed = true;
+        }
+
+        // Per-function growth was added by the scopes above; this samples
+        // the RSS even when nothing was virtualized.
+        stats.noteStage("obfuscator-vm", 0);
+        stats.reportPending = true;
+        return changed ? PreservedAnalyses::none() : PreservedAnalyses::all();
+    }
+
     static bool isRequired() { return true; }
 };
 
 } // namespace
 
+static ObfuscatorPass createObfuscatorPass() {
+    return ObfuscatorPass(BogusBlocksOpt, FakeLoopsOpt, InstrSubOpt);
+}
+
+// Extension-point callbacks are invoked while a default pipeline is being
+// built, after option parsing, so each one checks -obf-ep itself.
+static void registerExtensionPoints(PassBuilder &PB) {
+    PB.registerPipelineStartEPCallback(
+        [](ModulePassManager &MPM, OptimizationLevel) {
+            if (ExtensionPointOpt == ExtensionPoint::PipelineStart) {
+                MPM.addPass(createModuleToFunctionPassAdaptor(createObfuscatorPass()));
+            }
+        });
+    PB.registerScalarOptimizerLateEPCallback(
+        [](FunctionPassManager &FPM, OptimizationLevel) {
+            if (ExtensionPointOpt == ExtensionPoint::ScalarOptimizerLate) {
+                FPM.addPass(createObfuscatorPass());
+            }
+        });
+    PB.registerVectorizerStartEPCallback(
+        [](FunctionPassManager &FPM, OptimizationLevel) {
+            if (ExtensionPointOpt == ExtensionPoint::VectorizerStart) {
+                FPM.addPass(createObfuscatorPass());
+            }
+        });
+
+    // Late substitution is scheduled at the very end whatever the main pass's
+    // extension point, so it follows the vectorizers and the InstCombine runs
+    // that would otherwise fold it back.
+    auto OptimizerLast = [](ModulePassManager &MPM) {
+        if (ExtensionPointOpt == ExtensionPoint::None) {
+            return;
+        }
+        // Virtualize after -O2 so the bytecode is compiled from optimized IR.
+        MPM.addPass(VirtualizePass());
+        if (StringEncryptionOpt) {
+            MPM.addPass(StringEncryptionPass());
+        }
+        FunctionPassManager FPM;
+        ObfuscatorPass Obfuscator = createObfuscatorPass();
+        if (ExtensionPointOpt != ExtensionPoint::OptimizerLast) {
+            // The earlier run left the functions selected for the VM alone;
+            // obfuscate those it just rejected.
+            Obfuscator.VMRejectedOnly = true;
+        }
+        FPM.addPass(std::move(Obfuscator));
+        if (InstrSubOpt && InstrSubLateOpt) {
+            FPM.addPass(ObfuscatorSubPass());
+        }
+        if (EPCleanupOpt) {
+            FPM.addPass(ObfuscatorCleanupPass());
+        }
+        if (!FPM.isEmpty()) {
+            MPM.addPass(createModuleToFunctionPassAdaptor(std::move(FPM)));
+        }
+    };
+#if LLVM_VERSION_MAJOR >= 20
+    PB.registerOptimizerLastEPCallback(
+        [OptimizerLast](ModulePassManager &MPM, OptimizationLevel, ThinOrFullLTOPhase) {
+            OptimizerLast(MPM);
+        });
+#else
+    PB.registerOptimizerLastEPCallback(
+        [OptimizerLast](ModulePassManager &MPM, OptimizationLevel) {
+            OptimizerLast(MPM);
+        });
+#endif
+}
+
 llvm::PassPluginLibraryInfo getObfuscatorPassPluginInfo() {
     return {
         LLVM_PLUGIN_API_VERSION, "ObfuscatorPass", LLVM_VERSION_STRING,
         [](PassBuilder &PB) {
-					PB.registerPipelineParsingCallback(
-    [](StringRef Name, FunctionPassManager &FPM,
-       ArrayRef<PassBuilder::PipelineElement>) {
-        if (Name == "obfuscator-pass") {
-            FPM.addPass(ObfuscatorPass(BogusBlocksOpt, FakeLoopsOpt, InstrSubOpt));
-            return true;
-        }
-        return false;
-    });
+            PB.registerPipelineParsingCallback(
+                [](StringRef Name, FunctionPassManager &FPM,
+                   ArrayRef<PassBuilder::PipelineElement>) {
+                    if (Name == "obfuscator-pass") {
+                        FPM.addPass(createObfuscatorPass());
+                        return true;
+                    }
+                    if (Name == "obfuscator-sub") {
+                        FPM.addPass(ObfuscatorSubPass());
+                        return true;
+                    }
+                    if (Name == "obfuscator-cleanup") {
+                        FPM.addPass(ObfuscatorCleanupPass());
+                        return true;
+                    }
+                    return false;
+                });
+            // Module-level names, so function and module passes can be mixed
+            // in one -passes list without wrapping them in function(...).
+            PB.registerPipelineParsingCallback(
+                [](StringRef Name, ModulePassManager &MPM,
+                   ArrayRef<PassBuilder::PipelineElement>) {
+                    if (Name == "obfuscator-strings") {
+                        MPM.addPass(StringEncryptionPass());
+                        return true;
+                    }
+                    if (Name == "obfuscator-vm") {
+                        MPM.addPass(VirtualizePass());
+                        return true;
+                    }
+                    if (Name == "obfuscator-pass") {
+                        MPM.addPass(createModuleToFunctionPassAdaptor(createObfuscatorPass()));
+                        return true;
+                    }
+                    if (Name == "obfuscator-sub") {
+                        MPM.addPass(createModuleToFunctionPassAdaptor(ObfuscatorSubPass()));
+                        return true;
+                    }
+                    if (Name == "obfuscator-cleanup") {
+                        MPM.addPass(createModuleToFunctionPassAdaptor(ObfuscatorCleanupPass()));
+                        return true;
+                    }
+                    return false;
+                });
+            registerExtensionPoints(PB);
         }
     };
 }
@@ -0,0 +1,79 @@
+// Runtime for programs built with -obf-instrument (CLI: --instrument).
+//
+// Every instrumented function owns a table of Shards x Slots counters and
+// registers it from a module constructor. A thread picks its shard once, on
+// its first instrumented call, so threads mostly write their own cache line.
+// At exit the shards are summed and one line per function is written to
+// $OBF_COUNTERS_FILE, or obf_counters.<pid>.txt in the working directory.
+// obf-counters merges these files with the JSON report.
+//
+// Link this file into the program; it must not itself be obfuscated.
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+namespace {
+
+// Keep in sync with CounterShards, CounterSlots and CounterKind in Obfuscator.cpp.
+const unsigned Shards = 16;
+const unsigned Slots = 8;
+const unsigned Kinds = 6;
+
+struct CounterSet {
+    const char *name;
+    const uint64_t *counters;
+};
+
+// Registration runs from other modules' constructors, possibly before this
+// file's, so nothing here needs dynamic initialization.
+std::mutex Lock;
+std::vector<CounterSet> *Sets = nullptr;
+std::atomic<uint32_t> NextShard{0};
+thread_local uint32_t ThreadShard = 0;
+
+void flush() {
+    std::lock_guard<std::mutex> Guard(Lock);
+    const char *Path = std::getenv("OBF_COUNTERS_FILE");
+    std::string DefaultPath = "obf_counters." + std::to_string(getpid()) + ".txt";
+    FILE *Out = std::fopen(Path ? Path : DefaultPath.c_str(), "w");
+    if (!Out) {
+        std::perror("obf_counters");
+        return;
+    }
+    std::fprintf(Out, "# obf-counters 1: function calls predicates inserted_taken dispatches routed substituted\n");
+    for (const CounterSet &Set : *Sets) {
+        std::fprintf(Out, "%s", Set.name);
+        for (unsigned Kind = 0; Kind < Kinds; Kind++) {
+            uint64_t Sum = 0;
+            for (unsigned Shard = 0; Shard < Shards; Shard++) {
+                Sum += __atomic_load_n(&Set.counters[Shard * Slots + Kind], __ATOMIC_RELAXED);
+            }
+            std::fprintf(Out, " %llu", (unsigned long long)Sum);
+        }
+        std::fprintf(Out, "\n");
+    }
+    std::fclose(Out);
+}
+
+} // namespace
+
+extern "C" uint32_t __obf_ctr_shard() {
+    if (!ThreadShard) {
+        ThreadShard = NextShard.fetch_add(1, std::memory_order_relaxed) % Shards + 1;
+    }
+    return ThreadShard - 1;
+}
+
+extern "C" void __obf_ctr_register(const char *name, const uint64_t *counters) {
+    std::lock_guard<std::mutex> Guard(Lock);
+    if (!Sets) {
+        Sets = new std::vector<CounterSet>();
+        std::atexit(flush);
+    }
+    Sets->push_back({name, counters});
+}
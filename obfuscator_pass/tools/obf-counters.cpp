@@ -0,0 +1,169 @@
+// obf-counters: merge the counter files of an -obf-instrument build with the
+// pass's JSON report and show the dynamic overhead per function.
+//
+//   obf-counters report.json obf_counters.*.txt
+//
+// Counter files from several processes (or runs) are summed per function.
+// Added cycles are predicate evaluations times the predicate tier's cost,
+// plus routed calls and branches times the report's -indirect-call-cycles,
+// plus one cycle per extra instruction executed because of substitution.
+// Flattening dispatches are counted but not priced; their cost depends on
+// branch prediction (see benchmarks/run_flatten_bench.sh).
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+#include <algorithm>
+#include <cstdio>
+#include <map>
+#include <string>
+#include <vector>
+
+using namespace llvm;
+
+namespace {
+
+enum { Calls, Predicates, InsertedTaken, Dispatches, Routed, Substituted, NumKinds };
+
+struct FunctionCounts {
+    uint64_t counts[NumKinds] = {};
+};
+
+struct Row {
+    std::string name;
+    FunctionCounts counts;
+    double predicateCycles = 0;
+    double staticAdded = 0;
+    double addedCycles = 0;
+};
+
+bool readCounters(StringRef Path, std::map<std::string, FunctionCounts> &Out) {
+    auto Buffer = MemoryBuffer::getFile(Path);
+    if (!Buffer) {
+        errs() << "obf-counters: cannot read " << Path << ": " << Buffer.getError().message() << "\n";
+        return false;
+    }
+    SmallVector<StringRef, 0> Lines;
+    (*Buffer)->getBuffer().split(Lines, '\n', -1, false);
+    for (StringRef Line : Lines) {
+        if (Line.startswith("#")) {
+            continue;
+        }
+        SmallVector<StringRef, 8> Fields;
+        Line.split(Fields, ' ', -1, false);
+        if (Fields.size() != NumKinds + 1) {
+            errs() << "obf-counters: " << Path << ": malformed line: " << Line << "\n";
+            return false;
+        }
+        FunctionCounts &Counts = Out[Fields[0].str()];
+        for (unsigned Kind = 0; Kind < NumKinds; Kind++) {
+            uint64_t Value;
+            if (Fields[Kind + 1].getAsInteger(10, Value)) {
+                errs() << "obf-counters: " << Path << ": malformed line: " << Line << "\n";
+                return false;
+            }
+            Counts.counts[Kind] += Value;
+        }
+    }
+    return true;
+}
+
+// Optional's interface differs between LLVM versions; this works on both.
+double number(const json::Object &O, StringRef Key) {
+    if (auto V = O.getNumber(Key)) {
+        return *V;
+    }
+    return 0;
+}
+
+double perCall(double Count, uint64_t Calls) {
+    return Calls ? (double)Count / Calls : 0;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        errs() << "usage: obf-counters <report.json> <counters.txt>...\n";
+        return 1;
+    }
+
+    auto Buffer = MemoryBuffer::getFile(argv[1]);
+    if (!Buffer) {
+        errs() << "obf-counters: cannot read " << argv[1] << ": " << Buffer.getError().message() << "\n";
+        return 1;
+    }
+    Expected<json::Value> Report = json::parse((*Buffer)->getBuffer());
+    if (!Report) {
+        errs() << "obf-counters: " << argv[1] << ": " << toString(Report.takeError()) << "\n";
+        return 1;
+    }
+    const json::Object *Root = Report->getAsObject();
+    const json::Array *Functions = Root ? Root->getArray("functions") : nullptr;
+    if (!Functions) {
+        errs() << "obf-counters: " << argv[1] << " is not a -report-format=json report\n";
+        return 1;
+    }
+    double CallCycles = 0;
+    if (const json::Object *Options = Root->getObject("options")) {
+        CallCycles = number(*Options, "indirect_call_cycles");
+    }
+
+    std::map<std::string, FunctionCounts> Counts;
+    for (int i = 2; i < argc; i++) {
+        if (!readCounters(argv[i], Counts)) {
+            return 1;
+        }
+    }
+
+    std::vector<Row> Rows;
+    for (const json::Value &V : *Functions) {
+        const json::Object *F = V.getAsObject();
+        if (!F) {
+            continue;
+        }
+        auto Name = F->getString("name");
+        if (!Name || !Counts.count(Name->str())) {
+            continue;
+        }
+        Row R;
+        R.name = Name->str();
+        R.counts = Counts[R.name];
+        R.predicateCycles = number(*F, "predicate_cycles");
+        R.staticAdded = number(*F, "cost_after") - number(*F, "cost_before");
+        const uint64_t *C = R.counts.counts;
+        R.addedCycles = C[Predicates] * R.predicateCycles + C[Routed] * CallCycles + C[Substituted];
+        Rows.push_back(R);
+    }
+    std::sort(Rows.begin(), Rows.end(), [](const Row &A, const Row &B) { return A.addedCycles > B.addedCycles; });
+
+    double Total = 0;
+    for (const Row &R : Rows) {
+        Total += R.addedCycles;
+    }
+    outs() << "Function                         Calls  Pred/call Disp/call Route/call Subst/call  Cycles/call  Static/call  Share\n";
+    for (const Row &R : Rows) {
+        const uint64_t *C = R.counts.counts;
+        char Line[256];
+        std::snprintf(Line, sizeof(Line), "%-28.28s %9llu %10.1f %9.1f %10.1f %10.1f %12.1f %12.1f %5.1f%%\n",
+                      R.name.c_str(), (unsigned long long)C[Calls], perCall(C[Predicates], C[Calls]),
+                      perCall(C[Dispatches], C[Calls]), perCall(C[Routed], C[Calls]), perCall(C[Substituted], C[Calls]),
+                      perCall(R.addedCycles, C[Calls]), R.staticAdded, Total > 0 ? 100 * R.addedCycles / Total : 0);
+        outs() << Line;
+    }
+    char Line[128];
+    std::snprintf(Line, sizeof(Line), "Total added cycles: %.0f%s\n", Total,
+                  CallCycles > 0 ? "" : " (routed sites not priced: report has no -indirect-call-cycles)");
+    outs() << Line;
+
+    // Bogus blocks and fake loops sit behind always-false predicates; any
+    // entry means a predicate is broken.
+    int Broken = 0;
+    for (const Row &R : Rows) {
+        if (R.counts.counts[InsertedTaken] > 0) {
+            errs() << "error: " << R.name << ": inserted path taken " << R.counts.counts[InsertedTaken] << " times\n";
+            Broken++;
+        }
+    }
+    return Broken ? 2 : 0;
+}
@@ -0,0 +1,364 @@
+// obf-fuzzgen: print a random, well-defined C program for differential
+// testing of the obfuscator (see benchmarks/run_fuzz.sh).
+//
+//   obf-fuzzgen <seed> [work]
+//
+// The program computes a hash over a set of generated functions and prints
+// it; the low bits are also its exit status. Everything is well defined:
+// only unsigned arithmetic (signed values appear only in comparisons and
+// right shifts), shift counts masked to 0-31, divisors forced odd, array
+// indices masked to the array size, constant loop trip counts and no
+// recursion. Any difference between the plain and the obfuscated build is
+// therefore a miscompile.
+//
+// Functions only call lower-numbered functions, and each call is charged
+// its callee's estimated cost, so one call of the last function costs at
+// most MaxCost operations. main repeats it `work` / cost times (default
+// work 1000000000); the estimate counts every branch of every if and
+// switch, so plain -O2 builds run for a few to a few tens of milliseconds,
+// enough to compare run times. The same seed always prints the same
+// program.
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+namespace {
+
+const unsigned NumFunctions = 8;
+const unsigned NumLocals = 4;
+const unsigned GlobalSize = 16;
+const unsigned LocalArraySize = 8;
+const unsigned NumStrings = 4;
+const unsigned MaxDepth = 3;
+const unsigned MaxStatements = 6;
+const uint64_t MaxCost = 20000;
+
+// SplitMix64: small, and unlike <random>'s distributions it produces the
+// same sequence with every standard library.
+struct Rng {
+    uint64_t state;
+
+    uint64_t next() {
+        uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+    }
+
+    unsigned below(unsigned n) { return (unsigned)(next() % n); }
+
+    bool chance(unsigned percent) { return below(100) < percent; }
+};
+
+std::string hex(uint32_t Value) {
+    char Buffer[16];
+    std::snprintf(Buffer, sizeof(Buffer), "0x%08xu", Value);
+    return Buffer;
+}
+
+class Generator {
+public:
+    Generator(uint64_t Seed) : rng{Seed} {}
+
+    void run(uint64_t Seed, uint64_t Work) {
+        std::printf("// obf-fuzzgen %llu\n", (unsigned long long)Seed);
+        std::printf("#include <stdint.h>\n#include <stdio.h>\n\n");
+        std::printf("#ifdef __cplusplus\nextern \"C\" {\n#endif\n\n");
+
+        std::printf("uint32_t g[%u] = {", GlobalSize);
+        for (unsigned i = 0; i < GlobalSize; i++) {
+            std::printf("%s%s", i ? ", " : "", hex((uint32_t)rng.next()).c_str());
+        }
+        std::printf("};\nuint32_t gs = %s;\n", hex((uint32_t)rng.next()).c_str());
+        std::printf("static const char *const msg[%u] = {", NumStrings);
+        for (unsigned i = 0; i < NumStrings; i++) {
+            std::printf("%s\"", i ? ", " : "");
+            for (unsigned c = 0; c < 4 + rng.below(12); c++) {
+                std::printf("%c", 'a' + rng.below(26));
+            }
+            std::printf("\"");
+        }
+        std::printf("};\n\n");
+
+        for (unsigned f = 0; f < NumFunctions; f++) {
+            function(f);
+        }
+
+        // Indirect calls through a table of the functions generated so far.
+        std::printf("typedef uint32_t (*fn_t)(uint32_t, uint32_t);\n");
+        std::printf("fn_t table[%u] = {", NumFunctions);
+        for (unsigned f = 0; f < NumFunctions; f++) {
+            std::printf("%sf%u", f ? ", " : "", f);
+        }
+        std::printf("};\n\n");
+
+        uint64_t PerRep = cost.back() + *std::max_element(cost.begin(), cost.end()) + 10;
+        uint64_t Reps = Work / PerRep ? Work / PerRep : 1;
+        std::printf("volatile uint32_t input = %s;\n\n", hex((uint32_t)rng.next()).c_str());
+        std::printf("int main(void) {\n");
+        std::printf("    uint32_t h = 2166136261u ^ input;\n");
+        std::printf("    for (uint32_t r = 0; r < %lluu; r++) {\n", (unsigned long long)Reps);
+        std::printf("        h = (h ^ f%u(r, h)) * 16777619u;\n", NumFunctions - 1);
+        std::printf("        h ^= table[h & %u](h, r);\n", NumFunctions - 1);
+        std::printf("    }\n");
+        std::printf("    for (uint32_t i = 0; i < %u; i++) {\n", GlobalSize);
+        std::printf("        h = (h ^ g[i]) * 16777619u;\n");
+        std::printf("    }\n");
+        std::printf("    h ^= gs;\n");
+        std::printf("    printf(\"%%s %%08x\\n\", msg[h & %u], h);\n", NumStrings - 1);
+        std::printf("    return (int)(h & 0x7f);\n");
+        std::printf("}\n\n");
+        std::printf("#ifdef __cplusplus\n}\n#endif\n");
+    }
+
+private:
+    Rng rng;
+    // Estimated operations per call of each generated function. The table
+    // in main may call any of them, so only their maximum matters there.
+    std::vector<uint64_t> cost;
+    unsigned current = 0;
+    unsigned loopDepth = 0;
+    unsigned indent = 1;
+    // Cost of the statement or expression being generated, scaled by the
+    // trip counts of the enclosing loops.
+    uint64_t spent = 0;
+    uint64_t scale = 1;
+
+    void line(const std::string &Text) {
+        std::printf("%*s%s\n", indent * 4, "", Text.c_str());
+    }
+
+    // Locals declared so far; initializers may only read earlier ones.
+    unsigned declared = NumLocals;
+
+    std::string local() {
+        if (!declared) {
+            return rng.chance(50) ? "a" : "b";
+        }
+        return "v" + std::to_string(rng.below(declared));
+    }
+
+    std::string operand() {
+        switch (rng.below(7)) {
+        case 0:
+            return hex((uint32_t)rng.next());
+        case 1:
+            return std::to_string(rng.below(64)) + "u";
+        case 2:
+            return rng.chance(50) ? "a" : "b";
+        case 3:
+            return "gs";
+        case 4:
+            if (loopDepth) {
+                return "i" + std::to_string(rng.below(loopDepth));
+            }
+            return local();
+        default:
+            return local();
+        }
+    }
+
+    std::string expr(unsigned Depth = 0) {
+        spent += scale;
+        if (Depth >= MaxDepth || rng.chance(25)) {
+            return operand();
+        }
+        std::string A = expr(Depth + 1);
+        std::string B = expr(Depth + 1);
+        switch (rng.below(16)) {
+        case 0:
+            return "(" + A + " + " + B + ")";
+        case 1:
+            return "(" + A + " - " + B + ")";
+        case 2:
+            return "(" + A + " * " + B + ")";
+        case 3:
+            return "(" + A + " ^ " + B + ")";
+        case 4:
+            return "(" + A + " & " + B + ")";
+        case 5:
+            return "(" + A + " | " + B + ")";
+        case 6:
+            return "(" + A + " << (" + B + " & 31u))";
+        case 7:
+            return "(" + A + " >> (" + B + " & 31u))";
+        case 8:
+            return "(uint32_t)((int32_t)" + A + " >> (" + B + " & 31u))";
+        case 9:
+            return "(" + A + " / (" + B + " | 1u))";
+        case 10:
+            return "(" + A + " % (" + B + " | 1u))";
+        case 11: {
+            static const char *const Ops[] = {"<", "<=", "==", "!=", ">", ">="};
+            std::string Op = Ops[rng.below(6)];
+            if (rng.chance(50)) {
+                return "(uint32_t)((int32_t)" + A + " " + Op + " (int32_t)" + B + ")";
+            }
+            return "(uint32_t)(" + A + " " + Op + " " + B + ")";
+        }
+        case 12:
+            return "(" + condition(Depth + 1) + " ? " + A + " : " + B + ")";
+        case 13:
+            return "g[" + A + " & " + std::to_string(GlobalSize - 1) + "u]";
+        case 14:
+            return "(uint32_t)(((uint64_t)" + A + " * " + B + ") >> 32)";
+        default:
+            return "(uint32_t)(unsigned char)msg[" + A + " & " + std::to_string(NumStrings - 1) + "u][0] + " + B;
+        }
+    }
+
+    std::string condition(unsigned Depth) {
+        static const char *const Ops[] = {"<", "==", "!=", ">"};
+        std::string Cond = expr(Depth) + " " + Ops[rng.below(4)] + " " + expr(Depth);
+        if (rng.chance(20)) {
+            Cond = "(" + Cond + ") && (" + expr(Depth) + " & 1u)";
+        }
+        return Cond;
+    }
+
+    void block(unsigned Statements) {
+        for (unsigned s = 0; s < Statements; s++) {
+            statement();
+        }
+    }
+
+    void statement() {
+        unsigned Kind = rng.below(10);
+        if (spent > MaxCost / 2) {
+            Kind = 0;
+        }
+        switch (Kind) {
+        case 1:
+        case 2: {
+            line("if (" + condition(0) + ") {");
+            indent++;
+            block(1 + rng.below(3));
+            indent--;
+            if (rng.chance(50)) {
+                line("} else {");
+                indent++;
+                block(1 + rng.below(3));
+                indent--;
+            }
+            line("}");
+            break;
+        }
+        case 3: {
+            if (loopDepth >= 2) {
+                line(local() + " += " + expr() + ";");
+                break;
+            }
+            unsigned Trips = 1 + rng.below(16);
+            std::string Var = "i" + std::to_string(loopDepth);
+            line("for (uint32_t " + Var + " = 0; " + Var + " < " + std::to_string(Trips) + "u; " + Var + "++) {");
+            indent++;
+            loopDepth++;
+            scale *= Trips;
+            block(1 + rng.below(3));
+            scale /= Trips;
+            loopDepth--;
+            indent--;
+            line("}");
+            break;
+        }
+        case 4: {
+            line("switch (" + expr() + " & 7u) {");
+            unsigned Cases = 2 + rng.below(4);
+            for (unsigned c = 0; c < Cases; c++) {
+                line("case " + std::to_string(c) + ":");
+                indent++;
+                block(1 + rng.below(2));
+                if (rng.chance(70)) {
+                    line("break;");
+                }
+                indent--;
+            }
+            line("default:");
+            indent++;
+            block(1);
+            line("break;");
+            indent--;
+            line("}");
+            break;
+        }
+        case 5:
+            line("arr[" + expr() + " & " + std::to_string(LocalArraySize - 1) + "u] = " + expr() + ";");
+            break;
+        case 6:
+            line("g[" + expr() + " & " + std::to_string(GlobalSize - 1) + "u] ^= " + expr() + ";");
+            break;
+        case 7:
+            line(local() + " = arr[" + expr() + " & " + std::to_string(LocalArraySize - 1) + "u] + " + expr() + ";");
+            break;
+        case 8:
+            line("if (" + condition(0) + ") {");
+            line("    return " + expr() + ";");
+            line("}");
+            break;
+        case 9: {
+            // Calls are statements of their own: callees write g, and the
+            // order in which an expression's operands are evaluated is
+            // unspecified. The callee's whole cost is charged at the
+            // current loop scale.
+            if (!current) {
+                line(local() + " += " + expr() + ";");
+                break;
+            }
+            unsigned Callee = rng.below(current);
+            uint64_t Charge = cost[Callee] * scale;
+            if (spent + Charge > MaxCost) {
+                line(local() + " -= " + expr() + ";");
+                break;
+            }
+            spent += Charge;
+            line(local() + " ^= f" + std::to_string(Callee) + "(" + expr() + ", " + expr() + ");");
+            break;
+        }
+        default: {
+            static const char *const Ops[] = {"=", "+=", "-=", "^=", "*="};
+            line(local() + " " + Ops[rng.below(5)] + " " + expr() + ";");
+            break;
+        }
+        }
+    }
+
+    void function(unsigned Index) {
+        current = Index;
+        spent = 0;
+        std::printf("uint32_t f%u(uint32_t a, uint32_t b) {\n", Index);
+        for (unsigned v = 0; v < NumLocals; v++) {
+            declared = v;
+            line("uint32_t v" + std::to_string(v) + " = " + operand() + ";");
+        }
+        declared = NumLocals;
+        std::string Init;
+        for (unsigned i = 0; i < LocalArraySize; i++) {
+            Init += (i ? ", " : "") + hex((uint32_t)rng.next());
+        }
+        line("uint32_t arr[" + std::to_string(LocalArraySize) + "] = {" + Init + "};");
+        block(2 + rng.below(MaxStatements - 1));
+        std::string Result = "v0";
+        for (unsigned v = 1; v < NumLocals; v++) {
+            Result += " ^ v" + std::to_string(v);
+        }
+        line("return " + Result + " ^ arr[" + expr() + " & " + std::to_string(LocalArraySize - 1) + "u];");
+        std::printf("}\n\n");
+        cost.push_back(spent + 1);
+    }
+};
+
+} // namespace
+
+int main(int argc, char **argv) {
+    if (argc < 2 || argc > 3) {
+        std::fprintf(stderr, "usage: obf-fuzzgen <seed> [work]\n");
+        return 1;
+    }
+    uint64_t Seed = std::strtoull(argv[1], nullptr, 10);
+    uint64_t Work = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 1000000000;
+    Generator(Seed).run(Seed, Work);
+    return 0;
+}